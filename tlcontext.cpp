@@ -3,6 +3,20 @@
 // AFL License page: https://opensource.org/licenses/AFL-3.0
 
 #define TLCONTEXT_DEBUG 1
+#define TLCONTEXT_PROBES 1
+#define TLCONTEXT_VALUES 1
+#define TLCONTEXT_WORKERS 1
+#define TLCONTEXT_MEMORY 1
+#define TLCONTEXT_COROUTINES 1
+#define TLCONTEXT_NO_ALLOC 1
+#define TLCONTEXT_CLOCKS 1
+#define TLCONTEXT_SCHEDULER 1
+#define TLCONTEXT_PIPELINE 1
+#define TLCONTEXT_AUTOTUNE 1
+#define TLCONTEXT_EXECUTION 1
+#define TLCONTEXT_IO 1
+#define TLCONTEXT_NO_ALLOC_HOOK 1
+#define TLCONTEXT_MAX_COLD_TYPES 8
 #include "tlcontext.hpp"
 
 // Set up assertions.
@@ -24,9 +38,33 @@ using int_ctx = tlcontext::helper<int_ctx_data>;
 static void f0();
 static void f1();
 static void f2();
+static void static_init_client();
 static void client();
 static void fpa0();
 static void fpa1();
+static void kernel_client();
+static void hasher_client();
+static void snapshot_client();
+static void transaction_client();
+static void config_client();
+static void value_client();
+static void worker_client();
+static void pool_client();
+static void default_resource_client();
+static void context_allocator_client();
+static void scheduler_client();
+static void probes_client();
+static void io_client();
+static void output_client();
+static void no_alloc_client();
+static void clock_client();
+static void pipeline_client();
+static void autotune_client();
+static void shm_metrics_client();
+static void slab_client();
+static void coroutine_client();
+static void execution_client();
+static void cold_client();
 
 int main()
 {
@@ -60,9 +98,57 @@ int main()
     assert(int_ctx::get_global().value == 1);
     assert(int_ctx::get_top().value == 1);
 
+    static_init_client();
+
     client();
 
     fpa0();
+
+    kernel_client();
+
+    hasher_client();
+
+    snapshot_client();
+
+    transaction_client();
+
+    config_client();
+
+    value_client();
+
+    worker_client();
+
+    pool_client();
+
+    default_resource_client();
+
+    context_allocator_client();
+
+    scheduler_client();
+
+    probes_client();
+
+    io_client();
+
+    output_client();
+
+    no_alloc_client();
+
+    clock_client();
+
+    pipeline_client();
+
+    autotune_client();
+
+    shm_metrics_client();
+
+    slab_client();
+
+    coroutine_client();
+
+    execution_client();
+
+    cold_client();
 }
 
 void f0()
@@ -97,6 +183,47 @@ void f2()
     assert(int_ctx::get_top().value == 15);
 }
 
+//
+//
+//
+// Static initialization example
+// ----------------------------------------------------------------------------
+
+struct static_a_data
+{
+    int value;
+};
+
+struct static_b_data
+{
+    int value;
+};
+
+using static_a_ctx = tlcontext::helper<static_a_data>;
+using static_b_ctx = tlcontext::helper<static_b_data>;
+
+#ifndef TLCONTEXT_SLOT_ARRAY
+// Guards can be pushed from static initializers, which may run before any
+// other initializer of the library.
+static static_b_ctx::global_guard static_gb{7};
+static static_a_ctx::global_guard static_ga{42};
+#endif
+
+void static_init_client()
+{
+#ifndef TLCONTEXT_SLOT_ARRAY
+    assert(static_a_ctx::get_global().value == 42);
+    assert(static_b_ctx::get_top().value == 7);
+
+    static_a_ctx::local_guard lg{1};
+    assert(static_a_ctx::get_top().value == 1);
+
+    const tlcontext::context_snapshot snapshot = tlcontext::capture_all();
+    assert(snapshot.find<static_a_data>()->value == 1);
+    assert(snapshot.find<static_b_data>() == nullptr);
+#endif
+}
+
 //
 //
 //
@@ -104,10 +231,15 @@ void f2()
 // ----------------------------------------------------------------------------
 
 #include <chrono>
-#include <iostream>
+#include <memory_resource>
+#include <span>
 #include <string_view>
+#include <vector>
 
 using clock_type = std::chrono::steady_clock;
+using tlcontext::output_context;
+using tlcontext::pmr_context;
+using tlcontext::shm_metrics_context;
 
 struct metrics_ctx_data
 {
@@ -120,7 +252,9 @@ using metrics_ctx = tlcontext::helper<metrics_ctx_data>;
 class metrics_guard
 {
 private:
-    inline static int depth = 0;
+    // Nesting depth of the guards of the calling thread, which may be a
+    // pipeline worker.
+    inline static thread_local int depth = 0;
     metrics_ctx::local_guard guard;
 
 public:
@@ -128,6 +262,8 @@ public:
         : guard(label, clock_type::now())
     {
         ++depth;
+
+        TLCONTEXT_PROBE(metrics_begin, label.data(), label.size(), depth);
     }
 
     ~metrics_guard()
@@ -139,64 +275,135 @@ public:
             std::chrono::duration_cast<std::chrono::microseconds>(elapsed)
                 .count();
 
-        std::cout << std::string(depth * 4, '-') << " " << top.label << " took "
-                  << us << "us\n";
+        TLCONTEXT_PROBE(metrics_end, top.label.data(), top.label.size(), us);
+
+        if(shm_metrics_context::is_active())
+        {
+            shm_metrics_context::get_top().record(top.label, elapsed);
+        }
+
+        output_context::get_top()
+            .append('-', depth * 4)
+            .append(' ')
+            .append(top.label)
+            .append(" took ")
+            .append(us)
+            .append("us\n");
 
         --depth;
     }
 };
 
+// Particles of a spring simulation. Each step reads and writes distinct
+// fields, so that `step1a` and `step1b` can run concurrently.
+struct particle
+{
+    float x;
+    float v;
+    float a;
+    float energy;
+};
+
 struct simulator
 {
-    void step0()
+    static constexpr float k = 0.5f;
+    static constexpr float dt = 0.01f;
+
+    // Computes accelerations from positions.
+    void step0(std::span<particle> ps)
     {
-        // TODO
+        for(particle& p : ps)
+        {
+            p.a = -k * p.x;
+        }
     }
 
-    void step1a()
-    {}
+    // Integrates velocities.
+    void step1a(std::span<particle> ps)
+    {
+        for(particle& p : ps)
+        {
+            p.v += p.a * dt;
+        }
+    }
 
-    void step1b()
-    {}
+    // Computes potential energies, through scratch memory from the innermost
+    // `pmr_context`.
+    void step1b(std::span<particle> ps)
+    {
+        std::pmr::vector<float> squares(pmr_context::get_top()._mr);
+        squares.reserve(ps.size());
+
+        for(const particle& p : ps)
+        {
+            squares.push_back(p.x * p.x);
+        }
+
+        for(std::size_t i = 0; i < ps.size(); ++i)
+        {
+            ps[i].energy = 0.5f * k * squares[i];
+        }
+    }
 
-    void step1()
+    void step1(std::span<particle> ps)
     {
         {
             metrics_guard mg{"step1a"};
-            step1a();
+            step1a(ps);
         }
 
         {
             metrics_guard mg{"step1b"};
-            step1b();
+            step1b(ps);
         }
     }
 
-    void step2()
+    // Integrates positions.
+    void step2(std::span<particle> ps)
     {
-        // TODO
+        for(particle& p : ps)
+        {
+            p.x += p.v * dt;
+        }
     }
 };
 
+[[nodiscard]] static std::vector<particle> make_particles(std::size_t n)
+{
+    std::vector<particle> result(n);
+
+    for(std::size_t i = 0; i < n; ++i)
+    {
+        result[i].x = static_cast<float>(i) * 0.01f;
+    }
+
+    return result;
+}
+
 void client()
 {
     simulator s;
+    std::vector<particle> ps = make_particles(16);
 
+    // Reports are buffered, and written with a single system call when the
+    // sink exits.
+    output_context::local_guard og{STDOUT_FILENO};
+    pmr_context::local_guard ag{std::pmr::new_delete_resource()};
     metrics_guard mg{"client"};
 
     {
         metrics_guard mg{"step0"};
-        s.step0();
+        s.step0(ps);
     }
 
     {
         metrics_guard mg{"step1"};
-        s.step1();
+        s.step1(ps);
     }
 
     {
         metrics_guard mg{"step2"};
-        s.step2();
+        s.step2(ps);
     }
 }
 
@@ -211,13 +418,6 @@ void client()
 #include <iostream>
 #include <cstddef>
 
-struct pmr_context_data
-{
-    std::pmr::memory_resource* _mr;
-};
-
-using pmr_context = tlcontext::helper<pmr_context_data>;
-
 void fpa1()
 {
     std::pmr::memory_resource* mr = pmr_context::get_top()._mr;
@@ -246,3 +446,2264 @@ void fpa0()
         fpa1();
     }
 }
+
+//
+//
+//
+// Compile-time dispatch example
+// ----------------------------------------------------------------------------
+
+#include <csignal>
+#include <cstdio>
+#include <type_traits>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+enum class precision_mode
+{
+    low,
+    high,
+    exact
+};
+
+template <>
+inline constexpr std::size_t tlcontext::dispatch_cardinality<precision_mode> =
+    3;
+
+struct kernel_ctx_data
+{
+    bool validate;
+    precision_mode precision;
+};
+
+using kernel_ctx = tlcontext::helper<kernel_ctx_data>;
+
+static int kernel_sum(const std::vector<int>& xs)
+{
+    return tlcontext::dispatch_on<kernel_ctx, &kernel_ctx_data::validate,
+        &kernel_ctx_data::precision>(
+        [&](auto validate, auto precision)
+        {
+            static_assert(std::is_same_v<decltype(validate()), bool>);
+
+            int sum = 0;
+
+            for(int x : xs)
+            {
+                if constexpr(validate)
+                {
+                    if(x < 0)
+                    {
+                        return -1;
+                    }
+                }
+
+                if constexpr(precision == precision_mode::low)
+                {
+                    sum += x / 2 * 2;
+                }
+                else if constexpr(precision == precision_mode::high)
+                {
+                    sum += x;
+                }
+                else
+                {
+                    sum += x * 2;
+                }
+            }
+
+            return sum;
+        });
+}
+
+void kernel_client()
+{
+    const std::vector<int> xs{1, 2, 3, -4};
+
+    kernel_ctx::global_guard gg{false, precision_mode::high};
+    assert(kernel_sum(xs) == 2);
+
+    {
+        kernel_ctx::local_guard lg{true, precision_mode::high};
+        assert(kernel_sum(xs) == -1);
+    }
+
+    {
+        kernel_ctx::local_guard lg{false, precision_mode::low};
+        assert(kernel_sum(xs) == 0);
+    }
+
+    {
+        kernel_ctx::local_guard lg{false, precision_mode::exact};
+        assert(kernel_sum(xs) == 4);
+    }
+
+    // Out-of-range values abort in every build mode.
+    std::fflush(stdout);
+
+    if(const pid_t child = ::fork(); child == 0)
+    {
+        kernel_ctx::local_guard lg{false, static_cast<precision_mode>(7)};
+        ::_exit(kernel_sum(xs));
+    }
+    else
+    {
+        int status;
+        ::waitpid(child, &status, 0);
+        assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+    }
+}
+
+//
+//
+//
+// Strategy context example
+// ----------------------------------------------------------------------------
+
+#include <cstdint>
+
+struct hasher_table
+{
+    std::uint64_t (*hash)(void*, std::string_view);
+
+    template <typename T>
+    static constexpr hasher_table make() noexcept
+    {
+        return {[](void* self, std::string_view s)
+            { return static_cast<T*>(self)->hash(s); }};
+    }
+};
+
+using hasher_ctx = tlcontext::strategy<hasher_table>;
+
+struct fnv1a_hasher
+{
+    std::uint64_t hash(std::string_view s) const noexcept
+    {
+        std::uint64_t result = 14695981039346656037ull;
+
+        for(char c : s)
+        {
+            result ^= static_cast<unsigned char>(c);
+            result *= 1099511628211ull;
+        }
+
+        return result;
+    }
+};
+
+struct length_hasher
+{
+    int calls = 0;
+
+    std::uint64_t hash(std::string_view s) noexcept
+    {
+        ++calls;
+        return s.size();
+    }
+};
+
+static std::uint64_t hash_with_fast_path(std::string_view s)
+{
+    if(fnv1a_hasher* h = hasher_ctx::get_if<fnv1a_hasher>())
+    {
+        return h->hash(s);
+    }
+
+    return hasher_ctx::invoke<&hasher_table::hash>(s);
+}
+
+void hasher_client()
+{
+    fnv1a_hasher fnv1a;
+    hasher_ctx::global_guard gg{fnv1a};
+
+    const std::uint64_t expected = fnv1a.hash("hello");
+    assert(hasher_ctx::invoke<&hasher_table::hash>("hello") == expected);
+    assert(hash_with_fast_path("hello") == expected);
+
+    {
+        length_hasher lh;
+        hasher_ctx::local_guard lg{lh};
+
+        assert(hasher_ctx::get_if<fnv1a_hasher>() == nullptr);
+        assert(hasher_ctx::get_if<length_hasher>() == &lh);
+
+        assert(hasher_ctx::invoke<&hasher_table::hash>("hello") == 5);
+        assert(hash_with_fast_path("hi") == 2);
+        assert(lh.calls == 2);
+    }
+
+    assert(hasher_ctx::get_if<fnv1a_hasher>() == &fnv1a);
+}
+
+//
+//
+//
+// Context propagation example
+// ----------------------------------------------------------------------------
+
+#include <thread>
+
+void snapshot_client()
+{
+    int_ctx::local_guard lg0(20);
+    kernel_ctx::local_guard lg1{true, precision_mode::low};
+
+    const tlcontext::context_snapshot snapshot = tlcontext::capture_all();
+
+    std::thread t{[&]
+        {
+            assert(int_ctx::get_top().value == 1);
+
+            {
+                tlcontext::snapshot_guard sg{snapshot};
+
+                assert(int_ctx::get_local().value == 20);
+                assert(kernel_ctx::get_local().precision ==
+                       precision_mode::low);
+
+                int_ctx::local_guard lg2(25);
+                assert(int_ctx::get_local().value == 25);
+            }
+
+            assert(int_ctx::get_top().value == 1);
+        }};
+
+    t.join();
+
+    assert(int_ctx::get_local().value == 20);
+}
+
+//
+//
+//
+// Tag context example
+// ----------------------------------------------------------------------------
+
+struct in_transaction
+{};
+
+using transaction_ctx = tlcontext::helper<in_transaction>;
+
+static_assert(sizeof(transaction_ctx::local_guard) == 1);
+
+static int nested_transactions(int depth)
+{
+    assert(tlcontext::is_active<in_transaction>());
+
+    if(depth == 0)
+    {
+        return 0;
+    }
+
+    transaction_ctx::local_guard lg;
+    return 1 + nested_transactions(depth - 1);
+}
+
+void transaction_client()
+{
+    assert(!tlcontext::is_active<in_transaction>());
+
+    {
+        transaction_ctx::local_guard lg;
+        assert(transaction_ctx::is_active());
+        assert(&transaction_ctx::get_local() == &transaction_ctx::get_top());
+
+        assert(nested_transactions(100) == 100);
+        assert(tlcontext::is_active<in_transaction>());
+
+        const tlcontext::context_snapshot snapshot = tlcontext::capture_all();
+
+        std::thread t{[&]
+            {
+                assert(!tlcontext::is_active<in_transaction>());
+
+                tlcontext::snapshot_guard sg{snapshot};
+                assert(tlcontext::is_active<in_transaction>());
+            }};
+
+        t.join();
+    }
+
+    assert(!tlcontext::is_active<in_transaction>());
+
+    {
+        transaction_ctx::global_guard gg;
+        assert(tlcontext::is_active<in_transaction>());
+    }
+
+    assert(!tlcontext::is_active<in_transaction>());
+}
+
+//
+//
+//
+// Overlay context example
+// ----------------------------------------------------------------------------
+
+#include <array>
+
+struct config_data
+{
+    int timeout_ms;
+    int retries;
+    std::array<char, 4096> endpoint;
+};
+
+using config_ctx = tlcontext::overlay<config_data, &config_data::timeout_ms,
+    &config_data::retries>;
+
+static_assert(sizeof(config_ctx::override_guard<&config_data::timeout_ms>) <
+              sizeof(config_data));
+
+static int request_timeout()
+{
+    return config_ctx::get<&config_data::timeout_ms>();
+}
+
+void config_client()
+{
+    config_ctx::global_guard gg{1000, 3, std::array<char, 4096>{'a'}};
+    assert(request_timeout() == 1000);
+    assert(config_ctx::get<&config_data::retries>() == 3);
+
+    {
+        config_ctx::override_guard<&config_data::timeout_ms> og0{50};
+        assert(request_timeout() == 50);
+        assert(config_ctx::get<&config_data::retries>() == 3);
+
+        {
+            config_ctx::override_guard<&config_data::retries> og1{0};
+            assert(request_timeout() == 50);
+            assert(config_ctx::get<&config_data::retries>() == 0);
+
+            config_ctx::override_guard<&config_data::timeout_ms> og2{10};
+            assert(request_timeout() == 10);
+            assert(config_ctx::base().timeout_ms == 1000);
+        }
+
+        assert(request_timeout() == 50);
+        assert(config_ctx::get<&config_data::retries>() == 3);
+    }
+
+    {
+        config_ctx::local_guard lg{2000, 5, std::array<char, 4096>{'b'}};
+        assert(request_timeout() == 2000);
+        assert(config_ctx::base().endpoint[0] == 'b');
+    }
+
+    assert(request_timeout() == 1000);
+    assert(config_ctx::base().endpoint[0] == 'a');
+}
+
+//
+//
+//
+// Ad-hoc value context example
+// ----------------------------------------------------------------------------
+
+#include <string>
+
+inline constinit tlcontext::value_key<int> request_id_key;
+inline constinit tlcontext::value_key<std::string> user_key;
+
+static std::string describe_request()
+{
+    const int* id = tlcontext::get_value(request_id_key);
+    const std::string* user = tlcontext::get_value(user_key);
+
+    return (user ? *user : "anonymous") + "#" +
+           (id ? std::to_string(*id) : "none");
+}
+
+void value_client()
+{
+    assert(describe_request() == "anonymous#none");
+
+    tlcontext::value_guard vg0{request_id_key, 42};
+    assert(describe_request() == "anonymous#42");
+
+    tlcontext::value_map captured;
+
+    {
+        tlcontext::value_guard vg1{user_key, "alice"};
+        assert(describe_request() == "alice#42");
+
+        {
+            tlcontext::value_guard vg2{request_id_key, 43};
+            assert(describe_request() == "alice#43");
+        }
+
+        assert(describe_request() == "alice#42");
+        captured = tlcontext::capture_values();
+    }
+
+    assert(describe_request() == "anonymous#42");
+
+    std::thread t{[captured]
+        {
+            assert(describe_request() == "anonymous#none");
+
+            tlcontext::value_guard vg{captured};
+            assert(describe_request() == "alice#42");
+        }};
+
+    t.join();
+
+    // Maps with many keys share structure with their predecessors.
+    std::vector<tlcontext::value_key<int>> keys(500);
+    std::vector<tlcontext::value_map> versions{tlcontext::value_map{}};
+
+    for(std::size_t i = 0; i < keys.size(); ++i)
+    {
+        versions.push_back(versions.back().with(keys[i], static_cast<int>(i)));
+    }
+
+    for(std::size_t v = 0; v < versions.size(); ++v)
+    {
+        for(std::size_t i = 0; i < keys.size(); ++i)
+        {
+            const int* x = versions[v].find(keys[i]);
+            assert(i < v ? (x != nullptr && *x == static_cast<int>(i))
+                         : x == nullptr);
+        }
+    }
+
+    // Maps released by thread-local or static destructors, after the node pool
+    // of their thread was closed, free their nodes directly.
+    static tlcontext::value_map exit_map;
+
+    std::thread{[]
+        {
+            thread_local tlcontext::value_map late;
+            late = tlcontext::value_map{}.with(request_id_key, 1).with(
+                user_key, "bob");
+
+            {
+                const tlcontext::value_map temporary =
+                    tlcontext::value_map{}.with(request_id_key, 2);
+            }
+
+            exit_map = late.with(request_id_key, 3);
+        }}.join();
+
+    assert(*exit_map.find(request_id_key) == 3);
+    assert(*exit_map.find(user_key) == "bob");
+}
+
+//
+//
+//
+// Worker context profile example
+// ----------------------------------------------------------------------------
+
+#include <atomic>
+#include <random>
+
+struct rng_ctx_data
+{
+    std::minstd_rand engine;
+};
+
+struct worker_id_ctx_data
+{
+    std::size_t index;
+};
+
+using rng_ctx = tlcontext::helper<rng_ctx_data>;
+using worker_id_ctx = tlcontext::helper<worker_id_ctx_data>;
+
+void worker_client()
+{
+    constexpr std::size_t worker_count = 4;
+    constexpr int tasks_per_worker = 100;
+
+    // Built once, and instantiated once per worker thread.
+    const tlcontext::worker_profile profile{
+        [](std::size_t i) { return worker_id_ctx_data{i}; },
+        [](std::size_t i)
+        {
+            // Later factories can read earlier contexts.
+            assert(worker_id_ctx::get_local().index == i);
+
+            return rng_ctx_data{
+                std::minstd_rand{static_cast<unsigned>(1000 + i)}};
+        }};
+
+    std::atomic<int> tasks_run{0};
+    std::vector<std::thread> workers;
+
+    const auto task = [&](std::size_t expected_index)
+    {
+        assert(worker_id_ctx::get_local().index == expected_index);
+        assert(rng_ctx::get_local().engine() != 0);
+
+        ++tasks_run;
+    };
+
+    for(std::size_t i = 0; i < worker_count; ++i)
+    {
+        workers.emplace_back(
+            [&, i]
+            {
+                profile.run(i,
+                    [&]
+                    {
+                        for(int t = 0; t < tasks_per_worker; ++t)
+                        {
+                            task(i);
+                        }
+                    });
+
+                assert(!worker_id_ctx::is_active());
+
+                // Pools whose start hooks cannot wrap the worker loop.
+                profile.install(i);
+
+                for(int t = 0; t < tasks_per_worker; ++t)
+                {
+                    task(i);
+                }
+            });
+    }
+
+    for(std::thread& w : workers)
+    {
+        w.join();
+    }
+
+    assert(tasks_run == worker_count * tasks_per_worker * 2);
+    assert(!worker_id_ctx::is_active());
+}
+
+//
+//
+//
+// Sharded pool resource example
+// ----------------------------------------------------------------------------
+
+static std::pmr::vector<int> make_numbers(int n)
+{
+    std::pmr::vector<int> result{pmr_context::get_top()._mr};
+
+    for(int i = 0; i < n; ++i)
+    {
+        result.push_back(i);
+    }
+
+    return result;
+}
+
+void pool_client()
+{
+    tlcontext::sharded_pool_resource pool;
+    pmr_context::global_guard gg{&pool};
+
+    std::vector<std::pmr::vector<int>> produced;
+
+    for(int i = 1; i <= 64; ++i)
+    {
+        produced.push_back(make_numbers(i));
+    }
+
+    // Blocks allocated on this thread are freed on other threads through the
+    // remote free list, and reused here afterwards.
+    std::thread consumer{[&]
+        {
+            std::vector<std::pmr::vector<int>> own;
+
+            for(int i = 0; i < 64; ++i)
+            {
+                own.push_back(make_numbers(i));
+                assert(own.back().size() == static_cast<std::size_t>(i));
+            }
+
+            produced.clear();
+        }};
+
+    consumer.join();
+
+    for(int i = 1; i <= 64; ++i)
+    {
+        const std::pmr::vector<int> v = make_numbers(i);
+        assert(v.size() == static_cast<std::size_t>(i) && v.back() == i - 1);
+    }
+
+    // Heaps of exited threads are adopted by new threads.
+    assert(pool.heap_count() == 2);
+
+    for(int i = 0; i < 4; ++i)
+    {
+        std::thread{[]
+            {
+                const std::pmr::vector<int> v = make_numbers(16);
+                assert(v.size() == 16);
+            }}
+            .join();
+    }
+
+    assert(pool.heap_count() == 2);
+
+    // Alternating between resources keeps using the same heaps.
+    tlcontext::sharded_pool_resource other_pool;
+
+    for(int i = 0; i < 64; ++i)
+    {
+        void* const a = pool.allocate(32, 8);
+        void* const b = other_pool.allocate(32, 8);
+        pool.deallocate(a, 32, 8);
+        other_pool.deallocate(b, 32, 8);
+    }
+
+    assert(pool.heap_count() == 2 && other_pool.heap_count() == 1);
+
+    // Large and over-aligned requests go to the upstream resource.
+    void* const big = pool.allocate(1u << 20, 64);
+    pool.deallocate(big, 1u << 20, 64);
+}
+
+//
+//
+//
+// Thread-scoped default resource example
+// ----------------------------------------------------------------------------
+
+class counting_resource : public std::pmr::memory_resource
+{
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        ++allocations;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(
+        void* p, std::size_t bytes, std::size_t alignment) override
+    {
+        ++deallocations;
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& rhs) const noexcept
+        override
+    {
+        return this == &rhs;
+    }
+
+public:
+    std::atomic<int> allocations{0};
+    std::atomic<int> deallocations{0};
+};
+
+void default_resource_client()
+{
+    tlcontext::context_default_resource* const dr =
+        tlcontext::install_context_default_resource();
+
+    assert(std::pmr::get_default_resource() == dr);
+    assert(tlcontext::install_context_default_resource() == dr);
+
+    counting_resource arena;
+    std::pmr::vector<int> outlives_scope;
+
+    {
+        pmr_context::local_guard lg{&arena};
+
+        // Containers constructed without an explicit resource use the arena.
+        std::pmr::vector<int> v{1, 2, 3};
+        assert(arena.allocations == 1);
+
+        // Other threads are not affected.
+        std::thread t{[&]
+            {
+                std::pmr::vector<int> other{1, 2, 3};
+                assert(arena.allocations == 1);
+            }};
+
+        t.join();
+
+        outlives_scope.push_back(4);
+        assert(arena.allocations == 2);
+    }
+
+    // Blocks are returned to the resource they came from, even if another
+    // context is active when they are freed.
+    {
+        counting_resource other_arena;
+        pmr_context::local_guard lg{&other_arena};
+
+        outlives_scope = std::pmr::vector<int>{};
+        assert(arena.deallocations == 2);
+        assert(other_arena.deallocations == 0);
+    }
+
+    // Pushed resources whose upstream is the default resource allocate their
+    // buffers from the fallback instead of from themselves.
+    {
+        std::pmr::monotonic_buffer_resource upstream_is_default;
+        assert(upstream_is_default.upstream_resource() == dr);
+
+        pmr_context::local_guard lg{&upstream_is_default};
+
+        std::pmr::vector<int> v{1, 2, 3};
+        v.resize(1000);
+        assert(v[0] == 1 && v[999] == 0);
+    }
+}
+
+//
+//
+//
+// Stateless context allocator example
+// ----------------------------------------------------------------------------
+
+#include <unordered_map>
+
+template <typename T>
+using ctx_vector = std::vector<T, tlcontext::context_allocator<T>>;
+
+using ctx_map = std::unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+    tlcontext::context_allocator<std::pair<const int, int>>>;
+
+static_assert(sizeof(ctx_vector<int>) == sizeof(std::vector<int>));
+static_assert(sizeof(std::pmr::vector<int>) > sizeof(std::vector<int>));
+
+void context_allocator_client()
+{
+    counting_resource arena;
+
+    {
+        pmr_context::local_guard lg{&arena};
+
+        ctx_vector<int> v{1, 2, 3};
+        assert(arena.allocations == 1);
+
+        ctx_map m;
+        m.emplace(1, 2);
+        assert(arena.allocations > 1);
+
+        const int before = arena.allocations;
+
+        // Containers of containers share the same stateless allocator.
+        ctx_vector<ctx_vector<int>> vv(2);
+        vv[0].push_back(1);
+        assert(arena.allocations == before + 2);
+    }
+
+    assert(arena.allocations == arena.deallocations);
+
+    // Blocks are returned to the resource they were allocated from, even
+    // when a context with a different resource is on top.
+    {
+        pmr_context::local_guard lg0{&arena};
+        ctx_vector<int> v{1, 2, 3};
+
+        {
+            counting_resource other;
+            pmr_context::local_guard lg1{&other};
+            v = ctx_vector<int>{};
+
+            assert(other.allocations == 0 && other.deallocations == 0);
+        }
+
+        assert(arena.allocations == arena.deallocations);
+
+        ctx_vector<int> w{1, 2, 3};
+
+        {
+            pmr_context::local_guard lg2{std::pmr::new_delete_resource()};
+            w.clear();
+            w.shrink_to_fit();
+        }
+
+        assert(arena.allocations == arena.deallocations);
+    }
+
+    assert(arena.allocations == arena.deallocations);
+}
+
+//
+//
+//
+// Priority scheduler example
+// ----------------------------------------------------------------------------
+
+#include <exception>
+#include <latch>
+
+using tlcontext::priority_context;
+
+void scheduler_client()
+{
+    constexpr std::size_t interactive = 0;
+    constexpr std::size_t batch = 1;
+
+    std::latch done{4};
+    std::atomic<int> failures{0};
+
+    const auto expect_priority = [&](std::size_t expected)
+    {
+        if(priority_context::get_top().level != expected)
+        {
+            ++failures;
+        }
+    };
+
+    {
+        tlcontext::priority_scheduler scheduler{2, 2};
+
+        // Without a priority context, tasks get the lowest priority.
+        scheduler.submit(
+            [&]
+            {
+                expect_priority(batch);
+                done.count_down();
+            });
+
+        {
+            priority_context::local_guard lg{interactive};
+
+            scheduler.submit(
+                [&]
+                {
+                    expect_priority(interactive);
+
+                    // Nested submissions inherit the priority of the task.
+                    scheduler.submit(
+                        [&]
+                        {
+                            expect_priority(interactive);
+                            done.count_down();
+                        });
+
+                    done.count_down();
+                });
+        }
+
+        {
+            priority_context::local_guard lg{batch};
+
+            scheduler.submit(
+                [&]
+                {
+                    expect_priority(batch);
+                    done.count_down();
+                });
+        }
+
+        done.wait();
+    }
+
+    // Levels past the last one are clamped to it.
+    {
+        tlcontext::priority_scheduler scheduler{2, 1};
+        std::latch clamped{1};
+
+        priority_context::local_guard lg{std::size_t{7}};
+
+        scheduler.submit(
+            [&]
+            {
+                expect_priority(batch);
+                clamped.count_down();
+            });
+
+        clamped.wait();
+    }
+
+    // Workers submitting into a full queue run the task themselves instead of
+    // waiting for a worker, which could be themselves.
+    std::atomic<int> ran{0};
+
+    {
+        tlcontext::priority_scheduler scheduler{1, 1, 3 /* rounded to 4 */};
+        std::latch submitted{1};
+
+        scheduler.submit(
+            [&]
+            {
+                for(int i = 0; i < 64; ++i)
+                {
+                    scheduler.submit([&] { ++ran; });
+                }
+
+                submitted.count_down();
+            });
+
+        submitted.wait();
+    }
+
+    assert(ran == 64);
+
+    // Exceptions thrown by tasks are kept by the scheduler, whose workers
+    // keep running tasks.
+    {
+        tlcontext::priority_scheduler scheduler{1, 1};
+        std::latch finished{2};
+
+        scheduler.submit(
+            [&]
+            {
+                finished.count_down();
+                throw 42;
+            });
+
+        scheduler.submit([&] { finished.count_down(); });
+        finished.wait();
+
+        // The worker may still be catching the exception.
+        std::exception_ptr error;
+
+        while(error == nullptr)
+        {
+            error = scheduler.take_exception();
+        }
+
+        try
+        {
+            std::rethrow_exception(error);
+        }
+        catch(int x)
+        {
+            assert(x == 42);
+        }
+
+        assert(scheduler.take_exception() == nullptr);
+    }
+
+    // Workers can install a worker profile before running any task.
+    {
+        const tlcontext::worker_profile profile{
+            [](std::size_t i) { return worker_id_ctx_data{i}; }};
+
+        std::atomic<int> installed{0};
+        std::latch checked{1};
+
+        {
+            tlcontext::priority_scheduler scheduler{1, 2,
+                [&](std::size_t i)
+                {
+                    profile.install(i);
+                    ++installed;
+                }};
+
+            scheduler.submit(
+                [&]
+                {
+                    if(worker_id_ctx::get_local().index >= 2)
+                    {
+                        ++failures;
+                    }
+
+                    checked.count_down();
+                });
+
+            checked.wait();
+        }
+
+        assert(installed == 2);
+    }
+
+    assert(failures == 0);
+    assert(!priority_context::is_active());
+}
+
+//
+//
+//
+// Static tracing probes example
+// ----------------------------------------------------------------------------
+
+#if defined(TLCONTEXT_HAS_PROBES) && defined(__linux__)
+
+#include <elf.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+// Returns the names of the `tlcontext` probes listed in the SDT notes of the
+// running executable, which a tracer would read to find them.
+static std::vector<std::string> read_probe_names()
+{
+    std::ifstream file{"/proc/self/exe", std::ios::binary};
+    const std::vector<char> image{std::istreambuf_iterator<char>{file}, {}};
+
+    const auto read = [&]<typename T>(std::size_t offset)
+    {
+        T x;
+        std::memcpy(&x, image.data() + offset, sizeof(T));
+        return x;
+    };
+
+    const auto header = read.operator()<Elf64_Ehdr>(0);
+    const auto section = [&](std::size_t i)
+    {
+        return read.operator()<Elf64_Shdr>(
+            header.e_shoff + i * header.e_shentsize);
+    };
+
+    const Elf64_Shdr names = section(header.e_shstrndx);
+    std::vector<std::string> result;
+
+    for(std::size_t i = 0; i < header.e_shnum; ++i)
+    {
+        const Elf64_Shdr notes = section(i);
+
+        if(std::string_view{image.data() + names.sh_offset + notes.sh_name} !=
+            ".note.stapsdt")
+        {
+            continue;
+        }
+
+        // Each note is a header, the padded owner "stapsdt", and a padded
+        // descriptor made of three addresses and three strings: the provider,
+        // the probe name and the argument format.
+        std::size_t offset = notes.sh_offset;
+        const std::size_t end = notes.sh_offset + notes.sh_size;
+
+        while(offset < end)
+        {
+            const auto note = read.operator()<Elf64_Nhdr>(offset);
+            const std::size_t desc = offset + sizeof(Elf64_Nhdr) +
+                                     ((note.n_namesz + 3) & ~std::size_t{3});
+
+            const char* provider = image.data() + desc + 3 * sizeof(Elf64_Addr);
+            const char* name = provider + std::strlen(provider) + 1;
+
+            if(note.n_type == 3 && std::string_view{provider} == "tlcontext")
+            {
+                result.emplace_back(name);
+            }
+
+            offset = desc + ((note.n_descsz + 3) & ~std::size_t{3});
+        }
+    }
+
+    return result;
+}
+
+void probes_client()
+{
+    const std::vector<std::string> probes = read_probe_names();
+
+    const auto has_probe = [&](std::string_view name)
+    { return std::find(probes.begin(), probes.end(), name) != probes.end(); };
+
+    // Guards and the metrics example define probes.
+    assert(has_probe("push"));
+    assert(has_probe("pop"));
+    assert(has_probe("metrics_begin"));
+    assert(has_probe("metrics_end"));
+}
+
+#else
+
+void probes_client()
+{}
+
+#endif
+
+//
+//
+//
+// Batched file I/O example
+// ----------------------------------------------------------------------------
+
+#include <cstdio>
+#include <stdexcept>
+
+using tlcontext::io_context;
+
+// Queues a write on the innermost batch, without knowing about its owner.
+static void append_record(int fd, std::int64_t offset, std::string_view text,
+    int& written)
+{
+    io_context::get_top().write(fd, text.data(), text.size(), offset,
+        [&written, size = text.size()](std::int64_t result)
+        {
+            assert(result == static_cast<std::int64_t>(size));
+            ++written;
+        });
+}
+
+void io_client()
+{
+    for(const tlcontext::io_backend backend :
+        {tlcontext::io_backend::automatic, tlcontext::io_backend::thread_pool})
+    {
+        std::FILE* const file = std::tmpfile();
+        const int fd = fileno(file);
+
+        // Writes are submitted together when the guard exits.
+        int written = 0;
+
+        {
+            io_context::local_guard lg{backend};
+
+            append_record(fd, 0, "alpha", written);
+            append_record(fd, 5, "omega", written);
+
+            assert(io_context::get_top().pending() == 2);
+            assert(written == 0);
+        }
+
+        assert(written == 2);
+
+        // Callbacks can queue follow-up operations, flushed in the same call.
+        char first[5];
+        char second[5];
+        std::int64_t bad_fd_result = 0;
+
+        {
+            io_context::local_guard lg{backend};
+            io_context::get_top().read(fd, first, 5, 0,
+                [&](std::int64_t result)
+                {
+                    assert(result == 5);
+                    io_context::get_top().read(fd, second, 5, 5,
+                        [](std::int64_t result) { assert(result == 5); });
+                });
+
+            io_context::get_top().read(-1, first, 5, 0,
+                [&](std::int64_t result) { bad_fd_result = result; });
+
+            io_context::get_top().flush();
+            assert(io_context::get_top().pending() == 0);
+        }
+
+        assert(std::string_view(first, 5) == "alpha");
+        assert(std::string_view(second, 5) == "omega");
+        assert(bad_fd_result == -EBADF);
+
+        // Flushing from a callback returns immediately, and the enclosing
+        // flush runs the operations queued by the callbacks afterwards.
+        {
+            char third[5];
+            int order = 0;
+            int nested_completed = 0;
+            int later_completed = 0;
+
+            io_context::local_guard lg{backend};
+
+            for(int i = 0; i < 2; ++i)
+            {
+                io_context::get_top().read(fd, first, 5, 0,
+                    [&](std::int64_t)
+                    {
+                        io_context::get_top().read(fd, third, 5, 5,
+                            [&](std::int64_t result)
+                            {
+                                assert(result == 5);
+                                nested_completed = ++order;
+                            });
+
+                        io_context::get_top().flush();
+                        ++order;
+                    });
+            }
+
+            io_context::get_top().read(fd, first, 5, 0,
+                [&](std::int64_t) { later_completed = ++order; });
+
+            io_context::get_top().flush();
+
+            assert(later_completed == 3);
+            assert(nested_completed == 5);
+            assert(std::string_view(third, 5) == "omega");
+        }
+
+        // Exceptions thrown by callbacks do not prevent the other callbacks
+        // from running, and are rethrown by `flush()`.
+        int completed = 0;
+
+        {
+            io_context::local_guard lg{backend};
+
+            for(int i = 0; i < 3; ++i)
+            {
+                io_context::get_top().read(fd, first, 5, 0,
+                    [&, i](std::int64_t)
+                    {
+                        ++completed;
+
+                        if(i == 1)
+                        {
+                            throw std::runtime_error{"callback failed"};
+                        }
+                    });
+            }
+
+            bool caught = false;
+
+            try
+            {
+                io_context::get_top().flush();
+            }
+            catch(const std::runtime_error&)
+            {
+                caught = true;
+            }
+
+            assert(caught && completed == 3);
+
+            // When the guard exits, they are discarded instead.
+            io_context::get_top().read(fd, first, 5, 0,
+                [&](std::int64_t)
+                {
+                    ++completed;
+                    throw std::runtime_error{"callback failed"};
+                });
+        }
+
+        assert(completed == 4);
+
+        std::fclose(file);
+    }
+}
+
+//
+//
+//
+// Buffered output sink example
+// ----------------------------------------------------------------------------
+
+#include <optional>
+
+void output_client()
+{
+    int fds[2];
+    [[maybe_unused]] const int rc = pipe(fds);
+    assert(rc == 0);
+
+    const auto drain = [&]
+    {
+        char buffer[256];
+        const ssize_t n = read(fds[0], buffer, sizeof(buffer));
+        return std::string(buffer, static_cast<std::size_t>(n));
+    };
+
+    {
+        output_context::local_guard og{fds[1]};
+
+        output_context::get_top().append("answer=").append(42).append(' ');
+        output_context::get_top().append(0.5).append('!', 2);
+
+        // Nothing is written until the sink is flushed or exits.
+        assert(output_context::get_top().buffered() == "answer=42 0.5!!");
+
+        // A nested sink on the same descriptor flushes the enclosing one
+        // first, so output stays ordered.
+        {
+            output_context::local_guard inner{fds[1]};
+            assert(drain() == "answer=42 0.5!!");
+
+            output_context::get_top().append("inner");
+        }
+
+        assert(drain() == "inner");
+        output_context::get_top().append(-7);
+    }
+
+    assert(drain() == "-7");
+
+    // Sinks own their buffers, so a global sink can outlive the thread that
+    // pushed it.
+    {
+        std::optional<output_context::global_guard> global;
+
+        std::thread{[&] { global.emplace(fds[1]); }}.join();
+
+        output_context::get_global().append("global");
+        assert(output_context::get_global().buffered() == "global");
+    }
+
+    assert(drain() == "global");
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+//
+//
+//
+// Allocation-free scope example
+// ----------------------------------------------------------------------------
+
+using tlcontext::no_alloc_guard;
+
+[[gnu::noinline]] static std::size_t make_label_length(std::size_t n)
+{
+    const std::string label(n, 'x');
+    return label.size();
+}
+
+void no_alloc_client()
+{
+    const std::size_t before = tlcontext::no_alloc_violations();
+
+    // Hot sections that do not allocate report nothing.
+    {
+        no_alloc_guard ng{"hot loop"};
+
+        int values[64];
+        for(int i = 0; i < 64; ++i)
+        {
+            values[i] = i * i;
+        }
+
+        assert(values[63] == 63 * 63);
+        assert(ng.allocations() == 0);
+    }
+
+    assert(tlcontext::no_alloc_violations() == before);
+
+    // An allocation is counted in every enclosing scope, and reported with
+    // the chain of labels.
+    {
+        no_alloc_guard outer{"request"};
+
+        {
+            no_alloc_guard inner{"parse"};
+            assert(make_label_length(100) == 100);
+            assert(inner.allocations() == 1);
+        }
+
+        assert(outer.allocations() == 1);
+
+        // Each guard reports its own count, even under nested guards.
+        no_alloc_guard nested{"respond"};
+        assert(outer.allocations() == 1 && nested.allocations() == 0);
+    }
+
+    assert(tlcontext::no_alloc_violations() == before + 1);
+
+    // Scopes propagated through snapshots count allocations of every thread.
+    {
+        std::optional<tlcontext::context_snapshot> snapshot;
+        std::latch captured{1};
+
+        const auto worker = [&]
+        {
+            captured.wait();
+
+            tlcontext::snapshot_guard sg{*snapshot};
+            assert(make_label_length(100) == 100);
+        };
+
+        std::thread workers[2]{std::thread{worker}, std::thread{worker}};
+
+        no_alloc_guard ng{"fan out"};
+        snapshot.emplace(tlcontext::capture_all());
+
+        const std::size_t captures = ng.allocations();
+        captured.count_down();
+
+        for(std::thread& t : workers)
+        {
+            t.join();
+        }
+
+        assert(ng.allocations() == captures + 2);
+    }
+
+    // Allocations outside of any guard are not checked.
+    const std::size_t after = tlcontext::no_alloc_violations();
+    assert(make_label_length(100) == 100);
+    assert(tlcontext::no_alloc_violations() == after);
+
+#if !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+    // Failed allocations call the new handler before throwing.
+    static bool handler_called = false;
+
+    std::set_new_handler(
+        []
+        {
+            handler_called = true;
+            std::set_new_handler(nullptr);
+        });
+
+    bool thrown = false;
+
+    try
+    {
+        static_cast<void>(::operator new(std::size_t{1} << 62));
+    }
+    catch(const std::bad_alloc&)
+    {
+        thrown = true;
+    }
+
+    assert(handler_called && thrown);
+#endif
+}
+
+//
+//
+//
+// Clock context example
+// ----------------------------------------------------------------------------
+
+using tlcontext::context_clock;
+
+// Cache entry expiring after a time-to-live, timestamped with `context_clock`.
+struct cache_entry
+{
+    int value;
+    context_clock::time_point expiry;
+
+    [[nodiscard]] bool expired() const noexcept
+    {
+        return context_clock::now() >= expiry;
+    }
+};
+
+[[nodiscard]] static cache_entry make_entry(int value)
+{
+    using namespace std::chrono_literals;
+    return {value, context_clock::now() + 100ms};
+}
+
+void clock_client()
+{
+    using namespace std::chrono_literals;
+
+    // Virtual clocks make time-dependent code deterministic.
+    {
+        tlcontext::virtual_clock clock;
+        tlcontext::clock_context::local_guard lg{clock.source()};
+
+        const cache_entry entry = make_entry(1);
+        assert(!entry.expired());
+
+        clock.advance(99ms);
+        assert(!entry.expired());
+
+        clock.advance(1ms);
+        assert(entry.expired());
+    }
+
+    // Cached clocks return the time of entry until refreshed.
+    {
+        tlcontext::cached_clock_guard cg;
+
+        const context_clock::time_point t0 = context_clock::now();
+        std::this_thread::sleep_for(1ms);
+        assert(context_clock::now() == t0);
+
+        cg.refresh();
+        assert(context_clock::now() > t0);
+    }
+
+    // Coarse and ticker clocks share the epoch of `steady_clock`.
+    {
+        tlcontext::coarse_clock_guard cg;
+
+        const auto delta = context_clock::now() - clock_type::now();
+        assert(delta < 1s && delta > -1s);
+    }
+
+    {
+        tlcontext::clock_ticker ticker{1ms};
+        tlcontext::clock_context::global_guard gg{ticker.source()};
+
+        const context_clock::time_point t0 = context_clock::now();
+        std::this_thread::sleep_for(10ms);
+        assert(context_clock::now() > t0);
+
+        const auto delta = context_clock::now() - clock_type::now();
+        assert(delta < 1s && delta > -1s);
+    }
+}
+
+//
+//
+//
+// Staged pipeline example
+// ----------------------------------------------------------------------------
+
+#include <numeric>
+#include <stdexcept>
+
+void pipeline_client()
+{
+    simulator s;
+
+    std::vector<particle> expected = make_particles(1000);
+    std::vector<particle> actual = expected;
+
+    {
+        pmr_context::local_guard ag{std::pmr::new_delete_resource()};
+
+        s.step0(expected);
+        s.step1a(expected);
+        s.step1b(expected);
+        s.step2(expected);
+    }
+
+    // The simulator steps as a graph: `step1a` and `step1b` both run after
+    // `step0`, concurrently, and `step2` after both.
+    std::atomic<int> failures{0};
+
+    const auto checked = [&](const char* name, auto step)
+    {
+        return [&failures, name, step](std::span<particle> batch)
+        {
+            // Stages run under their own stage and arena contexts.
+            if(std::string_view{tlcontext::stage_context::get_top().name} !=
+                    name ||
+                !pmr_context::is_active())
+            {
+                ++failures;
+            }
+
+            step(batch);
+        };
+    };
+
+    tlcontext::pipeline<particle> engine{2, 4};
+
+    const std::size_t s0 = engine.add_stage("step0",
+        checked("step0", [&](std::span<particle> b) { s.step0(b); }));
+
+    const std::size_t s1a = engine.add_stage("step1a",
+        checked("step1a", [&](std::span<particle> b) { s.step1a(b); }),
+        {s0});
+
+    const std::size_t s1b = engine.add_stage("step1b",
+        checked("step1b", [&](std::span<particle> b) { s.step1b(b); }),
+        {s0});
+
+    engine.add_stage("step2",
+        checked("step2", [&](std::span<particle> b) { s.step2(b); }),
+        {s1a, s1b});
+
+    engine.run(actual, 64);
+
+    assert(failures == 0);
+
+    for(std::size_t i = 0; i < actual.size(); ++i)
+    {
+        assert(actual[i].x == expected[i].x);
+        assert(actual[i].energy == expected[i].energy);
+    }
+
+    // Report per-stage timings and queue depths.
+    output_context::local_guard og{STDOUT_FILENO};
+    tlcontext::output_sink& out = output_context::get_top();
+
+    for(const tlcontext::stage_stats& st : engine.stats())
+    {
+        assert(st.batches == 16);
+        assert(st.items == 1000);
+
+        out.append(st.name)
+            .append(": ")
+            .append(st.batches)
+            .append(" batches, busy ")
+            .append(st.busy.count() / 1000)
+            .append("us, max queue depth ")
+            .append(st.max_queue_depth)
+            .append('\n');
+    }
+
+    // A throwing stage fails its batch only: later stages skip it, and `run`
+    // rethrows once every batch is done.
+    tlcontext::pipeline<int> fallible{2};
+    std::atomic<int> finished{0};
+
+    const std::size_t parse = fallible.add_stage("parse",
+        [](std::span<int> batch)
+        {
+            if(batch.front() == 8)
+            {
+                throw std::runtime_error{"bad batch"};
+            }
+        });
+
+    fallible.add_stage(
+        "store", [&](std::span<int> batch) { finished += batch.size(); },
+        {parse});
+
+    std::vector<int> numbers(32);
+    std::iota(numbers.begin(), numbers.end(), 0);
+
+    bool thrown = false;
+
+    try
+    {
+        fallible.run(numbers, 8);
+    }
+    catch(const std::runtime_error&)
+    {
+        thrown = true;
+    }
+
+    assert(thrown && finished == 24);
+
+    // The pipeline can run again afterwards.
+    fallible.run(numbers, 16);
+    assert(finished == 56);
+}
+
+//
+//
+//
+// Autotuning example
+// ----------------------------------------------------------------------------
+
+using tlcontext::autotune_context;
+
+// Processes a request with a tuned batch size, and a tuned block size for
+// each batch. Time is simulated: batches of 256 and blocks of 16 are fastest.
+static void tuned_request(tlcontext::virtual_clock& clock)
+{
+    using namespace std::chrono_literals;
+
+    const auto batch = tlcontext::tune("batch", {64, 256, 1024});
+    clock.advance(batch.value() == 256 ? 10us : 30us);
+
+    for(int i = 0; i < 2; ++i)
+    {
+        const auto block = tlcontext::tune("block", {16, 32});
+        clock.advance(block.value() == 16 ? 1us : 2us);
+    }
+}
+
+void autotune_client()
+{
+    using namespace std::chrono_literals;
+
+    tlcontext::virtual_clock clock;
+    tlcontext::clock_context::local_guard cg{clock.source()};
+
+    // Without a tuner, the first candidate is used.
+    {
+        const auto batch = tlcontext::tune("batch", {64, 256});
+        assert(batch.value() == 64);
+    }
+
+    const char* const filename = "tlcontext_autotune.txt";
+
+    {
+        autotune_context::local_guard tuner;
+
+        std::size_t picked_fastest = 0;
+
+        for(int i = 0; i < 200; ++i)
+        {
+            tuned_request(clock);
+        }
+
+        for(int i = 0; i < 100; ++i)
+        {
+            const auto batch = tlcontext::tune("batch", {64, 256, 1024});
+            picked_fastest += batch.value() == 256;
+            clock.advance(batch.value() == 256 ? 10us : 30us);
+        }
+
+        // The tuner converges, with rare exploration.
+        assert(picked_fastest > 80);
+
+        // Nested scopes are tuned by label path.
+        assert(autotune_context::get_top().best("batch") == 1);
+        assert(autotune_context::get_top().best("batch/block") == 0);
+        assert(!autotune_context::get_top().best("block").has_value());
+
+        assert(autotune_context::get_top().save(filename));
+    }
+
+    // Saved decisions give warm starts.
+    {
+        autotune_context::local_guard tuner;
+        assert(autotune_context::get_top().load(filename));
+
+        assert(autotune_context::get_top().best("batch") == 1);
+        assert(autotune_context::get_top().best("batch/block") == 0);
+    }
+
+    // Timings of scopes whose candidates changed while they ran, e.g. by a
+    // concurrent load, are dropped.
+    {
+        std::FILE* const file = std::fopen(filename, "w");
+        std::fputs("4\tmode\t2\t5\t1\t9\t1\n", file);
+        std::fclose(file);
+
+        autotune_context::local_guard tuner;
+
+        for(std::size_t i = 0; i < 3; ++i)
+        {
+            // Untried candidates are picked first, in order.
+            const auto mode = tlcontext::tune("mode", {1, 2, 3});
+            assert(mode.index() == i);
+
+            if(i == 2)
+            {
+                assert(autotune_context::get_top().load(filename));
+            }
+        }
+
+        assert(autotune_context::get_top().best("mode") == 0);
+    }
+
+    // Label paths may contain separators of the file format.
+    {
+        const char* const label = "tab\there\nnewline";
+
+        {
+            autotune_context::local_guard tuner;
+
+            for(int i = 0; i < 2; ++i)
+            {
+                const auto mode = tlcontext::tune(label, {1, 2});
+                clock.advance(mode.value() == 2 ? 10us : 30us);
+            }
+
+            assert(autotune_context::get_top().best(label) == 1);
+            assert(autotune_context::get_top().save(filename));
+        }
+
+        autotune_context::local_guard tuner;
+        assert(autotune_context::get_top().load(filename));
+        assert(autotune_context::get_top().best(label) == 1);
+    }
+
+    // Files with a malformed line change no decision.
+    {
+        std::FILE* const file = std::fopen(filename, "w");
+        std::fputs("4\tmode\t2\t5\t1\t9\t1\n4\tmode\t2\t5\n", file);
+        std::fclose(file);
+
+        autotune_context::local_guard tuner;
+        assert(!autotune_context::get_top().load(filename));
+        assert(!autotune_context::get_top().best("mode").has_value());
+    }
+
+    std::remove(filename);
+}
+
+//
+//
+//
+// Shared-memory metrics example
+// ----------------------------------------------------------------------------
+
+#include <string>
+
+#include <sys/wait.h>
+
+void shm_metrics_client()
+{
+    using namespace std::chrono_literals;
+
+    const std::string name =
+        "/tlcontext_test_" + std::to_string(static_cast<long>(::getpid()));
+
+    // Missing regions are reported as invalid.
+    assert(!tlcontext::shm_metrics_reader{name.c_str()}.valid());
+
+    shm_metrics_context::local_guard mg{name, 4u};
+    tlcontext::shm_metrics& metrics = shm_metrics_context::get_local();
+    assert(metrics.available());
+
+    const tlcontext::shm_metrics_reader reader{name.c_str()};
+    assert(reader.valid());
+    assert(reader.pid() == static_cast<std::uint64_t>(::getpid()));
+    assert(reader.read().empty());
+
+    // Every thread records the same labels into its own slots.
+    const auto work = [&]
+    {
+        for(int i = 0; i < 100; ++i)
+        {
+            metrics.record("parse", 2us);
+        }
+
+        metrics.record("render", 5us);
+    };
+
+    std::thread t{work};
+    work();
+    t.join();
+
+    const std::vector<tlcontext::shm_metrics_entry> entries = reader.read();
+    assert(entries.size() == 2);
+
+    for(const tlcontext::shm_metrics_entry& e : entries)
+    {
+        if(e.label == "parse")
+        {
+            assert(e.count == 200);
+            assert(e.total_ns == 200 * 2000);
+            assert(e.max_ns == 2000);
+        }
+        else
+        {
+            assert(e.label == "render");
+            assert(e.count == 2);
+            assert(e.max_ns == 5000);
+        }
+    }
+
+    // Once the four slots are used, updates of new labels are dropped.
+    metrics.record("dropped", 1us);
+    assert(reader.dropped() == 1);
+
+    // The simulator publishes its metric scopes while the region is active.
+    {
+        shm_metrics_context::local_guard sg{name + "_sim"};
+        output_context::local_guard og{STDOUT_FILENO};
+
+        {
+            metrics_guard g{"published"};
+        }
+
+        const tlcontext::shm_metrics_reader sim{(name + "_sim").c_str()};
+        assert(sim.read().size() == 1);
+        assert(sim.read()[0].label == "published");
+        assert(sim.read()[0].count == 1);
+    }
+
+    // The region is removed with its owner.
+    assert(!tlcontext::shm_metrics_reader{(name + "_sim").c_str()}.valid());
+
+    // Live regions are never reinitialized by another writer.
+    {
+        const tlcontext::shm_metrics other{name};
+        assert(!other.available());
+    }
+
+    assert(reader.read().size() == 2 && reader.dropped() == 1);
+
+    // Evicting the cache entry of a label releases its slot, which the next
+    // update of that label claims again. The labels are as far apart as the
+    // per-thread cache is long, so they all probe the same entries.
+    {
+        constexpr std::size_t stride = 8 * 256;
+        constexpr std::size_t label_count = 9;
+
+        static char labels[label_count * stride];
+
+        for(std::size_t i = 0; i < label_count; ++i)
+        {
+            labels[i * stride] = 'x';
+        }
+
+        const auto label = [](std::size_t i)
+        { return std::string_view{labels + i * stride, 1}; };
+
+        const std::string evict_name = name + "_evict";
+        tlcontext::shm_metrics evicting{evict_name, 16u};
+
+        std::thread{
+            [&]
+            {
+                for(std::size_t i = 0; i < label_count - 1; ++i)
+                {
+                    evicting.record(label(i), 1us);
+                }
+
+                for(int round = 0; round < 100; ++round)
+                {
+                    evicting.record(label(label_count - 1), 1us);
+                    evicting.record(label(0), 1us);
+                }
+            }}
+            .join();
+
+        const tlcontext::shm_metrics_reader evicted{evict_name.c_str()};
+
+        assert(evicted.dropped() == 0);
+        assert(evicted.read().size() == 1);
+        assert(evicted.read()[0].count == label_count - 1 + 200);
+    }
+
+    // Regions left behind by exited processes are replaced.
+    const std::string stale_name = name + "_stale";
+
+    if(const pid_t child = ::fork(); child == 0)
+    {
+        tlcontext::shm_metrics* const leaked =
+            new tlcontext::shm_metrics{stale_name};
+
+        ::_exit(leaked->available() ? 0 : 1);
+    }
+    else
+    {
+        int status;
+        ::waitpid(child, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    {
+        const tlcontext::shm_metrics_reader left{stale_name.c_str()};
+        assert(left.valid());
+        assert(left.pid() != static_cast<std::uint64_t>(::getpid()));
+
+        const tlcontext::shm_metrics replacement{stale_name};
+        assert(replacement.available());
+
+        const tlcontext::shm_metrics_reader fresh{stale_name.c_str()};
+        assert(fresh.pid() == static_cast<std::uint64_t>(::getpid()));
+    }
+
+    assert(!tlcontext::shm_metrics_reader{stale_name.c_str()}.valid());
+}
+
+//
+//
+//
+// Out-of-line guard storage example
+// ----------------------------------------------------------------------------
+
+#include <pthread.h>
+
+// Context larger than the stack of the thread it is pushed on.
+struct large_ctx_data
+{
+    int value;
+    std::array<std::byte, 64 * 1024> scratch{};
+};
+
+using large_ctx = tlcontext::helper<large_ctx_data>;
+
+static void* slab_thread(void*)
+{
+    {
+        large_ctx::slab_guard g0{1};
+        assert(large_ctx::get_local().value == 1);
+
+        // Nested contexts span several slab chunks.
+        {
+            large_ctx::slab_guard g1{2};
+            large_ctx::slab_guard g2{3};
+            assert(large_ctx::get_local().value == 3);
+        }
+
+        assert(large_ctx::get_local().value == 1);
+
+        // Slab and stack guards of the same type nest.
+        int_ctx::local_guard g1{4};
+
+        {
+            int_ctx::slab_guard g2{5};
+            int_ctx::local_guard g3{6};
+            assert(int_ctx::get_local().value == 6);
+        }
+
+        assert(int_ctx::get_local().value == 4);
+    }
+
+    assert(!large_ctx::is_active());
+
+    // Released chunks are reused by later pushes.
+    const void* first;
+
+    {
+        large_ctx::slab_guard g{7};
+        first = &large_ctx::get_local();
+    }
+
+    large_ctx::slab_guard g{8};
+    assert(&large_ctx::get_local() == first);
+
+    return nullptr;
+}
+
+void slab_client()
+{
+    // The stack of the thread is too small to hold a `large_ctx_data`.
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 32 * 1024);
+
+    pthread_t thread;
+    assert(pthread_create(&thread, &attr, &slab_thread, nullptr) == 0);
+    assert(pthread_join(thread, nullptr) == 0);
+
+    pthread_attr_destroy(&attr);
+}
+
+//
+//
+//
+// Coroutine frame allocation example
+// ----------------------------------------------------------------------------
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+// Eagerly started coroutine producing an `int`, whose frame is allocated
+// through `context_promise_base`.
+class int_task
+{
+public:
+    struct promise_type : tlcontext::context_promise_base
+    {
+        int value;
+
+        int_task get_return_object() noexcept
+        {
+            return int_task{
+                std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_always final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_value(int x) noexcept
+        {
+            value = x;
+        }
+
+        void unhandled_exception() noexcept
+        {
+            std::terminate();
+        }
+    };
+
+private:
+    std::coroutine_handle<promise_type> _handle;
+
+    explicit int_task(std::coroutine_handle<promise_type> handle) noexcept
+        : _handle{handle}
+    {}
+
+public:
+    int_task(int_task&& rhs) noexcept
+        : _handle{std::exchange(rhs._handle, nullptr)}
+    {}
+
+    ~int_task()
+    {
+        if(_handle)
+        {
+            _handle.destroy();
+        }
+    }
+
+    [[nodiscard]] int get() const noexcept
+    {
+        return _handle.promise().value;
+    }
+};
+
+static int_task count_down(int depth)
+{
+    if(depth == 0)
+    {
+        co_return 0;
+    }
+
+    co_return count_down(depth - 1).get() + 1;
+}
+
+void coroutine_client()
+{
+    // Without a context, frames come from the per-thread cache.
+    assert(count_down(16).get() == 16);
+
+    counting_resource arena;
+    std::optional<int_task> outlives_scope;
+
+    {
+        pmr_context::local_guard lg{&arena};
+
+        assert(count_down(16).get() == 16);
+        assert(arena.allocations == 17);
+        assert(arena.deallocations == 17);
+
+        outlives_scope.emplace(count_down(0));
+        assert(arena.allocations == 18);
+    }
+
+    // Frames return to their resource under any context.
+    {
+        counting_resource other;
+        pmr_context::local_guard lg{&other};
+
+        outlives_scope.reset();
+        assert(arena.deallocations == 18);
+        assert(other.deallocations == 0);
+    }
+}
+
+//
+//
+//
+// Sender/receiver integration example
+// ----------------------------------------------------------------------------
+
+#include <stdexcept>
+
+namespace exec = tlcontext::exec;
+
+void execution_client()
+{
+    tlcontext::priority_scheduler pool{1, 1};
+    const exec::pool_scheduler sch{pool};
+
+    const std::thread::id caller = std::this_thread::get_id();
+
+    int_ctx::local_guard lg{42};
+
+    // Work scheduled on the pool does not see the caller's contexts...
+    const auto on_pool = exec::then(exec::schedule(sch),
+        [&]
+        {
+            assert(std::this_thread::get_id() != caller);
+            return int_ctx::is_active() ? int_ctx::get_top().value : 0;
+        });
+
+    assert(std::get<0>(*exec::sync_wait(on_pool)) != 42);
+
+    // ...unless it completes through `with_contexts`, which restores them
+    // around its completion, still on the pool.
+    const auto restored = exec::then(
+        tlcontext::with_contexts(exec::schedule(sch)),
+        [&]
+        {
+            assert(std::this_thread::get_id() != caller);
+            return int_ctx::get_local().value;
+        });
+
+    assert(std::get<0>(*exec::sync_wait(restored)) == 42);
+
+    // The contexts are captured at connect, not when the sender is created.
+    const auto late = exec::then(tlcontext::with_contexts(exec::just(1)),
+        [](int x) { return x + int_ctx::get_local().value; });
+
+    {
+        int_ctx::local_guard inner{100};
+        assert(std::get<0>(*exec::sync_wait(late)) == 101);
+    }
+
+    // The receiver environment exposes the captured contexts.
+    const auto [value] =
+        *exec::sync_wait(tlcontext::with_contexts(
+            tlcontext::read_context<int_ctx_data>()));
+
+    assert(value.value == 42);
+    assert(&value == &int_ctx::get_local());
+
+    // The previous contexts of the completing thread are restored.
+    {
+        int_ctx::local_guard inner{7};
+
+        const auto env_sender = exec::then(
+            tlcontext::with_contexts(tlcontext::read_context<int_ctx_data>()),
+            [](int_ctx_data& data) { return data.value; });
+
+        int_ctx::local_guard other{8};
+        assert(std::get<0>(*exec::sync_wait(env_sender)) == 8);
+        assert(int_ctx::get_local().value == 8);
+    }
+
+    // Errors propagate to `sync_wait`.
+    bool thrown = false;
+
+    try
+    {
+        static_cast<void>(exec::sync_wait(exec::then(exec::just(),
+            []() -> int { throw std::runtime_error{"failed"}; })));
+    }
+    catch(const std::runtime_error&)
+    {
+        thrown = true;
+    }
+
+    assert(thrown);
+}
+
+//
+//
+//
+// Cold context types example
+// ----------------------------------------------------------------------------
+
+// Rarely used context, whose local slot lives in the overflow table.
+struct cold_ctx_data
+{
+    int value;
+};
+
+template <>
+inline constexpr bool tlcontext::cold_context<cold_ctx_data> = true;
+
+using cold_ctx = tlcontext::helper<cold_ctx_data>;
+
+// Returns whether the calling thread has allocated its overflow table.
+[[nodiscard]] static bool has_cold_slots()
+{
+    return tlcontext::impl::local_cold_slots_if_allocated() != nullptr;
+}
+
+void cold_client()
+{
+#ifndef TLCONTEXT_SHARED
+    static_assert(tlcontext::impl::uses_cold_slot<cold_ctx_data>);
+#endif
+
+    cold_ctx::global_guard gg{1};
+
+    std::thread{[]
+        {
+            // Threads not using cold contexts never allocate the table, even
+            // when reading global cold contexts or propagating snapshots.
+            int_ctx::local_guard lg{2};
+            tlcontext::snapshot_guard sg{tlcontext::capture_all()};
+
+            assert(cold_ctx::get_top().value == 1);
+            assert(!has_cold_slots());
+        }}.join();
+
+    assert(cold_ctx::get_top().value == 1);
+
+    {
+        cold_ctx::local_guard lg{3};
+        assert(cold_ctx::get_local().value == 3);
+        assert(cold_ctx::get_top().value == 3);
+
+#ifndef TLCONTEXT_SHARED
+        assert(has_cold_slots());
+#endif
+
+        // Cold contexts propagate through snapshots.
+        const tlcontext::context_snapshot snapshot = tlcontext::capture_all();
+        assert(snapshot.find<cold_ctx_data>()->value == 3);
+
+        std::thread{[&]
+            {
+                tlcontext::snapshot_guard sg{snapshot};
+                assert(cold_ctx::get_local().value == 3);
+            }}.join();
+    }
+
+    assert(cold_ctx::get_top().value == 1);
+
+    // Guards destroyed at thread exit after the table was freed do not
+    // allocate it again.
+    std::thread{[]
+        {
+            thread_local std::optional<cold_ctx::local_guard> late;
+
+            {
+                cold_ctx::local_guard lg{4};
+            }
+
+            late.emplace(5);
+            assert(cold_ctx::get_local().value == 5);
+        }}.join();
+}
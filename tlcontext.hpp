@@ -15,19 +15,252 @@
 #include <cstdio>
 #endif
 
+//
+//
+//
+// Configuration
+// ----------------------------------------------------------------------------
+
+// With `TLCONTEXT_SLOT_ARRAY`, maximum number of distinct context types per
+// program, as every type occupies one pointer-sized slot in each thread's flat
+// slot array. Otherwise, maximum number of local context types simultaneously
+// active on a thread that `capture_all` can capture.
+#ifndef TLCONTEXT_MAX_TYPES
+#define TLCONTEXT_MAX_TYPES 64
+#endif
+
+// Maximum number of distinct context types marked as `cold_context`, whose
+// local slots live in a per-thread overflow table allocated on first use
+// instead of in static TLS that every new thread must allocate and zero.
+// Raising it does not grow static TLS. Ignored in shared library mode.
+#ifndef TLCONTEXT_MAX_COLD_TYPES
+#define TLCONTEXT_MAX_COLD_TYPES 0
+#endif
+
+// Define `TLCONTEXT_SHARED` in every binary of a program made of multiple
+// shared libraries, so that each context type has a single stack even with
+// `-fvisibility=hidden` or `-Bsymbolic`. The slots are then owned by the one
+// translation unit that also defines `TLCONTEXT_SHARED_OWNER`, and every other
+// binary resolves them once into cached pointers. Accesses from `dlopen`-ed
+// libraries cost one more load than in the owner (the TLS offset of the
+// cached pointer, through the GOT), e.g. about 2.5ns instead of 1.7ns per
+// `get_local` in `tlcontext_shared.cpp`.
+#if defined(TLCONTEXT_SHARED_OWNER) && !defined(TLCONTEXT_SHARED)
+#define TLCONTEXT_SHARED 1
+#endif
+
+// Define `TLCONTEXT_SLOT_ARRAY` to store the tops of all context types in flat
+// arrays indexed by dense type ids instead of in one variable per type, so
+// that `capture_all` and `restore_all` are a single copy instead of one
+// indirect call per type. Ids are assigned during dynamic initialization, so
+// accessors load the id before the slot, and guards must not be pushed from
+// static initializers. `TLCONTEXT_SHARED` implies it.
+#if defined(TLCONTEXT_SHARED) && !defined(TLCONTEXT_SLOT_ARRAY)
+#define TLCONTEXT_SLOT_ARRAY 1
+#endif
+
+// Define `TLCONTEXT_PROBES` to emit SystemTap SDT probes (usable by `perf`,
+// `bpftrace` and `stap`) when guards are pushed and popped. Every probe is a
+// single `nop` plus a `.note.stapsdt` entry describing its arguments, so no
+// tracer needs to be attached and no rebuild is needed to start tracing.
+
+// Define `TLCONTEXT_VALUES` to enable `value_map` and `value_guard`, which
+// carry ad-hoc values keyed by `value_key`s.
+
+// Define `TLCONTEXT_WORKERS` to enable `worker_profile`, which installs
+// per-worker contexts at the bottom of worker threads.
+
+// Define `TLCONTEXT_MEMORY` to enable `pmr_context` and the memory resources
+// and allocator built on it.
+
+// Define `TLCONTEXT_COROUTINES` to enable `context_promise_base`, which
+// allocates coroutine frames from the active `pmr_context`.
+
+// Define `TLCONTEXT_NO_ALLOC` to enable `no_alloc_guard`. Additionally define
+// `TLCONTEXT_NO_ALLOC_HOOK` in exactly one translation unit to replace the
+// global `operator new` with one that reports allocations made under a
+// `no_alloc_guard`, and `TLCONTEXT_NO_ALLOC_ABORT` there to abort on such
+// allocations, e.g. in test builds.
+
+// Define `TLCONTEXT_CLOCKS` to enable `context_clock` and its time sources.
+
+// Define `TLCONTEXT_IO` to enable `io_context`, which batches file reads and
+// writes through a per-thread `io_uring` on Linux, or a thread pool running
+// `pread` and `pwrite` elsewhere, `output_context`, which buffers text
+// output, and `shm_metrics_context`, which publishes metrics in shared memory.
+// It requires POSIX headers.
+
+// Define `TLCONTEXT_SCHEDULER` to enable `priority_scheduler`, a thread pool
+// with one lock-free queue per priority level.
+
+// Define `TLCONTEXT_PIPELINE` to enable `pipeline`, which runs graphs of stages
+// over batches of items on worker threads.
+
+// Define `TLCONTEXT_AUTOTUNE` to enable `autotuner` and `tuning_scope`, which
+// pick the fastest of several candidates separately for every calling context.
+
+// Define `TLCONTEXT_EXECUTION` to enable the minimal subset of `std::execution`
+// (P2300) in `tlcontext::exec`.
+
+// `TLCONTEXT_PIPELINE`, `TLCONTEXT_EXECUTION` and `TLCONTEXT_IO` are built on
+// the scheduler, and enable it.
+#if !defined(TLCONTEXT_SCHEDULER) &&                                           \
+    (defined(TLCONTEXT_PIPELINE) || defined(TLCONTEXT_EXECUTION) ||            \
+        defined(TLCONTEXT_IO))
+#define TLCONTEXT_SCHEDULER 1
+#endif
+
+// `TLCONTEXT_PIPELINE` and `TLCONTEXT_COROUTINES` are built on the memory
+// resources, `TLCONTEXT_AUTOTUNE` on the clocks, and `TLCONTEXT_NO_ALLOC_HOOK`
+// on `no_alloc_guard`, and they enable them.
+#if !defined(TLCONTEXT_MEMORY) &&                                              \
+    (defined(TLCONTEXT_PIPELINE) || defined(TLCONTEXT_COROUTINES))
+#define TLCONTEXT_MEMORY 1
+#endif
+
+#if defined(TLCONTEXT_AUTOTUNE) && !defined(TLCONTEXT_CLOCKS)
+#define TLCONTEXT_CLOCKS 1
+#endif
+
+#if defined(TLCONTEXT_NO_ALLOC_HOOK) && !defined(TLCONTEXT_NO_ALLOC)
+#define TLCONTEXT_NO_ALLOC 1
+#endif
+
+//
+//
+//
+// Standard library includes
+// ----------------------------------------------------------------------------
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+//
+//
+//
+// Shared library mode entry points
+// ----------------------------------------------------------------------------
+
+#ifdef TLCONTEXT_SHARED
+extern "C" {
+
+// Returns the id of the context type uniquely named by `key`, assigning the
+// next free id on first use. Aborts if `size` differs from the size the type
+// was first registered with, which means that distinct types share a name.
+[[gnu::visibility("default")]] std::size_t tlcontext_shared_register_type(
+    const char* key, std::size_t size) noexcept;
+
+// Returns the address of the number of registered context types.
+[[gnu::visibility("default")]] const std::atomic<std::size_t>*
+tlcontext_shared_type_count() noexcept;
+
+// Returns the flat array of global tops.
+[[gnu::visibility("default")]] void** tlcontext_shared_global_slots() noexcept;
+
+// Returns the flat array of local tops of the calling thread.
+[[gnu::visibility("default")]] void** tlcontext_shared_local_slots() noexcept;
+}
+#endif
+
+//
+//
+//
+// Static tracing probes
+// ----------------------------------------------------------------------------
+
+// `TLCONTEXT_PROBE(name, a1, a2, a3)` defines the probe `tlcontext:name` with
+// three arguments, each passed as a 64-bit unsigned integer. Guards fire
+// `push` and `pop` with the key of the type (see `impl::probe_type`), the
+// address of the context and whether the guard is local. `TLCONTEXT_HAS_PROBES`
+// is defined if probes are emitted.
+#if defined(TLCONTEXT_PROBES) && __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+
+#define TLCONTEXT_HAS_PROBES 1
+
+#define TLCONTEXT_PROBE(name, a1, a2, a3)                                      \
+    STAP_PROBE3(tlcontext, name, ::tlcontext::impl::probe_arg(a1),             \
+        ::tlcontext::impl::probe_arg(a2), ::tlcontext::impl::probe_arg(a3))
+
+#elif defined(TLCONTEXT_PROBES) && defined(__x86_64__) && defined(__GNUC__)
+
+// Minimal equivalent of `STAP_PROBE3` from `<sys/sdt.h>` (note version 3),
+// for systems without the SystemTap headers.
+#define TLCONTEXT_HAS_PROBES 1
+
+#define TLCONTEXT_PROBE(name, a1, a2, a3)                                      \
+    __asm__ __volatile__("990: nop\n"                                          \
+                         ".pushsection .note.stapsdt, \"?\", \"note\"\n"       \
+                         ".balign 4\n"                                         \
+                         ".4byte 992f-991f, 994f-993f, 3\n"                    \
+                         "991: .asciz \"stapsdt\"\n"                           \
+                         "992: .balign 4\n"                                    \
+                         "993: .8byte 990b\n"                                  \
+                         ".8byte _.stapsdt.base\n"                             \
+                         ".8byte 0\n"                                          \
+                         ".asciz \"tlcontext\"\n"                              \
+                         ".asciz \"" #name "\"\n"                              \
+                         ".asciz \"8@%[x1] 8@%[x2] 8@%[x3]\"\n"                \
+                         "994: .balign 4\n"                                    \
+                         ".popsection\n"                                       \
+                         ".ifndef _.stapsdt.base\n"                            \
+                         ".pushsection .stapsdt.base, \"aG\", \"progbits\", "  \
+                         ".stapsdt.base, comdat\n"                             \
+                         ".weak _.stapsdt.base\n"                              \
+                         ".hidden _.stapsdt.base\n"                            \
+                         "_.stapsdt.base: .space 1\n"                          \
+                         ".size _.stapsdt.base, 1\n"                           \
+                         ".popsection\n"                                       \
+                         ".endif\n"                                            \
+                         :                                                     \
+                         : [x1] "nor"(::tlcontext::impl::probe_arg(a1)),       \
+                         [x2] "nor"(::tlcontext::impl::probe_arg(a2)),         \
+                         [x3] "nor"(::tlcontext::impl::probe_arg(a3)))
+
+#else
+
+#define TLCONTEXT_PROBE(name, a1, a2, a3) static_cast<void>(0)
+
+#endif
+
 //
 //
 //
 // Implementation details (private API)
 // ----------------------------------------------------------------------------
 
-namespace tlcontext::impl {
+namespace tlcontext {
 
+// Whether contexts of type `T` are rarely used. Specialize this as `true` to
+// move the local slot of `T` out of static TLS into the overflow table (see
+// `TLCONTEXT_MAX_COLD_TYPES`), at the cost of two more loads per access.
 template <typename T>
-constinit inline T* global_top_ptr{nullptr};
+inline constexpr bool cold_context = false;
 
-template <typename T>
-constinit thread_local T* local_top_ptr{nullptr};
+} // namespace tlcontext
+
+namespace tlcontext::impl {
+
+// Terminates the program on unrecoverable misuse, which is checked in every
+// build mode where the check is off the hot path. The message is only printed
+// in debug mode.
+[[noreturn, gnu::cold]] inline void fatal([[maybe_unused]] const char* msg)
+    noexcept
+{
+#ifdef TLCONTEXT_DEBUG
+    std::printf("TLCONTEXT FATAL ERROR: '%s'\n", msg);
+    std::fflush(stdout);
+#endif
+
+    std::abort();
+}
 
 // Assertion functions, only available in debug mode.
 #ifdef TLCONTEXT_DEBUG
@@ -38,112 +271,6685 @@ inline void abort_if(bool predicate, const char* msg) noexcept
         return;
     }
 
-    std::printf("TLCONTEXT FATAL ERROR: '%s'\n", msg);
-    std::fflush(stdout);
-
-    std::abort();
+    fatal(msg);
 }
 #endif
 
-// RAII guard for `TType` contexts of type `T`.
-template <typename T, bool TLocal>
-class [[nodiscard]] guard
+// Converts an argument of `TLCONTEXT_PROBE` to a 64-bit unsigned integer.
+template <typename T>
+[[nodiscard, gnu::always_inline]] inline std::uint64_t probe_arg(
+    const T& x) noexcept
 {
-private:
-    T _data;
-    T* _prev;
-
-public:
-    template <typename... Ts>
-    [[nodiscard, gnu::always_inline]] explicit guard(Ts&&... xs) noexcept(
-        noexcept(T{static_cast<Ts&&>(xs)...}))
-        : _data{static_cast<Ts&&>(xs)...}
+    if constexpr(std::is_pointer_v<T>)
     {
-        T*& ptr_ref = (TLocal ? local_top_ptr<T> : global_top_ptr<T>);
-
-        _prev = ptr_ref;
-        ptr_ref = &_data;
+        return reinterpret_cast<std::uintptr_t>(x);
     }
-
-    [[gnu::always_inline]] ~guard() noexcept
+    else
     {
-        (TLocal ? local_top_ptr<T> : global_top_ptr<T>) = _prev;
+        return static_cast<std::uint64_t>(x);
     }
+}
 
-    guard(const guard&) = delete;
-    guard(guard&&) = delete;
+inline constexpr std::size_t max_types = TLCONTEXT_MAX_TYPES;
+inline constexpr std::size_t max_cold_types = TLCONTEXT_MAX_COLD_TYPES;
+
+// Size of the arrays of cold slots, which cannot be empty.
+inline constexpr std::size_t cold_slots_size =
+    max_cold_types == 0 ? 1 : max_cold_types;
+
+template <typename T>
+struct member_pointer_class;
+
+template <typename T, typename C>
+struct member_pointer_class<T C::*>
+{
+    using type = C;
 };
 
-} // namespace tlcontext::impl
+#ifndef TLCONTEXT_SHARED
 
-//
-//
-//
-// Public API
-// ----------------------------------------------------------------------------
+// Number of cold context types that have been assigned an index so far.
+constinit inline std::atomic<std::size_t> cold_type_count{0};
 
-namespace tlcontext {
+// Assigns the next index in the overflow tables, aborting in every build mode
+// rather than writing past them. This only runs once per cold type.
+[[nodiscard]] inline std::size_t register_cold_index() noexcept
+{
+    const std::size_t index =
+        cold_type_count.fetch_add(1, std::memory_order_relaxed);
+
+    if(index >= max_cold_types) [[unlikely]]
+    {
+        fatal("exceeded TLCONTEXT_MAX_COLD_TYPES");
+    }
+
+    return index;
+}
 
 template <typename T>
-struct helper
+inline constexpr bool uses_cold_slot = cold_context<T>;
+
+// Per-thread overflow table of the local tops of cold types. Only the table
+// pointer occupies static TLS.
+constinit inline thread_local void** local_cold_slots{nullptr};
+
+struct cold_slots_owner
 {
-    helper() = delete;
+    ~cold_slots_owner()
+    {
+        delete[] local_cold_slots;
+        local_cold_slots = nullptr;
+    }
+};
 
-    helper(const helper&) = delete;
-    helper(helper&&) = delete;
+inline thread_local cold_slots_owner cold_slots_owner_instance;
 
-    // A `local_guard` pushes a new context of type `T` on the thread-local
-    // stack on construction, and pops it on destruction.
-    using local_guard = impl::guard<T, true /* local */>;
+[[gnu::cold, gnu::noinline]] inline void** allocate_local_cold_slots()
+{
+    // Registers the release of the table on thread exit.
+    static_cast<void>(&cold_slots_owner_instance);
 
-    // A `global_guard` creates a new context of type `T` on the static buffer
-    // on construction, and destroys it on destruction.
-    using global_guard = impl::guard<T, false /* global */>;
+    local_cold_slots = new void*[cold_slots_size]{};
+    return local_cold_slots;
+}
 
-    // Returns the context on top of the thread-local stack. The behavior is
-    // undefined if there are no contexts of type `T` on the stack.
-    [[nodiscard, gnu::always_inline]] inline static T& get_local() noexcept
+[[nodiscard, gnu::always_inline]] inline std::size_t
+registered_cold_type_count() noexcept
+{
+    return cold_type_count.load(std::memory_order_relaxed);
+}
+
+// Returns the overflow table of the calling thread, allocating it if needed.
+[[nodiscard, gnu::always_inline]] inline void** local_cold_slots_base()
+{
+    void** const slots = local_cold_slots;
+
+    if(slots == nullptr) [[unlikely]]
     {
-        T* const ptr = impl::local_top_ptr<T>;
+        return allocate_local_cold_slots();
+    }
+
+    return slots;
+}
+
+[[nodiscard, gnu::always_inline]] inline void**
+local_cold_slots_if_allocated() noexcept
+{
+    return local_cold_slots;
+}
 
-#ifdef TLCONTEXT_DEBUG
-        impl::abort_if(ptr == nullptr, "tried using inactive local context");
 #endif
 
-        return *ptr;
+#ifndef TLCONTEXT_SLOT_ARRAY
+
+// Global and local tops of `T`. Their addresses are link-time constants, so
+// that every access is a single load, and guards can be pushed from static
+// initializers of any translation unit.
+template <typename T>
+constinit inline void* global_top{nullptr};
+
+template <typename T>
+constinit inline thread_local void* local_top{nullptr};
+
+// Descriptor of a context type, through which `capture_all` and `restore_all`
+// reach the local tops of every type that has guards.
+struct type_entry
+{
+    // Returns the local top of the calling thread. For cold types, returns
+    // null if the overflow table is not allocated and `allocate` is false.
+    void** (*local_top)(bool allocate);
+    const type_entry* next;
+};
+
+// Singly-linked list of the descriptors of all types, which only grows.
+constinit inline std::atomic<const type_entry*> type_registry{nullptr};
+
+[[nodiscard]] inline bool register_type_entry(type_entry& entry) noexcept
+{
+    entry.next = type_registry.load(std::memory_order_relaxed);
+
+    while(!type_registry.compare_exchange_weak(entry.next, &entry,
+        std::memory_order_release, std::memory_order_relaxed))
+    {
     }
 
-    // Returns the global context. The behavior is undefined if there is no
-    // global context of type `T`.
-    [[nodiscard, gnu::always_inline]] inline static T& get_global() noexcept
+    return true;
+}
+
+// Index of the local top of the cold type `T` in the overflow tables plus one,
+// or zero until the first access assigns it. Assigning lazily keeps cold
+// guards usable from static initializers.
+template <typename T>
+constinit inline std::atomic<std::size_t> cold_index_slot{0};
+
+constinit inline std::atomic<bool> cold_index_lock{false};
+
+[[gnu::cold, gnu::noinline]] inline std::size_t assign_cold_index(
+    std::atomic<std::size_t>& slot) noexcept
+{
+    while(cold_index_lock.exchange(true, std::memory_order_acquire))
     {
-        T* const ptr = impl::global_top_ptr<T>;
+    }
 
-#ifdef TLCONTEXT_DEBUG
-        impl::abort_if(ptr == nullptr, "tried using inactive global context");
-#endif
+    std::size_t value = slot.load(std::memory_order_relaxed);
 
-        return *ptr;
+    if(value == 0)
+    {
+        value = register_cold_index() + 1;
+        slot.store(value, std::memory_order_relaxed);
     }
 
-    // Either returns the local context on top of the stack or the global
-    // context, if there's no local context available. The behavior is undefined
-    // if neither a local nor a global context is available.
-    [[nodiscard, gnu::always_inline]] inline static T& get_top() noexcept
+    cold_index_lock.store(false, std::memory_order_release);
+    return value - 1;
+}
+
+template <typename T>
+[[nodiscard]] void** type_entry_local_top(bool allocate);
+
+template <typename T>
+constinit inline type_entry type_entry_instance{
+    &type_entry_local_top<T>, nullptr};
+
+// Links the descriptor of `T` into the registry during static initialization.
+// Guards only take its address, which costs nothing at run time.
+template <typename T>
+inline const bool type_registered =
+    register_type_entry(type_entry_instance<T>);
+
+template <typename T>
+[[nodiscard, gnu::always_inline]] inline std::size_t cold_slot_index() noexcept
+{
+    static_cast<void>(&type_registered<T>);
+
+    const std::size_t value =
+        cold_index_slot<T>.load(std::memory_order_relaxed);
+
+    if(value == 0) [[unlikely]]
     {
-        if(T* const local_ptr = impl::local_top_ptr<T>)
-        {
-            return *local_ptr;
-        }
+        return assign_cold_index(cold_index_slot<T>);
+    }
 
-        T* const global_ptr = impl::global_top_ptr<T>;
+    return value - 1;
+}
 
-#ifdef TLCONTEXT_DEBUG
-        impl::abort_if(global_ptr == nullptr, "no available context");
-#endif
+template <typename T>
+[[nodiscard, gnu::always_inline]] inline void*& local_hot_top() noexcept
+{
+    static_cast<void>(&type_registered<T>);
+    return local_top<T>;
+}
 
-        return *global_ptr;
+template <typename T>
+[[nodiscard, gnu::always_inline]] inline void*& global_hot_top() noexcept
+{
+    static_cast<void>(&type_registered<T>);
+    return global_top<T>;
+}
+
+// Global tops are not thread-local, so cold types need no overflow table.
+template <typename T>
+[[nodiscard, gnu::always_inline]] inline void*& global_cold_top() noexcept
+{
+    return global_hot_top<T>();
+}
+
+template <typename T>
+[[nodiscard]] void** type_entry_local_top(bool allocate)
+{
+    if constexpr(uses_cold_slot<T>)
+    {
+        void** const slots = allocate ? local_cold_slots_base()
+                                      : local_cold_slots_if_allocated();
+
+        return slots == nullptr ? nullptr : &slots[cold_slot_index<T>()];
     }
-};
+    else
+    {
+        return &local_top<T>;
+    }
+}
 
-} // namespace tlcontext
+// Key identifying `T` in tracing probes: the address of its descriptor.
+template <typename T>
+[[nodiscard, gnu::always_inline]] inline std::uintptr_t probe_type() noexcept
+{
+    return reinterpret_cast<std::uintptr_t>(&type_entry_instance<T>);
+}
+
+#elif !defined(TLCONTEXT_SHARED)
+
+// Number of context types that have been assigned an id so far. Atomic, as
+// libraries may be loaded concurrently with `dlopen`.
+constinit inline std::atomic<std::size_t> type_count{0};
+
+// Assigns the next id, aborting in every build mode rather than writing past
+// the slot arrays. This only runs once per type, during initialization.
+[[nodiscard]] inline std::size_t register_type() noexcept
+{
+    const std::size_t id = type_count.fetch_add(1, std::memory_order_relaxed);
+
+    if(id >= max_types) [[unlikely]]
+    {
+        fatal("exceeded TLCONTEXT_MAX_TYPES");
+    }
+
+    return id;
+}
+
+// Dense id of the context type `T`, assigned during dynamic initialization.
+// Guards must therefore not be pushed from other static initializers. Cold
+// types get ids from `max_types` onwards, so that ids stay unique.
+template <typename T>
+inline const std::size_t type_id =
+    uses_cold_slot<T> ? max_types + register_cold_index() : register_type();
+
+// Flat arrays of global and per-thread local tops, indexed by `type_id`.
+constinit inline void* global_slots[max_types]{};
+constinit inline thread_local void* local_slots[max_types]{};
+
+// Global tops of cold types, indexed by `type_id - max_types`.
+constinit inline void* global_cold_slots[cold_slots_size]{};
+
+[[nodiscard, gnu::always_inline]] inline std::size_t
+registered_type_count() noexcept
+{
+    return type_count.load(std::memory_order_relaxed);
+}
+
+[[nodiscard, gnu::always_inline]] inline void** global_slots_base() noexcept
+{
+    return global_slots;
+}
+
+[[nodiscard, gnu::always_inline]] inline void** local_slots_base() noexcept
+{
+    return local_slots;
+}
+
+#else
+
+// Returns whether the type named in `name` is in an anonymous namespace, and
+// is therefore distinct in every translation unit despite its name.
+[[nodiscard]] inline bool names_internal_type(const char* name) noexcept
+{
+    return std::strstr(name, "{anonymous}") != nullptr ||
+           std::strstr(name, "(anonymous namespace)") != nullptr;
+}
+
+// Writes `name` followed by `@` and the hexadecimal `discriminator` to `out`.
+inline void make_internal_key(char* out, const char* name, std::size_t size,
+    std::uintptr_t discriminator) noexcept
+{
+    std::memcpy(out, name, size);
+    out += size;
+    *out++ = '@';
+
+    for(int shift = sizeof(discriminator) * 8 - 4; shift >= 0; shift -= 4)
+    {
+        *out++ = "0123456789abcdef"[(discriminator >> shift) & 0xf];
+    }
+
+    *out = '\0';
+}
+
+// Name of `T` that is identical in every binary built by the same compiler.
+// Types in anonymous namespaces are additionally keyed by the address of a
+// variable that is distinct per translation unit, so that same-named types of
+// different translation units or binaries never share a slot. Other types
+// with the same name in different binaries are the same type, as required by
+// the one-definition rule; local classes are not supported.
+template <typename T>
+[[nodiscard]] const char* type_key() noexcept
+{
+    const char* const name = __PRETTY_FUNCTION__;
+
+    if(!names_internal_type(name)) [[likely]]
+    {
+        return name;
+    }
+
+    static char key[sizeof(__PRETTY_FUNCTION__) + 2 + 2 * sizeof(void*)];
+
+    make_internal_key(key, name, sizeof(__PRETTY_FUNCTION__) - 1,
+        reinterpret_cast<std::uintptr_t>(&key));
+
+    return key;
+}
+
+template <typename T>
+inline const std::size_t type_id =
+    tlcontext_shared_register_type(type_key<T>(), sizeof(T));
+
+// Cold types are not supported across binaries, so every type is hot.
+template <typename T>
+inline constexpr bool uses_cold_slot = false;
+
+constinit inline void* global_cold_slots[cold_slots_size]{};
+
+[[nodiscard, gnu::always_inline]] inline std::size_t
+registered_cold_type_count() noexcept
+{
+    return 0;
+}
+
+[[nodiscard, gnu::always_inline]] inline void** local_cold_slots_base()
+{
+    return nullptr;
+}
+
+[[nodiscard, gnu::always_inline]] inline void**
+local_cold_slots_if_allocated() noexcept
+{
+    return nullptr;
+}
+
+// Addresses of the owner's slots, resolved once per binary. The per-thread
+// cache uses the initial-exec model, which avoids a `__tls_get_addr` call in
+// `dlopen`-ed libraries at the cost of one pointer of static TLS surplus.
+inline const std::atomic<std::size_t>* const type_count_ptr =
+    tlcontext_shared_type_count();
+inline void** const global_slots = tlcontext_shared_global_slots();
+
+[[gnu::tls_model("initial-exec")]] constinit inline thread_local void**
+    local_slots_cache{nullptr};
+
+[[nodiscard, gnu::always_inline]] inline std::size_t
+registered_type_count() noexcept
+{
+    return type_count_ptr->load(std::memory_order_relaxed);
+}
+
+[[nodiscard, gnu::always_inline]] inline void** global_slots_base() noexcept
+{
+    return global_slots;
+}
+
+[[nodiscard, gnu::always_inline]] inline void** local_slots_base() noexcept
+{
+    void** slots = local_slots_cache;
+
+    if(slots == nullptr) [[unlikely]]
+    {
+        slots = local_slots_cache = tlcontext_shared_local_slots();
+    }
+
+    return slots;
+}
+
+#endif
+
+#ifdef TLCONTEXT_SLOT_ARRAY
+
+template <typename T>
+[[nodiscard, gnu::always_inline]] inline std::size_t cold_slot_index() noexcept
+{
+    return type_id<T> - max_types;
+}
+
+template <typename T>
+[[nodiscard, gnu::always_inline]] inline void*& local_hot_top() noexcept
+{
+    return local_slots_base()[type_id<T>];
+}
+
+template <typename T>
+[[nodiscard, gnu::always_inline]] inline void*& global_hot_top() noexcept
+{
+    return global_slots_base()[type_id<T>];
+}
+
+template <typename T>
+[[nodiscard, gnu::always_inline]] inline void*& global_cold_top() noexcept
+{
+    return global_cold_slots[cold_slot_index<T>()];
+}
+
+// Key identifying `T` in tracing probes: its dense id.
+template <typename T>
+[[nodiscard, gnu::always_inline]] inline std::size_t probe_type() noexcept
+{
+    return type_id<T>;
+}
+
+#endif
+
+// Returns the slot of `T`. The first access to the local slot of a cold type
+// on a thread allocates its overflow table, and terminates if that fails.
+template <typename T, bool TLocal>
+[[nodiscard, gnu::always_inline]] inline void*& top_slot() noexcept
+{
+    if constexpr(uses_cold_slot<T>)
+    {
+        static_assert(uses_cold_slot<T> && max_cold_types > 0,
+            "TLCONTEXT_MAX_COLD_TYPES is zero");
+
+        if constexpr(TLocal)
+        {
+            return local_cold_slots_base()[cold_slot_index<T>()];
+        }
+        else
+        {
+            return global_cold_top<T>();
+        }
+    }
+    else if constexpr(TLocal)
+    {
+        return local_hot_top<T>();
+    }
+    else
+    {
+        return global_hot_top<T>();
+    }
+}
+
+// Returns the value of the slot of `T`, without allocating an overflow table
+// for cold types.
+template <typename T, bool TLocal>
+[[nodiscard, gnu::always_inline]] inline void* top_value() noexcept
+{
+    if constexpr(uses_cold_slot<T> && TLocal)
+    {
+        void** const slots = local_cold_slots_if_allocated();
+        return slots == nullptr ? nullptr : slots[cold_slot_index<T>()];
+    }
+    else
+    {
+        return top_slot<T, TLocal>();
+    }
+}
+
+// Sets the slot of `T` to `value` when a guard pops. Guards popped by
+// thread-local destructors after the overflow table of the thread was freed
+// leave it freed, as no context of the thread can be read anymore.
+template <typename T, bool TLocal>
+[[gnu::always_inline]] inline void pop_slot(void* value) noexcept
+{
+    if constexpr(uses_cold_slot<T> && TLocal)
+    {
+        if(void** const slots = local_cold_slots_if_allocated()) [[likely]]
+        {
+            slots[cold_slot_index<T>()] = value;
+        }
+    }
+    else
+    {
+        top_slot<T, TLocal>() = value;
+    }
+}
+
+// RAII guard for `TType` contexts of type `T`.
+template <typename T, bool TLocal>
+class [[nodiscard]] guard
+{
+private:
+    T _data;
+    void* _prev;
+
+public:
+    template <typename... Ts>
+    [[nodiscard, gnu::always_inline]] explicit guard(Ts&&... xs) noexcept(
+        noexcept(T{static_cast<Ts&&>(xs)...}))
+        : _data{static_cast<Ts&&>(xs)...}
+    {
+        void*& ptr_ref = top_slot<T, TLocal>();
+
+        _prev = ptr_ref;
+        ptr_ref = &_data;
+
+        TLCONTEXT_PROBE(push, probe_type<T>(), &_data, TLocal);
+    }
+
+    [[gnu::always_inline]] ~guard() noexcept
+    {
+        TLCONTEXT_PROBE(pop, probe_type<T>(), &_data, TLocal);
+
+        pop_slot<T, TLocal>(_prev);
+    }
+
+    guard(const guard&) = delete;
+    guard(guard&&) = delete;
+};
+
+// Tag contexts carry no state and are only used for presence checks. Their
+// slots hold a nesting depth instead of a pointer to the top context.
+template <typename T>
+concept tag_context = std::is_empty_v<T> &&
+                      std::is_trivially_default_constructible_v<T> &&
+                      std::is_trivially_destructible_v<T>;
+
+// Object returned by accessors of active tag contexts.
+template <tag_context T>
+constinit inline T tag_instance{};
+
+// RAII guard for tag contexts, which stores nothing and pushes by incrementing
+// the depth in the slot.
+template <tag_context T, bool TLocal>
+class [[nodiscard]] guard<T, TLocal>
+{
+private:
+    [[no_unique_address]] T _data;
+
+    [[gnu::always_inline]] static void add_depth(std::uintptr_t delta) noexcept
+    {
+        void*& slot = top_slot<T, TLocal>();
+        slot = reinterpret_cast<void*>(
+            reinterpret_cast<std::uintptr_t>(slot) + delta);
+    }
+
+public:
+    template <typename... Ts>
+    [[nodiscard, gnu::always_inline]] explicit guard(Ts&&... xs) noexcept(
+        noexcept(T{static_cast<Ts&&>(xs)...}))
+        : _data{static_cast<Ts&&>(xs)...}
+    {
+        add_depth(1);
+
+        TLCONTEXT_PROBE(push, probe_type<T>(), &tag_instance<T>, TLocal);
+    }
+
+    [[gnu::always_inline]] ~guard() noexcept
+    {
+        TLCONTEXT_PROBE(pop, probe_type<T>(), &tag_instance<T>, TLocal);
+
+        pop_slot<T, TLocal>(reinterpret_cast<void*>(
+            reinterpret_cast<std::uintptr_t>(top_value<T, TLocal>()) - 1));
+    }
+
+    guard(const guard&) = delete;
+    guard(guard&&) = delete;
+};
+
+// Per-thread bump allocator for contexts of `slab_guard`s, whose allocations
+// and releases mirror guard nesting. Chunks are kept once allocated, so that
+// pushes only allocate memory when the nesting exceeds its previous maximum.
+class guard_slab
+{
+private:
+    static constexpr std::size_t chunk_size = 16 * 1024;
+
+    struct chunk
+    {
+        chunk* prev;
+        chunk* next;
+        std::byte* end;
+
+        [[nodiscard]] std::byte* begin() noexcept
+        {
+            return reinterpret_cast<std::byte*>(this + 1);
+        }
+
+        [[nodiscard]] bool contains(const std::byte* p) noexcept
+        {
+            const auto x = reinterpret_cast<std::uintptr_t>(p);
+
+            return x >= reinterpret_cast<std::uintptr_t>(begin()) &&
+                   x <= reinterpret_cast<std::uintptr_t>(end);
+        }
+    };
+
+    chunk* _first{nullptr};
+    chunk* _current{nullptr};
+    std::byte* _top{nullptr};
+
+    [[nodiscard]] static std::byte* align_up(
+        std::byte* p, std::size_t alignment) noexcept
+    {
+        const auto x = reinterpret_cast<std::uintptr_t>(p);
+        return p + ((alignment - x % alignment) % alignment);
+    }
+
+    [[gnu::cold]] std::byte* allocate_slow(
+        std::size_t size, std::size_t alignment);
+
+public:
+    constexpr guard_slab() = default;
+
+    guard_slab(const guard_slab&) = delete;
+    guard_slab(guard_slab&&) = delete;
+
+    // Frees every chunk. Called on thread exit by `guard_slab_owner`, rather
+    // than by a destructor, so that the slab needs no TLS initialization
+    // check on the hot path.
+    void free_chunks() noexcept
+    {
+        while(_first != nullptr)
+        {
+            chunk* const next = _first->next;
+            ::operator delete(_first);
+            _first = next;
+        }
+
+        _current = nullptr;
+        _top = nullptr;
+    }
+
+    [[nodiscard]] std::byte* top() const noexcept
+    {
+        return _top;
+    }
+
+    [[nodiscard, gnu::always_inline]] std::byte* allocate(
+        std::size_t size, std::size_t alignment)
+    {
+        if(_current != nullptr) [[likely]]
+        {
+            std::byte* const p = align_up(_top, alignment);
+
+            if(p + size <= _current->end) [[likely]]
+            {
+                _top = p + size;
+                return p;
+            }
+        }
+
+        return allocate_slow(size, alignment);
+    }
+
+    // Releases every allocation made after `top()` returned `mark`, which is
+    // null if the slab had no chunk yet. There must be an allocation since.
+    [[gnu::always_inline]] void release(std::byte* mark) noexcept
+    {
+        while(!_current->contains(mark)) [[unlikely]]
+        {
+            if(_current->prev == nullptr)
+            {
+                mark = _current->begin();
+                break;
+            }
+
+            _current = _current->prev;
+        }
+
+        _top = mark;
+    }
+};
+
+constinit inline thread_local guard_slab guard_slab_instance;
+
+struct guard_slab_owner
+{
+    ~guard_slab_owner()
+    {
+        guard_slab_instance.free_chunks();
+    }
+};
+
+inline thread_local guard_slab_owner guard_slab_owner_instance;
+
+[[gnu::cold]] inline std::byte* guard_slab::allocate_slow(
+    std::size_t size, std::size_t alignment)
+{
+    chunk* next = _current == nullptr ? _first : _current->next;
+
+    // Drop cached chunks too small for this allocation.
+    while(next != nullptr &&
+          align_up(next->begin(), alignment) + size > next->end)
+    {
+        chunk* const after = next->next;
+        ::operator delete(next);
+        next = after;
+    }
+
+    if(next == nullptr)
+    {
+        // Registers the cleanup of the slab on thread exit.
+        static_cast<void>(&guard_slab_owner_instance);
+
+        const std::size_t needed = sizeof(chunk) + size + alignment;
+        const std::size_t bytes = needed > chunk_size ? needed : chunk_size;
+
+        next = static_cast<chunk*>(::operator new(bytes));
+        next->end = reinterpret_cast<std::byte*>(next) + bytes;
+        next->next = nullptr;
+    }
+
+    next->prev = _current;
+    (_current == nullptr ? _first : _current->next) = next;
+
+    _current = next;
+
+    std::byte* const p = align_up(next->begin(), alignment);
+    _top = p + size;
+
+    return p;
+}
+
+// RAII guard for local contexts of type `T` that places the context in the
+// per-thread `guard_slab`, so that the stack only holds three pointers.
+template <typename T>
+class [[nodiscard]] slab_guard
+{
+    static_assert(!tag_context<T>, "tag contexts occupy no storage");
+
+private:
+    T* _data;
+    void* _prev;
+    std::byte* _mark;
+
+public:
+    template <typename... Ts>
+    [[nodiscard, gnu::always_inline]] explicit slab_guard(Ts&&... xs)
+    {
+        guard_slab& slab = guard_slab_instance;
+
+        _mark = slab.top();
+        void* const p = slab.allocate(sizeof(T), alignof(T));
+
+        if constexpr(noexcept(T{static_cast<Ts&&>(xs)...}))
+        {
+            _data = ::new(p) T{static_cast<Ts&&>(xs)...};
+        }
+        else
+        {
+            try
+            {
+                _data = ::new(p) T{static_cast<Ts&&>(xs)...};
+            }
+            catch(...)
+            {
+                slab.release(_mark);
+                throw;
+            }
+        }
+
+        void*& ptr_ref = top_slot<T, true /* local */>();
+
+        _prev = ptr_ref;
+        ptr_ref = _data;
+
+        TLCONTEXT_PROBE(push, probe_type<T>(), _data, true);
+    }
+
+    [[gnu::always_inline]] ~slab_guard() noexcept
+    {
+        TLCONTEXT_PROBE(pop, probe_type<T>(), _data, true);
+
+        pop_slot<T, true /* local */>(_prev);
+
+        guard_slab& slab = guard_slab_instance;
+
+#ifdef TLCONTEXT_DEBUG
+        abort_if(slab.top() != reinterpret_cast<std::byte*>(_data + 1),
+            "slab guards destroyed out of order");
+#endif
+
+        _data->~T();
+        slab.release(_mark);
+    }
+
+    slab_guard(const slab_guard&) = delete;
+    slab_guard(slab_guard&&) = delete;
+};
+
+// Converts the value of a slot of `T` to a pointer to the context, which is
+// null if no context is active.
+template <typename T>
+[[nodiscard, gnu::always_inline]] inline T* slot_context(void* slot) noexcept
+{
+    if constexpr(tag_context<T>)
+    {
+        return slot == nullptr ? nullptr : &tag_instance<T>;
+    }
+    else
+    {
+        return static_cast<T*>(slot);
+    }
+}
+
+// Unique address identifying the static type `T` of a strategy
+// implementation.
+template <typename T>
+constinit inline const char strategy_tag{};
+
+// Context data for strategies described by the function-pointer table type
+// `TTable`. The table is resolved once when the guard is pushed, and stored by
+// value alongside the type-erased implementation pointer.
+template <typename TTable>
+struct strategy_data
+{
+    void* self;
+    TTable table;
+    const void* tag;
+};
+
+template <auto TField>
+using field_type = std::remove_cvref_t<decltype(
+    std::declval<const typename member_pointer_class<
+        decltype(TField)>::type&>().*TField)>;
+
+template <auto TField, auto... TFields>
+[[nodiscard]] consteval std::size_t field_index() noexcept
+{
+    constexpr bool matches[]{std::is_same_v<std::integral_constant<
+        decltype(TField), TField>,
+        std::integral_constant<decltype(TFields), TFields>>...};
+
+    for(std::size_t i = 0; i < sizeof...(TFields); ++i)
+    {
+        if(matches[i])
+        {
+            return i;
+        }
+    }
+
+    return sizeof...(TFields);
+}
+
+// Context data of overlay contexts: the base object, and one pointer per
+// overridable field, in the order of `TFields`. Each pointer refers either
+// into the base object or into the innermost guard overriding that field.
+template <typename T, auto... TFields>
+struct overlay_table
+{
+    static_assert(sizeof...(TFields) > 0, "overlays need overridable fields");
+
+    const T* base;
+    const void* fields[sizeof...(TFields)];
+};
+
+} // namespace tlcontext::impl
+
+//
+//
+//
+// Public API
+// ----------------------------------------------------------------------------
+
+namespace tlcontext {
+
+template <typename T>
+struct helper
+{
+    helper() = delete;
+
+    helper(const helper&) = delete;
+    helper(helper&&) = delete;
+
+    // A `local_guard` pushes a new context of type `T` on the thread-local
+    // stack on construction, and pops it on destruction.
+    using local_guard = impl::guard<T, true /* local */>;
+
+    // A `global_guard` creates a new context of type `T` on the static buffer
+    // on construction, and destroys it on destruction.
+    using global_guard = impl::guard<T, false /* global */>;
+
+    // A `slab_guard` is a `local_guard` that stores the context in a
+    // per-thread LIFO slab instead of on the stack, for large contexts on
+    // small stacks (e.g. fibers). Guards of a thread must still be destroyed
+    // in reverse order of construction. The slab is shared by every fiber
+    // running on the thread, so fibers that interleave while holding slab
+    // guards would release each other's contexts: they must not switch while
+    // a slab guard is active, or must use `local_guard` instead.
+    using slab_guard = impl::slab_guard<T>;
+
+    // Returns the context on top of the thread-local stack. The behavior is
+    // undefined if there are no contexts of type `T` on the stack.
+    [[nodiscard, gnu::always_inline]] inline static T& get_local() noexcept
+    {
+        T* const ptr = impl::slot_context<T>(impl::top_value<T, true>());
+
+#ifdef TLCONTEXT_DEBUG
+        impl::abort_if(ptr == nullptr, "tried using inactive local context");
+#endif
+
+        return *ptr;
+    }
+
+    // Returns the global context. The behavior is undefined if there is no
+    // global context of type `T`.
+    [[nodiscard, gnu::always_inline]] inline static T& get_global() noexcept
+    {
+        T* const ptr = impl::slot_context<T>(impl::top_value<T, false>());
+
+#ifdef TLCONTEXT_DEBUG
+        impl::abort_if(ptr == nullptr, "tried using inactive global context");
+#endif
+
+        return *ptr;
+    }
+
+    // Either returns the local context on top of the stack or the global
+    // context, if there's no local context available. The behavior is undefined
+    // if neither a local nor a global context is available.
+    [[nodiscard, gnu::always_inline]] inline static T& get_top() noexcept
+    {
+        if(void* const local_ptr = impl::top_value<T, true>())
+        {
+            return *impl::slot_context<T>(local_ptr);
+        }
+
+        T* const global_ptr =
+            impl::slot_context<T>(impl::top_value<T, false>());
+
+#ifdef TLCONTEXT_DEBUG
+        impl::abort_if(global_ptr == nullptr, "no available context");
+#endif
+
+        return *global_ptr;
+    }
+
+    // Returns whether a local or a global context of type `T` is available.
+    [[nodiscard, gnu::always_inline]] inline static bool is_active() noexcept
+    {
+        return impl::top_value<T, true>() != nullptr ||
+               impl::top_value<T, false>() != nullptr;
+    }
+};
+
+// Returns whether a local or a global context of type `T` is available. This
+// is a single slot load per stack, and is the intended query for tag contexts
+// (empty types), whose guards occupy no storage.
+template <typename T>
+[[nodiscard, gnu::always_inline]] inline bool is_active() noexcept
+{
+    return helper<T>::is_active();
+}
+
+// Number of distinct values of a field type usable with `dispatch_on`.
+// Specialize this for enumerations whose enumerators are contiguous and start
+// at zero.
+template <typename T>
+inline constexpr std::size_t dispatch_cardinality = 0;
+
+template <>
+inline constexpr std::size_t dispatch_cardinality<bool> = 2;
+
+namespace impl {
+
+// Invokes `k` with `value` converted to an `std::integral_constant`, through a
+// jump table with one entry per possible value.
+template <typename V, typename K, std::size_t... Is>
+[[gnu::always_inline]] inline decltype(auto) dispatch_value(
+    V value, K& k, std::index_sequence<Is...>)
+{
+    using result_type =
+        decltype(k(std::integral_constant<V, static_cast<V>(0)>{}));
+
+    constexpr result_type (*table[])(K&){[](K& k) -> result_type
+        { return k(std::integral_constant<V, static_cast<V>(Is)>{}); }...};
+
+    const auto index = static_cast<std::size_t>(value);
+
+    // Checked in every build mode, as the comparison is negligible next to the
+    // indirect call and an out-of-range value would jump to arbitrary code.
+    if(index >= sizeof...(Is)) [[unlikely]]
+    {
+        fatal("dispatched value out of range");
+    }
+
+    return table[index](k);
+}
+
+template <typename F>
+[[gnu::always_inline]] inline decltype(auto) dispatch_values(F& f)
+{
+    return f();
+}
+
+// Converts every value in `vs...` to an `std::integral_constant`, one at a
+// time, and finally invokes `f` with all of them.
+template <typename F, typename V, typename... Vs>
+[[gnu::always_inline]] inline decltype(auto) dispatch_values(
+    F& f, V v, Vs... vs)
+{
+    auto bind_first = [&]<V X>(std::integral_constant<V, X> c) -> decltype(auto)
+    {
+        auto bind_rest = [&](auto... cs) -> decltype(auto)
+        { return f(c, cs...); };
+
+        return dispatch_values(bind_rest, vs...);
+    };
+
+    static_assert(dispatch_cardinality<V> > 0,
+        "specialize dispatch_cardinality for every dispatched field type");
+
+    return dispatch_value(
+        v, bind_first, std::make_index_sequence<dispatch_cardinality<V>>{});
+}
+
+} // namespace impl
+
+// Reads the fields `TFields...` of the context on top of the stack of `Ctx`
+// once, and invokes `f` with them as `std::integral_constant`s. One
+// specialization of `f` is instantiated per combination of values, so that
+// loop-invariant flags become compile-time constants in hot kernels. Every
+// field type must have a non-zero `dispatch_cardinality`, and all
+// specializations of `f` must return the same type.
+template <typename Ctx, auto... TFields, typename F>
+[[gnu::always_inline]] inline decltype(auto) dispatch_on(F&& f)
+{
+    const auto& data = Ctx::get_top();
+    return impl::dispatch_values(f, (data.*TFields)...);
+}
+
+// Copy of the local tops of every context type on a thread, as produced by
+// `capture_all`. The pointed-to contexts are not owned by the snapshot, and
+// must outlive any thread the snapshot is restored on.
+class context_snapshot
+{
+private:
+#ifdef TLCONTEXT_SLOT_ARRAY
+    void* _slots[impl::max_types];
+    std::size_t _count;
+
+    // Cold tops, only captured if the thread has an overflow table.
+    void* _cold_slots[impl::cold_slots_size];
+    std::size_t _cold_count;
+#else
+    // Active local tops, at most one per type.
+    struct entry
+    {
+        const impl::type_entry* type;
+        void* top;
+    };
+
+    entry _tops[impl::max_types];
+    std::size_t _count;
+#endif
+
+    friend context_snapshot capture_all() noexcept;
+    friend void restore_all(const context_snapshot&) noexcept;
+
+public:
+    // Returns the local top of `T` in the snapshot, or null if there is none.
+    template <typename T>
+    [[nodiscard]] T* find() const noexcept
+    {
+#ifdef TLCONTEXT_SLOT_ARRAY
+        const std::size_t id = impl::type_id<T>;
+
+        if(id >= impl::max_types)
+        {
+            const std::size_t index = id - impl::max_types;
+
+            return index < _cold_count
+                       ? impl::slot_context<T>(_cold_slots[index])
+                       : nullptr;
+        }
+
+        return id < _count ? impl::slot_context<T>(_slots[id]) : nullptr;
+#else
+        for(std::size_t i = 0; i < _count; ++i)
+        {
+            if(_tops[i].type == &impl::type_entry_instance<T>)
+            {
+                return impl::slot_context<T>(_tops[i].top);
+            }
+        }
+
+        return nullptr;
+#endif
+    }
+};
+
+#ifdef TLCONTEXT_SLOT_ARRAY
+
+// Captures the local tops of all context types on the calling thread, as a
+// single copy of `sizeof(void*)` bytes per registered type.
+[[nodiscard, gnu::always_inline]] inline context_snapshot capture_all() noexcept
+{
+    context_snapshot result;
+    result._count = impl::registered_type_count();
+
+    std::memcpy(result._slots, impl::local_slots_base(),
+        result._count * sizeof(void*));
+
+    void** const cold = impl::local_cold_slots_if_allocated();
+    result._cold_count =
+        cold == nullptr ? 0 : impl::registered_cold_type_count();
+
+    if(result._cold_count != 0) [[unlikely]]
+    {
+        std::memcpy(
+            result._cold_slots, cold, result._cold_count * sizeof(void*));
+    }
+
+    return result;
+}
+
+// Replaces the local tops of all context types on the calling thread with the
+// ones in `snapshot`. Types registered after the capture become inactive.
+[[gnu::always_inline]] inline void restore_all(
+    const context_snapshot& snapshot) noexcept
+{
+    void** const slots = impl::local_slots_base();
+    const std::size_t count = impl::registered_type_count();
+
+    std::memcpy(slots, snapshot._slots, snapshot._count * sizeof(void*));
+
+    if(count > snapshot._count) [[unlikely]]
+    {
+        std::memset(slots + snapshot._count, 0,
+            (count - snapshot._count) * sizeof(void*));
+    }
+
+    // Only allocate an overflow table if the snapshot has cold tops.
+    void** const cold = snapshot._cold_count == 0
+                            ? impl::local_cold_slots_if_allocated()
+                            : impl::local_cold_slots_base();
+
+    if(cold != nullptr) [[unlikely]]
+    {
+        const std::size_t cold_count = impl::registered_cold_type_count();
+
+        std::memcpy(
+            cold, snapshot._cold_slots, snapshot._cold_count * sizeof(void*));
+
+        std::memset(cold + snapshot._cold_count, 0,
+            (cold_count - snapshot._cold_count) * sizeof(void*));
+    }
+}
+
+#else
+
+// Captures the active local tops of all context types on the calling thread,
+// through one indirect call per registered type. Aborts if more than
+// `TLCONTEXT_MAX_TYPES` types are active.
+[[nodiscard]] inline context_snapshot capture_all() noexcept
+{
+    context_snapshot result;
+    result._count = 0;
+
+    for(const impl::type_entry* e =
+            impl::type_registry.load(std::memory_order_acquire);
+        e != nullptr; e = e->next)
+    {
+        void** const top = e->local_top(false /* allocate */);
+
+        if(top == nullptr || *top == nullptr)
+        {
+            continue;
+        }
+
+        if(result._count == impl::max_types) [[unlikely]]
+        {
+            impl::fatal("too many active contexts for TLCONTEXT_MAX_TYPES");
+        }
+
+        result._tops[result._count++] = {e, *top};
+    }
+
+    return result;
+}
+
+// Replaces the local tops of all context types on the calling thread with the
+// ones in `snapshot`. Types not in the snapshot become inactive.
+inline void restore_all(const context_snapshot& snapshot) noexcept
+{
+    for(const impl::type_entry* e =
+            impl::type_registry.load(std::memory_order_acquire);
+        e != nullptr; e = e->next)
+    {
+        if(void** const top = e->local_top(false /* allocate */))
+        {
+            *top = nullptr;
+        }
+    }
+
+    for(std::size_t i = 0; i < snapshot._count; ++i)
+    {
+        *snapshot._tops[i].type->local_top(true /* allocate */) =
+            snapshot._tops[i].top;
+    }
+}
+
+#endif
+
+// RAII guard that restores `snapshot` on the calling thread on construction,
+// and the previously active local tops on destruction. Useful to propagate
+// all contexts of a parent thread into tasks running on a worker thread.
+class [[nodiscard]] snapshot_guard
+{
+private:
+    context_snapshot _prev;
+
+public:
+    [[nodiscard, gnu::always_inline]] explicit snapshot_guard(
+        const context_snapshot& snapshot) noexcept
+        : _prev{capture_all()}
+    {
+        restore_all(snapshot);
+    }
+
+    [[gnu::always_inline]] ~snapshot_guard() noexcept
+    {
+        restore_all(_prev);
+    }
+
+    snapshot_guard(const snapshot_guard&) = delete;
+    snapshot_guard(snapshot_guard&&) = delete;
+};
+
+// RAII guard for strategy contexts. Binds a reference to an implementation
+// object of any type `TImpl` for which `TTable::template make<TImpl>()` yields
+// a function-pointer table.
+template <typename TTable, bool TLocal>
+class [[nodiscard]] strategy_guard
+{
+private:
+    impl::guard<impl::strategy_data<TTable>, TLocal> _guard;
+
+public:
+    template <typename TImpl>
+    [[nodiscard, gnu::always_inline]] explicit strategy_guard(
+        TImpl& obj) noexcept
+        : _guard{static_cast<void*>(&obj), TTable::template make<TImpl>(),
+              static_cast<const void*>(&impl::strategy_tag<TImpl>)}
+    {}
+
+    strategy_guard(const strategy_guard&) = delete;
+    strategy_guard(strategy_guard&&) = delete;
+};
+
+// Strategy contexts carry polymorphic behavior without virtual dispatch. The
+// user-provided `TTable` is an aggregate of function pointers taking a `void*`
+// to the implementation as their first argument, and exposes a
+// `template <typename TImpl> static constexpr TTable make()` factory. Calls
+// through `invoke` are a single indirect call with no vtable load.
+template <typename TTable>
+struct strategy
+{
+    strategy() = delete;
+
+    strategy(const strategy&) = delete;
+    strategy(strategy&&) = delete;
+
+    using data_type = impl::strategy_data<TTable>;
+    using ctx = helper<data_type>;
+
+    using local_guard = strategy_guard<TTable, true /* local */>;
+    using global_guard = strategy_guard<TTable, false /* global */>;
+
+    // Invokes the function pointer `TFn` (a pointer to a data member of
+    // `TTable`) of the strategy on top of the stack.
+    template <auto TFn, typename... Ts>
+    [[gnu::always_inline]] inline static decltype(auto) invoke(Ts&&... xs)
+    {
+        const data_type& data = ctx::get_top();
+        return (data.table.*TFn)(data.self, static_cast<Ts&&>(xs)...);
+    }
+
+    // Returns the strategy on top of the stack if its static type at the guard
+    // site was `TImpl`, or `nullptr` otherwise. Calls through the returned
+    // pointer can be fully inlined.
+    template <typename TImpl>
+    [[nodiscard, gnu::always_inline]] inline static TImpl* get_if() noexcept
+    {
+        const data_type& data = ctx::get_top();
+
+        if(data.tag != static_cast<const void*>(&impl::strategy_tag<TImpl>))
+        {
+            return nullptr;
+        }
+
+        return static_cast<TImpl*>(data.self);
+    }
+};
+
+// Overlay contexts allow scopes to override individual fields of a large
+// context type `T` without copying it. Only the fields listed in `TFields...`
+// (pointers to data members of `T`) can be overridden. Every guard pushes a
+// table of `1 + sizeof...(TFields)` pointers, so field reads through `get`
+// stay a constant-time indirection.
+template <typename T, auto... TFields>
+struct overlay
+{
+    overlay() = delete;
+
+    overlay(const overlay&) = delete;
+    overlay(overlay&&) = delete;
+
+    using table_type = impl::overlay_table<T, TFields...>;
+    using ctx = helper<table_type>;
+
+    template <auto TField>
+    static constexpr std::size_t index =
+        impl::field_index<TField, TFields...>();
+
+    // RAII guard that pushes a full `T` as the base of the overlay stack.
+    template <bool TLocal>
+    class [[nodiscard]] base_guard
+    {
+    private:
+        T _data;
+        impl::guard<table_type, TLocal> _guard;
+
+    public:
+        template <typename... Ts>
+        [[nodiscard, gnu::always_inline]] explicit base_guard(Ts&&... xs)
+            : _data{static_cast<Ts&&>(xs)...},
+              _guard{table_type{&_data, {&(_data.*TFields)...}}}
+        {}
+
+        base_guard(const base_guard&) = delete;
+        base_guard(base_guard&&) = delete;
+    };
+
+    using local_guard = base_guard<true /* local */>;
+    using global_guard = base_guard<false /* global */>;
+
+    // RAII guard that overrides the field `TField` on the thread-local stack.
+    // Only the new value of the field and the updated table are stored.
+    template <auto TField>
+    class [[nodiscard]] override_guard
+    {
+        static_assert(index<TField> < sizeof...(TFields),
+            "field is not overridable in this overlay");
+
+    private:
+        impl::field_type<TField> _value;
+        impl::guard<table_type, true /* local */> _guard;
+
+        [[nodiscard, gnu::always_inline]] table_type make_table() const noexcept
+        {
+            table_type result = ctx::get_top();
+            result.fields[index<TField>] = &_value;
+            return result;
+        }
+
+    public:
+        template <typename... Ts>
+        [[nodiscard, gnu::always_inline]] explicit override_guard(Ts&&... xs)
+            : _value{static_cast<Ts&&>(xs)...}, _guard{make_table()}
+        {}
+
+        override_guard(const override_guard&) = delete;
+        override_guard(override_guard&&) = delete;
+    };
+
+    // Returns the innermost value of the field `TField`. The behavior is
+    // undefined if no overlay context is available.
+    template <auto TField>
+    [[nodiscard, gnu::always_inline]] inline static const impl::field_type<
+        TField>&
+    get() noexcept
+    {
+        return *static_cast<const impl::field_type<TField>*>(
+            ctx::get_top().fields[index<TField>]);
+    }
+
+    // Returns the innermost base object, which does not reflect overrides.
+    [[nodiscard, gnu::always_inline]] inline static const T& base() noexcept
+    {
+        return *ctx::get_top().base;
+    }
+};
+
+} // namespace tlcontext
+
+//
+//
+//
+// Ad-hoc values
+// ----------------------------------------------------------------------------
+
+#ifdef TLCONTEXT_VALUES
+
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+namespace tlcontext::impl {
+
+// Type-erased, reference-counted value stored in the leaves of a `hamt_node`.
+struct hamt_value
+{
+    std::atomic<std::uint32_t> refs{1};
+    void (*destroy)(hamt_value*) noexcept;
+};
+
+template <typename V>
+struct hamt_value_of : hamt_value
+{
+    V value;
+
+    template <typename... Ts>
+    explicit hamt_value_of(Ts&&... xs) : value{static_cast<Ts&&>(xs)...}
+    {
+        destroy = [](hamt_value* self) noexcept
+        { delete static_cast<hamt_value_of*>(self); };
+    }
+};
+
+struct hamt_node;
+
+// Either a leaf mapping `key` to `value`, or a link to a `child` node if `key`
+// is null.
+struct hamt_entry
+{
+    const void* key;
+
+    union
+    {
+        hamt_value* value;
+        hamt_node* child;
+    };
+};
+
+// Immutable node of a hash array mapped trie, followed in memory by one
+// `hamt_entry` per bit set in `bitmap`. Nodes are shared between maps and
+// freed when the last reference is released.
+struct hamt_node
+{
+    std::atomic<std::uint32_t> refs;
+    std::uint32_t bitmap;
+
+    [[nodiscard, gnu::always_inline]] hamt_entry* entries() noexcept
+    {
+        return reinterpret_cast<hamt_entry*>(this + 1);
+    }
+
+    [[nodiscard, gnu::always_inline]] const hamt_entry* entries() const noexcept
+    {
+        return reinterpret_cast<const hamt_entry*>(this + 1);
+    }
+
+    [[nodiscard, gnu::always_inline]] std::size_t size() const noexcept
+    {
+        return static_cast<std::size_t>(std::popcount(bitmap));
+    }
+};
+
+inline constexpr unsigned hamt_bits = 5;
+inline constexpr std::uint64_t hamt_mask = (1u << hamt_bits) - 1;
+inline constexpr std::size_t hamt_max_entries = 1u << hamt_bits;
+
+// Maximum number of free nodes cached per size class and thread.
+inline constexpr std::size_t hamt_pool_limit = 64;
+
+// Per-thread cache of free nodes, with one free list per number of entries.
+// Nodes released on a thread return to that thread's pool, regardless of
+// which thread allocated them.
+class hamt_pool
+{
+private:
+    struct free_node
+    {
+        free_node* next;
+    };
+
+    free_node* _lists[hamt_max_entries + 1]{};
+    std::size_t _sizes[hamt_max_entries + 1]{};
+    bool _closed{false};
+
+    [[nodiscard]] static std::size_t bytes(std::size_t n) noexcept
+    {
+        return sizeof(hamt_node) + n * sizeof(hamt_entry);
+    }
+
+public:
+    constexpr hamt_pool() = default;
+
+    hamt_pool(const hamt_pool&) = delete;
+    hamt_pool(hamt_pool&&) = delete;
+
+    // Frees every cached node, and makes later releases free nodes directly.
+    // Called on thread exit by `hamt_pool_owner`, rather than by a destructor,
+    // so that maps released afterwards by thread-local or static destructors
+    // never reach a destroyed pool.
+    void close() noexcept
+    {
+        for(std::size_t n = 0; n <= hamt_max_entries; ++n)
+        {
+            while(free_node* const node = _lists[n])
+            {
+                _lists[n] = node->next;
+                ::operator delete(node, bytes(n));
+            }
+
+            _sizes[n] = 0;
+        }
+
+        _closed = true;
+    }
+
+    [[nodiscard]] hamt_node* allocate(std::size_t n, std::uint32_t bitmap)
+    {
+        void* memory;
+
+        if(free_node* const node = _lists[n])
+        {
+            _lists[n] = node->next;
+            --_sizes[n];
+            memory = node;
+        }
+        else
+        {
+            memory = ::operator new(bytes(n));
+        }
+
+        return ::new(memory) hamt_node{{1}, bitmap};
+    }
+
+    void deallocate(hamt_node* node) noexcept;
+};
+
+constinit inline thread_local hamt_pool hamt_pool_instance;
+
+struct hamt_pool_owner
+{
+    ~hamt_pool_owner()
+    {
+        hamt_pool_instance.close();
+    }
+};
+
+inline thread_local hamt_pool_owner hamt_pool_owner_instance;
+
+inline void hamt_pool::deallocate(hamt_node* node) noexcept
+{
+    const std::size_t n = node->size();
+    node->~hamt_node();
+
+    if(_closed || _sizes[n] == hamt_pool_limit)
+    {
+        ::operator delete(node, bytes(n));
+        return;
+    }
+
+    // Registers the release of the cached nodes on thread exit.
+    static_cast<void>(&hamt_pool_owner_instance);
+
+    _lists[n] = ::new(static_cast<void*>(node)) free_node{_lists[n]};
+    ++_sizes[n];
+}
+
+// Bijective mix of a key address, so that distinct keys always differ in at
+// least one hash bit and no collision nodes are needed.
+[[nodiscard, gnu::always_inline]] inline std::uint64_t hamt_hash(
+    const void* key) noexcept
+{
+    auto h = static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(key));
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    return h;
+}
+
+inline void hamt_retain(const hamt_entry& entry) noexcept
+{
+    auto& refs = entry.key == nullptr ? entry.child->refs : entry.value->refs;
+    refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void hamt_release(hamt_node* node) noexcept;
+
+inline void hamt_release(const hamt_entry& entry) noexcept
+{
+    if(entry.key == nullptr)
+    {
+        hamt_release(entry.child);
+        return;
+    }
+
+    hamt_value* const value = entry.value;
+
+    if(value->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        value->destroy(value);
+    }
+}
+
+inline void hamt_release(hamt_node* node) noexcept
+{
+    if(node->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    {
+        return;
+    }
+
+    hamt_entry* const entries = node->entries();
+
+    for(std::size_t i = 0, n = node->size(); i < n; ++i)
+    {
+        hamt_release(entries[i]);
+    }
+
+    hamt_pool_instance.deallocate(node);
+}
+
+[[nodiscard]] inline hamt_value* hamt_find(
+    const hamt_node* node, const void* key) noexcept
+{
+    const std::uint64_t hash = hamt_hash(key);
+
+    for(unsigned shift = 0; node != nullptr; shift += hamt_bits)
+    {
+        const std::uint32_t bit = 1u << ((hash >> shift) & hamt_mask);
+
+        if((node->bitmap & bit) == 0)
+        {
+            return nullptr;
+        }
+
+        const auto index =
+            static_cast<std::size_t>(std::popcount(node->bitmap & (bit - 1)));
+
+        const hamt_entry& entry = node->entries()[index];
+
+        if(entry.key != nullptr)
+        {
+            return entry.key == key ? entry.value : nullptr;
+        }
+
+        node = entry.child;
+    }
+
+    return nullptr;
+}
+
+// Returns a node holding the two leaves `a` and `b`, whose hashes are equal
+// in all the bits below `shift`.
+[[nodiscard]] inline hamt_node* hamt_make_pair(
+    const hamt_entry& a, const hamt_entry& b, unsigned shift)
+{
+    const std::uint64_t a_hash = hamt_hash(a.key);
+    const std::uint64_t b_hash = hamt_hash(b.key);
+
+    const auto a_bits = static_cast<unsigned>((a_hash >> shift) & hamt_mask);
+    const auto b_bits = static_cast<unsigned>((b_hash >> shift) & hamt_mask);
+
+    if(a_bits == b_bits)
+    {
+        hamt_node* const node = hamt_pool_instance.allocate(1, 1u << a_bits);
+
+        node->entries()[0].key = nullptr;
+        node->entries()[0].child = hamt_make_pair(a, b, shift + hamt_bits);
+
+        return node;
+    }
+
+    hamt_node* const node =
+        hamt_pool_instance.allocate(2, (1u << a_bits) | (1u << b_bits));
+
+    node->entries()[a_bits < b_bits ? 0 : 1] = a;
+    node->entries()[a_bits < b_bits ? 1 : 0] = b;
+
+    return node;
+}
+
+// Returns a new node equal to `node` (which may be null) with `leaf` inserted
+// or replaced, sharing all the untouched subtrees. Takes ownership of the
+// reference to `leaf.value`.
+[[nodiscard]] inline hamt_node* hamt_insert(
+    hamt_node* node, const hamt_entry& leaf, std::uint64_t hash, unsigned shift)
+{
+    const std::uint32_t bit = 1u << ((hash >> shift) & hamt_mask);
+
+    if(node == nullptr)
+    {
+        hamt_node* const result = hamt_pool_instance.allocate(1, bit);
+        result->entries()[0] = leaf;
+
+        return result;
+    }
+
+    const std::size_t n = node->size();
+    const auto index =
+        static_cast<std::size_t>(std::popcount(node->bitmap & (bit - 1)));
+
+    const hamt_entry* const entries = node->entries();
+
+    if((node->bitmap & bit) == 0)
+    {
+        hamt_node* const result =
+            hamt_pool_instance.allocate(n + 1, node->bitmap | bit);
+
+        hamt_entry* const out = result->entries();
+
+        for(std::size_t i = 0; i < n; ++i)
+        {
+            hamt_retain(entries[i]);
+            out[i < index ? i : i + 1] = entries[i];
+        }
+
+        out[index] = leaf;
+        return result;
+    }
+
+    hamt_entry replacement;
+    const hamt_entry& existing = entries[index];
+
+    if(existing.key == nullptr)
+    {
+        replacement.key = nullptr;
+        replacement.child =
+            hamt_insert(existing.child, leaf, hash, shift + hamt_bits);
+    }
+    else if(existing.key == leaf.key)
+    {
+        replacement = leaf;
+    }
+    else
+    {
+        hamt_retain(existing);
+
+        replacement.key = nullptr;
+        replacement.child = hamt_make_pair(existing, leaf, shift + hamt_bits);
+    }
+
+    hamt_node* const result = hamt_pool_instance.allocate(n, node->bitmap);
+    hamt_entry* const out = result->entries();
+
+    for(std::size_t i = 0; i < n; ++i)
+    {
+        if(i != index)
+        {
+            hamt_retain(entries[i]);
+            out[i] = entries[i];
+        }
+    }
+
+    out[index] = replacement;
+    return result;
+}
+
+} // namespace tlcontext::impl
+
+namespace tlcontext {
+
+// Identity of an ad-hoc key with values of type `V`. Keys are compared by
+// address, and are typically declared as `inline constinit` variables.
+template <typename V>
+class value_key
+{
+public:
+    constexpr value_key() noexcept = default;
+
+    value_key(const value_key&) = delete;
+    value_key(value_key&&) = delete;
+};
+
+// Persistent, immutable map from `value_key`s to values, implemented as a
+// hash array mapped trie with structural sharing. Copying a map is a single
+// reference count increment, and lookups visit one node per five hash bits
+// (two nodes for hundreds of keys).
+class value_map
+{
+private:
+    impl::hamt_node* _root;
+
+    [[nodiscard, gnu::always_inline]] explicit value_map(
+        impl::hamt_node* root) noexcept
+        : _root{root}
+    {}
+
+public:
+    [[nodiscard]] value_map() noexcept : _root{nullptr}
+    {}
+
+    [[nodiscard]] value_map(const value_map& rhs) noexcept : _root{rhs._root}
+    {
+        if(_root != nullptr)
+        {
+            _root->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    [[nodiscard]] value_map(value_map&& rhs) noexcept : _root{rhs._root}
+    {
+        rhs._root = nullptr;
+    }
+
+    value_map& operator=(value_map rhs) noexcept
+    {
+        std::swap(_root, rhs._root);
+        return *this;
+    }
+
+    ~value_map()
+    {
+        if(_root != nullptr)
+        {
+            impl::hamt_release(_root);
+        }
+    }
+
+    // Returns the value associated with `key`, or `nullptr` if there is none.
+    template <typename V>
+    [[nodiscard]] const V* find(const value_key<V>& key) const noexcept
+    {
+        impl::hamt_value* const value = impl::hamt_find(_root, &key);
+
+        if(value == nullptr)
+        {
+            return nullptr;
+        }
+
+        return &static_cast<impl::hamt_value_of<V>*>(value)->value;
+    }
+
+    // Returns a new map in which `key` is associated with a `V` constructed
+    // from `xs...`, sharing structure with this one.
+    template <typename V, typename... Ts>
+    [[nodiscard]] value_map with(const value_key<V>& key, Ts&&... xs) const
+    {
+        impl::hamt_entry leaf;
+        leaf.key = &key;
+        leaf.value = new impl::hamt_value_of<V>{static_cast<Ts&&>(xs)...};
+
+        return value_map{
+            impl::hamt_insert(_root, leaf, impl::hamt_hash(&key), 0)};
+    }
+};
+
+// Returns the innermost map of ad-hoc values on the calling thread, or an
+// empty map. The result can be captured into asynchronous tasks in O(1).
+[[nodiscard]] inline value_map capture_values() noexcept
+{
+    if(!helper<value_map>::is_active())
+    {
+        return value_map{};
+    }
+
+    return helper<value_map>::get_top();
+}
+
+// Returns the innermost value associated with `key` on the calling thread, or
+// `nullptr` if there is none.
+template <typename V>
+[[nodiscard]] const V* get_value(const value_key<V>& key) noexcept
+{
+    if(!helper<value_map>::is_active())
+    {
+        return nullptr;
+    }
+
+    return helper<value_map>::get_top().find(key);
+}
+
+// RAII guard that pushes a map of ad-hoc values on the thread-local stack:
+// either the current map extended with a new value, or a captured map.
+class [[nodiscard]] value_guard
+{
+private:
+    impl::guard<value_map, true /* local */> _guard;
+
+public:
+    template <typename V, typename... Ts>
+    [[nodiscard]] explicit value_guard(const value_key<V>& key, Ts&&... xs)
+        : _guard{capture_values().with(key, static_cast<Ts&&>(xs)...)}
+    {}
+
+    [[nodiscard]] explicit value_guard(value_map map) noexcept
+        : _guard{static_cast<value_map&&>(map)}
+    {}
+
+    value_guard(const value_guard&) = delete;
+    value_guard(value_guard&&) = delete;
+};
+
+} // namespace tlcontext
+
+#endif
+
+//
+//
+//
+// Worker profiles
+// ----------------------------------------------------------------------------
+
+#ifdef TLCONTEXT_WORKERS
+
+#include <optional>
+#include <tuple>
+
+namespace tlcontext {
+
+// Stack of local guards for the contexts produced by the factories `Fs...`,
+// pushed in declaration order and popped in reverse order.
+template <typename... Fs>
+class worker_scope;
+
+template <>
+class [[nodiscard]] worker_scope<>
+{
+public:
+    [[nodiscard]] explicit worker_scope(std::size_t) noexcept
+    {}
+
+    worker_scope(const worker_scope&) = delete;
+    worker_scope(worker_scope&&) = delete;
+};
+
+template <typename F, typename... Fs>
+class [[nodiscard]] worker_scope<F, Fs...>
+{
+private:
+    using context_type = std::decay_t<std::invoke_result_t<const F&,
+        std::size_t>>;
+
+    impl::guard<context_type, true /* local */> _guard;
+    worker_scope<Fs...> _rest;
+
+public:
+    [[nodiscard]] explicit worker_scope(
+        std::size_t worker_index, const F& f, const Fs&... fs)
+        : _guard{f(worker_index)}, _rest{worker_index, fs...}
+    {}
+
+    worker_scope(const worker_scope&) = delete;
+    worker_scope(worker_scope&&) = delete;
+};
+
+// Declarative set of long-lived contexts that every worker thread of a pool
+// installs once at the bottom of its stack, instead of pushing them for every
+// task. Each factory in `Fs...` is invoked with the index of the worker, and
+// returns the context data for that worker (e.g. a per-worker arena, or an
+// RNG substream). Contexts are pushed in the order of the factories, so later
+// factories can read earlier contexts.
+template <typename... Fs>
+class worker_profile
+{
+private:
+    std::tuple<Fs...> _factories;
+
+    // Storage for profiles installed by `install`, per thread.
+    inline static thread_local std::optional<worker_scope<Fs...>> _installed;
+
+public:
+    [[nodiscard]] explicit worker_profile(Fs... factories)
+        : _factories{static_cast<Fs&&>(factories)...}
+    {}
+
+    // Pushes all the contexts of the profile for the worker `worker_index`,
+    // and pops them when the returned scope is destroyed.
+    [[nodiscard]] worker_scope<Fs...> enter(std::size_t worker_index) const
+    {
+        return std::apply([&](const Fs&... fs)
+            { return worker_scope<Fs...>{worker_index, fs...}; },
+            _factories);
+    }
+
+    // Runs `f` (typically the worker loop) under all the contexts of the
+    // profile for the worker `worker_index`.
+    template <typename F>
+    decltype(auto) run(std::size_t worker_index, F&& f) const
+    {
+        const worker_scope<Fs...> scope = enter(worker_index);
+        return static_cast<F&&>(f)();
+    }
+
+    // Pushes all the contexts of the profile for the worker `worker_index`
+    // until the calling thread exits. Intended for thread start hooks of pools
+    // that do not let the caller wrap the worker loop, and must be called
+    // while no local contexts of the profile's types are active.
+    void install(std::size_t worker_index) const
+    {
+        std::apply([&](const Fs&... fs)
+            { _installed.emplace(worker_index, fs...); },
+            _factories);
+    }
+};
+
+} // namespace tlcontext
+
+#endif
+
+//
+//
+//
+// Memory resources
+// ----------------------------------------------------------------------------
+
+#ifdef TLCONTEXT_MEMORY
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace tlcontext {
+
+// Context carrying the memory resource to be used by allocating code.
+struct pmr_context_data
+{
+    std::pmr::memory_resource* _mr;
+};
+
+using pmr_context = helper<pmr_context_data>;
+
+// Pool resource for small objects in which every thread allocates from its
+// own unsynchronized heap, without locks. Blocks are carved from aligned pages
+// owned by a single heap: frees on the owning thread push onto a local free
+// list, and frees on any other thread push onto the owner's lock-free remote
+// free list, which the owner reclaims when its local lists run dry. Heaps of
+// exited threads, with all their pages and free blocks, are adopted by the
+// next thread that starts using the resource. Requests larger than
+// `max_block` or over-aligned go to the upstream resource.
+class sharded_pool_resource : public std::pmr::memory_resource
+{
+public:
+    static constexpr std::size_t page_size = 64 * 1024;
+    static constexpr std::size_t min_block = 16;
+    static constexpr std::size_t class_count = 8;
+    static constexpr std::size_t max_block = min_block << (class_count - 1);
+
+private:
+    struct free_block
+    {
+        free_block* next;
+    };
+
+    struct heap;
+
+    // Stored at the beginning of every page, found by masking block addresses.
+    struct alignas(64) page_header
+    {
+        heap* owner;
+        std::size_t class_index;
+        page_header* next;
+    };
+
+    struct heap
+    {
+        alignas(64) std::atomic<free_block*> remote{nullptr};
+
+        // Head of the list of heaps of the owning thread, `nullptr` if the
+        // thread exited, or `detached()` if it registered while exiting.
+        std::atomic<heap**> thread{nullptr};
+        heap* thread_next{nullptr};
+        const sharded_pool_resource* resource;
+
+        alignas(64) free_block* local[class_count]{};
+        std::byte* bump[class_count]{};
+        std::byte* bump_end[class_count]{};
+        page_header* pages{nullptr};
+    };
+
+    struct heap_cache
+    {
+        std::uint64_t resource_id;
+        heap* owned;
+    };
+
+    // Unlinks the heaps of the calling thread on exit, so that they can be
+    // adopted by other threads.
+    struct thread_heaps_owner
+    {
+        ~thread_heaps_owner()
+        {
+            const std::lock_guard lock{_registry_mutex};
+
+            while(heap* const h = _thread_heaps)
+            {
+                _thread_heaps = h->thread_next;
+                h->thread_next = nullptr;
+                h->thread.store(nullptr, std::memory_order_relaxed);
+            }
+
+            _thread_exited = true;
+
+            for(heap_cache& entry : _cache)
+            {
+                entry = {0, nullptr};
+            }
+        }
+    };
+
+    static constexpr std::size_t cache_size = 8;
+
+    inline static constinit std::atomic<std::uint64_t> _next_id{1};
+
+    // Serializes registration, thread exit, and destruction of all resources,
+    // which all relink heaps across threads.
+    inline static constinit std::mutex _registry_mutex;
+
+    // Direct-mapped by resource id, so that alternating between a few
+    // resources never takes the registration slow path.
+    inline static constinit thread_local heap_cache _cache[cache_size]{};
+
+    inline static constinit thread_local heap* _thread_heaps{nullptr};
+    inline static constinit thread_local bool _thread_exited{false};
+    inline static thread_local thread_heaps_owner _thread_heaps_owner;
+
+    std::pmr::memory_resource* _upstream;
+    std::uint64_t _id;
+
+    std::vector<heap*> _heaps;
+
+    [[nodiscard, gnu::always_inline]] static std::size_t class_index(
+        std::size_t bytes) noexcept
+    {
+        return bytes <= min_block
+                   ? 0
+                   : static_cast<std::size_t>(std::bit_width(bytes - 1)) - 4;
+    }
+
+    [[nodiscard, gnu::always_inline]] static page_header* page_of(
+        void* p) noexcept
+    {
+        return reinterpret_cast<page_header*>(
+            reinterpret_cast<std::uintptr_t>(p) & ~(page_size - 1));
+    }
+
+    // Owner of heaps registered by threads after their exit began, which are
+    // never adopted, as the thread might still use them.
+    [[nodiscard]] static heap** detached() noexcept
+    {
+        static constinit heap* sentinel{nullptr};
+        return &sentinel;
+    }
+
+    [[nodiscard, gnu::always_inline]] heap* owned_heap() const noexcept
+    {
+        const heap_cache& entry = _cache[_id % cache_size];
+        return entry.resource_id == _id ? entry.owned : nullptr;
+    }
+
+    [[nodiscard, gnu::noinline]] heap* register_thread()
+    {
+        if(!_thread_exited)
+        {
+            static_cast<void>(&_thread_heaps_owner);
+        }
+
+        const std::lock_guard lock{_registry_mutex};
+
+        heap* result = nullptr;
+
+        // Evicted from the cache by another resource.
+        for(heap* h = _thread_heaps; h != nullptr; h = h->thread_next)
+        {
+            if(h->resource == this)
+            {
+                result = h;
+                break;
+            }
+        }
+
+        if(result == nullptr)
+        {
+            for(heap* const h : _heaps)
+            {
+                if(h->thread.load(std::memory_order_relaxed) == nullptr)
+                {
+                    result = h;
+                    break;
+                }
+            }
+
+            if(result == nullptr)
+            {
+                result = new heap;
+                result->resource = this;
+                _heaps.push_back(result);
+            }
+
+            if(_thread_exited)
+            {
+                result->thread.store(detached(), std::memory_order_relaxed);
+            }
+            else
+            {
+                result->thread.store(
+                    &_thread_heaps, std::memory_order_relaxed);
+
+                result->thread_next = _thread_heaps;
+                _thread_heaps = result;
+            }
+        }
+
+        _cache[_id % cache_size] = {_id, result};
+        return result;
+    }
+
+    [[nodiscard, gnu::noinline]] void* allocate_slow(heap& h, std::size_t c)
+    {
+        // Reclaim the blocks freed by other threads.
+        free_block* remote =
+            h.remote.exchange(nullptr, std::memory_order_acquire);
+
+        while(remote != nullptr)
+        {
+            free_block* const next = remote->next;
+            const std::size_t rc = page_of(remote)->class_index;
+
+            remote->next = h.local[rc];
+            h.local[rc] = remote;
+
+            remote = next;
+        }
+
+        if(free_block* const b = h.local[c])
+        {
+            h.local[c] = b->next;
+            return b;
+        }
+
+        const std::size_t block_size = min_block << c;
+
+        if(static_cast<std::size_t>(h.bump_end[c] - h.bump[c]) < block_size)
+        {
+            void* const memory = _upstream->allocate(page_size, page_size);
+            auto* const page = ::new(memory) page_header{&h, c, h.pages};
+            h.pages = page;
+
+            h.bump[c] = static_cast<std::byte*>(memory) + sizeof(page_header);
+            h.bump_end[c] = static_cast<std::byte*>(memory) + page_size;
+        }
+
+        void* const result = h.bump[c];
+        h.bump[c] += block_size;
+
+        return result;
+    }
+
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        if(bytes > max_block || alignment > alignof(std::max_align_t))
+            [[unlikely]]
+        {
+            return _upstream->allocate(bytes, alignment);
+        }
+
+        const std::size_t c = class_index(bytes);
+
+        heap* h = owned_heap();
+
+        if(h == nullptr) [[unlikely]]
+        {
+            h = register_thread();
+        }
+
+        if(free_block* const b = h->local[c]) [[likely]]
+        {
+            h->local[c] = b->next;
+            return b;
+        }
+
+        return allocate_slow(*h, c);
+    }
+
+    void do_deallocate(
+        void* p, std::size_t bytes, std::size_t alignment) override
+    {
+        if(bytes > max_block || alignment > alignof(std::max_align_t))
+            [[unlikely]]
+        {
+            _upstream->deallocate(p, bytes, alignment);
+            return;
+        }
+
+        auto* const block = static_cast<free_block*>(p);
+        heap* const owner = page_of(p)->owner;
+
+        // Owned by the calling thread, whether or not it is still cached.
+        if(owner->thread.load(std::memory_order_relaxed) == &_thread_heaps)
+            [[likely]]
+        {
+            const std::size_t c = class_index(bytes);
+
+            block->next = owner->local[c];
+            owner->local[c] = block;
+
+            return;
+        }
+
+        free_block* head = owner->remote.load(std::memory_order_relaxed);
+
+        do
+        {
+            block->next = head;
+        }
+        while(!owner->remote.compare_exchange_weak(
+            head, block, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    [[nodiscard]] bool do_is_equal(
+        const std::pmr::memory_resource& rhs) const noexcept override
+    {
+        return this == &rhs;
+    }
+
+public:
+    // The upstream resource defaults to `std::pmr::new_delete_resource()`
+    // rather than to the default resource, which might forward back to this
+    // resource if it is the active one of a `context_default_resource`.
+    [[nodiscard]] explicit sharded_pool_resource(
+        std::pmr::memory_resource* upstream =
+            std::pmr::new_delete_resource()) noexcept
+        : _upstream{upstream},
+          _id{_next_id.fetch_add(1, std::memory_order_relaxed)}
+    {}
+
+    sharded_pool_resource(const sharded_pool_resource&) = delete;
+    sharded_pool_resource(sharded_pool_resource&&) = delete;
+
+    // Returns all pages to the upstream resource, even if blocks allocated
+    // from them were not deallocated.
+    ~sharded_pool_resource() override
+    {
+        const std::lock_guard lock{_registry_mutex};
+
+        for(heap* const h : _heaps)
+        {
+            heap** link = h->thread.load(std::memory_order_relaxed);
+
+            if(link != nullptr && link != detached())
+            {
+                while(*link != h)
+                {
+                    link = &(*link)->thread_next;
+                }
+
+                *link = h->thread_next;
+            }
+
+            while(page_header* const page = h->pages)
+            {
+                h->pages = page->next;
+                _upstream->deallocate(page, page_size, page_size);
+            }
+
+            delete h;
+        }
+    }
+
+    [[nodiscard]] std::pmr::memory_resource* upstream_resource() const noexcept
+    {
+        return _upstream;
+    }
+
+    // Returns the number of heaps, which is at most the largest number of
+    // threads that used the resource at the same time.
+    [[nodiscard]] std::size_t heap_count() const
+    {
+        const std::lock_guard lock{_registry_mutex};
+        return _heaps.size();
+    }
+};
+
+// Memory resource that forwards every allocation to the resource of the
+// innermost `pmr_context` of the calling thread, or to `fallback` if there is
+// none. Installed as the process-wide default resource, it makes `std::pmr`
+// containers constructed without an explicit resource use the active arena
+// of each thread. Every block is prefixed by a header recording the resource
+// it came from, so deallocation is correct under any active context.
+// Allocations made by the active resource itself, e.g. by a default
+// constructed `std::pmr::monotonic_buffer_resource` whose upstream is this
+// resource, go to `fallback` instead of recursing.
+class context_default_resource : public std::pmr::memory_resource
+{
+private:
+    std::pmr::memory_resource* _fallback;
+
+    // Whether the calling thread is inside an allocation of the active
+    // resource.
+    static constinit inline thread_local bool _nested{false};
+
+    // Marks the calling thread as inside an allocation for its lifetime.
+    struct nesting_guard
+    {
+        [[nodiscard, gnu::always_inline]] nesting_guard() noexcept
+        {
+            _nested = true;
+        }
+
+        [[gnu::always_inline]] ~nesting_guard()
+        {
+            _nested = false;
+        }
+
+        nesting_guard(const nesting_guard&) = delete;
+        nesting_guard(nesting_guard&&) = delete;
+    };
+
+    [[nodiscard, gnu::always_inline]] static std::size_t header_size(
+        std::size_t alignment) noexcept
+    {
+        constexpr std::size_t min_alignment = alignof(std::max_align_t);
+        return alignment > min_alignment ? alignment : min_alignment;
+    }
+
+    [[nodiscard, gnu::always_inline]] std::pmr::memory_resource*
+    target() noexcept
+    {
+        if(_nested)
+        {
+            return _fallback;
+        }
+
+        void* slot = impl::top_value<pmr_context_data, true>();
+
+        if(slot == nullptr)
+        {
+            slot = impl::top_value<pmr_context_data, false>();
+        }
+
+        if(slot == nullptr)
+        {
+            return _fallback;
+        }
+
+        std::pmr::memory_resource* const mr =
+            static_cast<pmr_context_data*>(slot)->_mr;
+
+        // Avoid infinite recursion if the default resource itself is pushed.
+        return mr == this ? _fallback : mr;
+    }
+
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        std::pmr::memory_resource* const mr = target();
+        const std::size_t offset = header_size(alignment);
+
+        std::byte* result;
+
+        if(mr == _fallback)
+        {
+            result = static_cast<std::byte*>(
+                mr->allocate(bytes + offset, offset));
+        }
+        else
+        {
+            const nesting_guard ng;
+            result = static_cast<std::byte*>(
+                mr->allocate(bytes + offset, offset));
+        }
+
+        result += offset;
+
+        std::memcpy(result - sizeof(mr), &mr, sizeof(mr));
+        return result;
+    }
+
+    void do_deallocate(
+        void* p, std::size_t bytes, std::size_t alignment) override
+    {
+        std::pmr::memory_resource* mr;
+        std::memcpy(&mr, static_cast<std::byte*>(p) - sizeof(mr), sizeof(mr));
+
+        const std::size_t offset = header_size(alignment);
+        mr->deallocate(static_cast<std::byte*>(p) - offset, bytes + offset,
+            offset);
+    }
+
+    [[nodiscard]] bool do_is_equal(
+        const std::pmr::memory_resource& rhs) const noexcept override
+    {
+        return this == &rhs;
+    }
+
+public:
+    [[nodiscard]] explicit context_default_resource(
+        std::pmr::memory_resource* fallback) noexcept
+        : _fallback{fallback}
+    {}
+
+    context_default_resource(const context_default_resource&) = delete;
+    context_default_resource(context_default_resource&&) = delete;
+
+    [[nodiscard]] std::pmr::memory_resource* fallback() const noexcept
+    {
+        return _fallback;
+    }
+};
+
+// Installs a `context_default_resource` as the process-wide default resource,
+// falling back to the previous default. Subsequent calls have no effect, and
+// all return the installed resource. The resource is never destroyed, as
+// containers with static storage duration may still use it during exit.
+inline context_default_resource* install_context_default_resource()
+{
+    alignas(context_default_resource) static unsigned char
+        storage[sizeof(context_default_resource)];
+
+    static context_default_resource* const instance =
+        ::new(static_cast<void*>(storage))
+            context_default_resource{std::pmr::get_default_resource()};
+
+    static const bool installed =
+        (std::pmr::set_default_resource(instance), true);
+
+    static_cast<void>(installed);
+    return instance;
+}
+
+// Stateless allocator that fetches the memory resource from the top of the
+// context `Ctx` (whose data must have a `std::pmr::memory_resource* _mr`
+// member, like `pmr_context_data`) on every allocation. Containers using it
+// are as small as with `std::allocator`. Every block is prefixed by a header
+// recording the resource it was allocated from, and is returned to that
+// resource, whichever context is on top when it is deallocated.
+template <typename T, typename Ctx = pmr_context>
+class context_allocator
+{
+private:
+    static constexpr std::size_t header_size =
+        alignof(T) > alignof(std::max_align_t) ? alignof(T)
+                                               : alignof(std::max_align_t);
+
+    static constexpr std::size_t alignment = header_size;
+
+    [[nodiscard, gnu::always_inline]] static std::pmr::memory_resource*
+    resource() noexcept
+    {
+        return Ctx::get_top()._mr;
+    }
+
+public:
+    using value_type = T;
+    using is_always_equal = std::true_type;
+
+    [[nodiscard]] constexpr context_allocator() noexcept = default;
+
+    template <typename U>
+    [[nodiscard]] constexpr context_allocator(
+        const context_allocator<U, Ctx>&) noexcept
+    {}
+
+    [[nodiscard]] T* allocate(std::size_t n)
+    {
+        if(n > (static_cast<std::size_t>(-1) - header_size) / sizeof(T))
+        {
+            throw std::bad_array_new_length{};
+        }
+
+        std::pmr::memory_resource* const mr = resource();
+
+        std::byte* const result =
+            static_cast<std::byte*>(
+                mr->allocate(n * sizeof(T) + header_size, alignment)) +
+            header_size;
+
+        std::memcpy(result - sizeof(mr), &mr, sizeof(mr));
+        return reinterpret_cast<T*>(result);
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept
+    {
+        std::byte* const block = reinterpret_cast<std::byte*>(p) - header_size;
+
+        std::pmr::memory_resource* mr;
+        std::memcpy(&mr, reinterpret_cast<std::byte*>(p) - sizeof(mr),
+            sizeof(mr));
+
+        mr->deallocate(block, n * sizeof(T) + header_size, alignment);
+    }
+
+    template <typename U>
+    [[nodiscard]] friend constexpr bool operator==(
+        const context_allocator&, const context_allocator<U, Ctx>&) noexcept
+    {
+        return true;
+    }
+};
+
+} // namespace tlcontext
+
+#endif
+
+//
+//
+//
+// Coroutine frame allocation
+// ----------------------------------------------------------------------------
+
+#ifdef TLCONTEXT_COROUTINES
+
+#include <memory_resource>
+#include <new>
+
+namespace tlcontext::impl {
+
+// Per-thread cache of coroutine frames allocated while no `pmr_context` is
+// active, with one free list per multiple of `frame_granularity` bytes.
+// Frames released on a thread return to that thread's cache, regardless of
+// which thread allocated them.
+class frame_cache
+{
+public:
+    static constexpr std::size_t frame_granularity = 64;
+    static constexpr std::size_t class_count = 32;
+    static constexpr std::size_t max_frame = frame_granularity * class_count;
+    static constexpr std::size_t list_limit = 64;
+
+private:
+    struct free_frame
+    {
+        free_frame* next;
+    };
+
+    free_frame* _lists[class_count]{};
+    std::size_t _sizes[class_count]{};
+
+    [[nodiscard, gnu::always_inline]] static std::size_t class_of(
+        std::size_t bytes) noexcept
+    {
+        return (bytes - 1) / frame_granularity;
+    }
+
+    [[nodiscard, gnu::always_inline]] static std::size_t class_bytes(
+        std::size_t index) noexcept
+    {
+        return (index + 1) * frame_granularity;
+    }
+
+public:
+    constexpr frame_cache() = default;
+
+    frame_cache(const frame_cache&) = delete;
+    frame_cache(frame_cache&&) = delete;
+
+    // Frees every cached frame. Called on thread exit by `frame_cache_owner`.
+    void free_frames() noexcept
+    {
+        for(std::size_t i = 0; i < class_count; ++i)
+        {
+            while(free_frame* const frame = _lists[i])
+            {
+                _lists[i] = frame->next;
+                ::operator delete(frame, class_bytes(i));
+            }
+
+            _sizes[i] = 0;
+        }
+    }
+
+    [[nodiscard, gnu::always_inline]] void* allocate(std::size_t bytes);
+
+    [[gnu::always_inline]] void deallocate(void* p, std::size_t bytes) noexcept
+    {
+        if(bytes > max_frame) [[unlikely]]
+        {
+            ::operator delete(p, bytes);
+            return;
+        }
+
+        const std::size_t index = class_of(bytes);
+
+        if(_sizes[index] == list_limit) [[unlikely]]
+        {
+            ::operator delete(p, class_bytes(index));
+            return;
+        }
+
+        _lists[index] = ::new(p) free_frame{_lists[index]};
+        ++_sizes[index];
+    }
+};
+
+constinit inline thread_local frame_cache frame_cache_instance;
+
+struct frame_cache_owner
+{
+    ~frame_cache_owner()
+    {
+        frame_cache_instance.free_frames();
+    }
+};
+
+inline thread_local frame_cache_owner frame_cache_owner_instance;
+
+inline void* frame_cache::allocate(std::size_t bytes)
+{
+    if(bytes > max_frame) [[unlikely]]
+    {
+        return ::operator new(bytes);
+    }
+
+    const std::size_t index = class_of(bytes);
+
+    if(free_frame* const frame = _lists[index]) [[likely]]
+    {
+        _lists[index] = frame->next;
+        --_sizes[index];
+        return frame;
+    }
+
+    // Registers the release of cached frames on thread exit.
+    static_cast<void>(&frame_cache_owner_instance);
+    return ::operator new(class_bytes(index));
+}
+
+} // namespace tlcontext::impl
+
+namespace tlcontext {
+
+// Base class for coroutine promise types, whose frames are then allocated
+// from the resource of the innermost `pmr_context` of the calling thread, or
+// from a per-thread frame cache if there is none. The resource is stored at
+// the end of every frame, so that frames can be destroyed under any context;
+// it is not owned, so it must outlive every frame allocated from it, which
+// includes coroutines that are suspended or detached when its context exits.
+struct context_promise_base
+{
+private:
+    static constexpr std::size_t alignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+    [[nodiscard, gnu::always_inline]] static std::size_t trailer_offset(
+        std::size_t size) noexcept
+    {
+        constexpr std::size_t a = alignof(std::pmr::memory_resource*);
+        return (size + a - 1) / a * a;
+    }
+
+public:
+    [[nodiscard]] static void* operator new(std::size_t size)
+    {
+        std::pmr::memory_resource* mr = nullptr;
+
+        if(void* slot = impl::top_value<pmr_context_data, true>())
+        {
+            mr = static_cast<pmr_context_data*>(slot)->_mr;
+        }
+        else if(void* slot = impl::top_value<pmr_context_data, false>())
+        {
+            mr = static_cast<pmr_context_data*>(slot)->_mr;
+        }
+
+        const std::size_t offset = trailer_offset(size);
+        const std::size_t bytes = offset + sizeof(mr);
+
+        void* const frame = mr == nullptr
+                                ? impl::frame_cache_instance.allocate(bytes)
+                                : mr->allocate(bytes, alignment);
+
+        std::memcpy(static_cast<std::byte*>(frame) + offset, &mr, sizeof(mr));
+        return frame;
+    }
+
+    static void operator delete(void* p, std::size_t size) noexcept
+    {
+        const std::size_t offset = trailer_offset(size);
+        const std::size_t bytes = offset + sizeof(std::pmr::memory_resource*);
+
+        std::pmr::memory_resource* mr;
+        std::memcpy(&mr, static_cast<std::byte*>(p) + offset, sizeof(mr));
+
+        if(mr == nullptr)
+        {
+            impl::frame_cache_instance.deallocate(p, bytes);
+            return;
+        }
+
+        mr->deallocate(p, bytes, alignment);
+    }
+};
+
+} // namespace tlcontext
+
+#endif
+
+//
+//
+//
+// Allocation checks
+// ----------------------------------------------------------------------------
+
+#ifdef TLCONTEXT_NO_ALLOC
+
+#include <atomic>
+
+#ifdef TLCONTEXT_NO_ALLOC_ABORT
+#include <cstdio>
+#include <cstdlib>
+#endif
+
+namespace tlcontext {
+
+// Context of a scope that must not allocate. Scopes link to the enclosing
+// one, to report the whole chain of labels. The counter is atomic, as
+// snapshots can propagate a scope to other threads.
+struct no_alloc_scope
+{
+    const char* label;
+    no_alloc_scope* outer;
+    std::atomic<std::size_t> allocations;
+};
+
+using no_alloc_context = helper<no_alloc_scope>;
+
+} // namespace tlcontext
+
+namespace tlcontext::impl {
+
+constinit inline std::atomic<std::size_t> no_alloc_violations{0};
+
+// Labels of the scopes of the last violation on each thread, outermost first.
+constinit inline thread_local char no_alloc_chain[256]{};
+
+// Records an allocation made under `scope`. Must not allocate.
+[[gnu::cold, gnu::noinline]] inline void report_allocation(
+    no_alloc_scope* scope) noexcept
+{
+    no_alloc_violations.fetch_add(1, std::memory_order_relaxed);
+
+    constexpr std::size_t max_depth = 16;
+    const char* labels[max_depth];
+    std::size_t depth = 0;
+
+    for(no_alloc_scope* s = scope; s != nullptr; s = s->outer)
+    {
+        s->allocations.fetch_add(1, std::memory_order_relaxed);
+
+        if(depth < max_depth)
+        {
+            labels[depth++] = s->label;
+        }
+    }
+
+    char* out = no_alloc_chain;
+    char* const end = no_alloc_chain + sizeof(no_alloc_chain) - 1;
+
+    for(std::size_t i = depth; i-- > 0;)
+    {
+        for(const char* c = labels[i]; *c != '\0' && out != end; ++c)
+        {
+            *out++ = *c;
+        }
+
+        for(const char* c = " > "; i != 0 && *c != '\0' && out != end; ++c)
+        {
+            *out++ = *c;
+        }
+    }
+
+    *out = '\0';
+
+#ifdef TLCONTEXT_NO_ALLOC_ABORT
+    std::fputs("TLCONTEXT FATAL ERROR: allocation in no-alloc scope '", stderr);
+    std::fputs(no_alloc_chain, stderr);
+    std::fputs("'\n", stderr);
+
+    std::abort();
+#endif
+}
+
+// Called by the allocation hook on every allocation. Outside of a
+// `no_alloc_guard` this is a single load from the slot of the thread.
+[[gnu::always_inline]] inline void check_allocation() noexcept
+{
+    if(void* const slot = top_value<no_alloc_scope, true>()) [[unlikely]]
+    {
+        report_allocation(static_cast<no_alloc_scope*>(slot));
+    }
+}
+
+} // namespace tlcontext::impl
+
+namespace tlcontext {
+
+// RAII guard marking a scope of the calling thread that must not allocate.
+// With the hook enabled by `TLCONTEXT_NO_ALLOC_HOOK`, allocations made under
+// it are counted in the guard and in all enclosing guards.
+class [[nodiscard]] no_alloc_guard
+{
+private:
+    impl::guard<no_alloc_scope, true /* local */> _guard;
+
+    // Scope pushed by `_guard`.
+    const no_alloc_scope* _scope;
+
+    [[nodiscard]] static no_alloc_scope* enclosing() noexcept
+    {
+        return static_cast<no_alloc_scope*>(
+            impl::top_value<no_alloc_scope, true>());
+    }
+
+public:
+    [[nodiscard]] explicit no_alloc_guard(const char* label) noexcept
+        : _guard{label, enclosing(), std::size_t{0}}, _scope{enclosing()}
+    {}
+
+    no_alloc_guard(const no_alloc_guard&) = delete;
+    no_alloc_guard(no_alloc_guard&&) = delete;
+
+    // Returns the number of allocations made under this guard, including
+    // those under nested guards and on threads it was propagated to.
+    [[nodiscard]] std::size_t allocations() const noexcept
+    {
+        return _scope->allocations.load(std::memory_order_relaxed);
+    }
+};
+
+// Returns the number of allocations made under any `no_alloc_guard`.
+[[nodiscard]] inline std::size_t no_alloc_violations() noexcept
+{
+    return impl::no_alloc_violations.load(std::memory_order_relaxed);
+}
+
+// Returns the labels of the scopes of the last allocation made under a
+// `no_alloc_guard` on the calling thread, as "outer > inner".
+[[nodiscard]] inline const char* last_no_alloc_violation() noexcept
+{
+    return impl::no_alloc_chain;
+}
+
+} // namespace tlcontext
+
+#endif
+
+//
+//
+//
+// Priority scheduling
+// ----------------------------------------------------------------------------
+
+#ifdef TLCONTEXT_SCHEDULER
+
+#include <algorithm>
+#include <bit>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+namespace tlcontext::impl {
+
+// Bounded lock-free multi-producer multi-consumer queue of trivially copyable
+// values, with one sequence number per cell. The capacity is rounded up to a
+// power of two.
+template <typename T>
+class mpmc_queue
+{
+private:
+    struct cell
+    {
+        std::atomic<std::size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<cell[]> _cells;
+    std::size_t _mask;
+
+    alignas(64) std::atomic<std::size_t> _enqueue_pos{0};
+    alignas(64) std::atomic<std::size_t> _dequeue_pos{0};
+
+public:
+    [[nodiscard]] explicit mpmc_queue(std::size_t capacity)
+        : _cells{new cell[std::bit_ceil(capacity < 2 ? 2 : capacity)]},
+          _mask{std::bit_ceil(capacity < 2 ? 2 : capacity) - 1}
+    {
+        for(std::size_t i = 0; i <= _mask; ++i)
+        {
+            _cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    [[nodiscard]] bool try_push(const T& x) noexcept
+    {
+        std::size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+        cell* c;
+
+        for(;;)
+        {
+            c = &_cells[pos & _mask];
+
+            const std::size_t seq = c->sequence.load(std::memory_order_acquire);
+            const auto diff = static_cast<std::ptrdiff_t>(seq - pos);
+
+            if(diff == 0)
+            {
+                if(_enqueue_pos.compare_exchange_weak(
+                       pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if(diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = _enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        c->data = x;
+        c->sequence.store(pos + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    [[nodiscard]] bool try_pop(T& x) noexcept
+    {
+        std::size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+        cell* c;
+
+        for(;;)
+        {
+            c = &_cells[pos & _mask];
+
+            const std::size_t seq = c->sequence.load(std::memory_order_acquire);
+            const auto diff = static_cast<std::ptrdiff_t>(seq - (pos + 1));
+
+            if(diff == 0)
+            {
+                if(_dequeue_pos.compare_exchange_weak(
+                       pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if(diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = _dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        x = c->data;
+        c->sequence.store(pos + _mask + 1, std::memory_order_release);
+
+        return true;
+    }
+};
+
+// Type-erased task submitted to a `priority_scheduler`.
+struct scheduled_task
+{
+    std::size_t priority;
+
+    explicit scheduled_task(std::size_t p) noexcept : priority{p}
+    {}
+
+    virtual ~scheduled_task() = default;
+    virtual void run() = 0;
+};
+
+template <typename F>
+struct scheduled_task_of final : scheduled_task
+{
+    F f;
+
+    template <typename G>
+    explicit scheduled_task_of(std::size_t p, G&& g)
+        : scheduled_task{p}, f{static_cast<G&&>(g)}
+    {}
+
+    void run() override
+    {
+        f();
+    }
+};
+
+// Worker threads repeatedly looking for work through a callback, and sleeping
+// on a shared signal while there is none. Used by `priority_scheduler` and
+// `pipeline`, which own the queues of work.
+class worker_threads
+{
+private:
+    std::vector<std::thread> _threads;
+
+    // Bumped whenever work is made available and on stop, to wake idle
+    // workers.
+    alignas(64) std::atomic<std::uint32_t> _signal{0};
+    std::atomic<bool> _stopping{false};
+
+public:
+    [[nodiscard]] worker_threads() noexcept = default;
+
+    worker_threads(const worker_threads&) = delete;
+    worker_threads(worker_threads&&) = delete;
+
+    ~worker_threads()
+    {
+        stop();
+    }
+
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        return _threads.size();
+    }
+
+    // Starts a worker which invokes `on_start` once, and then `try_run` until
+    // it returns false after `stop` was called. `try_run` runs one piece of
+    // work, and returns whether it found any.
+    template <typename FStart, typename FTryRun>
+    void start(FStart on_start, FTryRun try_run)
+    {
+        _threads.emplace_back(
+            [this, on_start, try_run]() mutable
+            {
+                on_start();
+
+                for(;;)
+                {
+                    const std::uint32_t seen =
+                        _signal.load(std::memory_order_acquire);
+
+                    if(try_run())
+                    {
+                        continue;
+                    }
+
+                    if(_stopping.load(std::memory_order_acquire))
+                    {
+                        return;
+                    }
+
+                    _signal.wait(seen, std::memory_order_acquire);
+                }
+            });
+    }
+
+    // Wakes an idle worker, once work has been made available.
+    void notify_one() noexcept
+    {
+        _signal.fetch_add(1, std::memory_order_release);
+        _signal.notify_one();
+    }
+
+    // Lets the workers run all the remaining work, and joins them.
+    void stop() noexcept
+    {
+        _stopping.store(true, std::memory_order_release);
+
+        _signal.fetch_add(1, std::memory_order_release);
+        _signal.notify_all();
+
+        for(std::thread& thread : _threads)
+        {
+            thread.join();
+        }
+
+        _threads.clear();
+    }
+};
+
+} // namespace tlcontext::impl
+
+namespace tlcontext {
+
+// Context carrying the priority of the current work. Level `0` is the most
+// urgent one.
+struct priority_ctx_data
+{
+    std::size_t level;
+};
+
+using priority_context = helper<priority_ctx_data>;
+
+// Thread pool with one lock-free queue per priority level. Tasks take their
+// priority from the `priority_context` active at submission (or the lowest
+// priority if there is none), workers always pick the most urgent queued task,
+// and run it under a `priority_context` of its level, so that work spawned by
+// a task inherits its priority. An exception thrown by a task is caught by the
+// worker, which keeps running tasks; the first one is kept until retrieved by
+// `take_exception`.
+class priority_scheduler
+{
+private:
+    // Scheduler whose worker is the calling thread, if any.
+    inline static constinit thread_local const priority_scheduler*
+        _current_worker{nullptr};
+
+    std::vector<std::unique_ptr<impl::mpmc_queue<impl::scheduled_task*>>>
+        _queues;
+
+    impl::worker_threads _workers;
+
+    // First exception thrown by a task since the last `take_exception`.
+    std::mutex _error_mutex;
+    std::exception_ptr _error;
+
+    [[nodiscard]] impl::scheduled_task* try_pop() noexcept
+    {
+        impl::scheduled_task* result;
+
+        for(const auto& queue : _queues)
+        {
+            if(queue->try_pop(result))
+            {
+                return result;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // Runs the most urgent queued task, if any, and returns whether there was
+    // one.
+    [[nodiscard]] bool run_one()
+    {
+        impl::scheduled_task* const task = try_pop();
+
+        if(task == nullptr)
+        {
+            return false;
+        }
+
+        try
+        {
+            priority_context::local_guard lg{task->priority};
+            task->run();
+        }
+        catch(...)
+        {
+            const std::lock_guard lock{_error_mutex};
+
+            if(_error == nullptr)
+            {
+                _error = std::current_exception();
+            }
+        }
+
+        delete task;
+        return true;
+    }
+
+public:
+    // Starts `worker_count` workers, which first invoke `on_start` with their
+    // index, e.g. to install a `worker_profile`. There must be at least one
+    // level and one worker.
+    template <typename F>
+        requires std::is_invocable_v<const F&, std::size_t>
+    [[nodiscard]] explicit priority_scheduler(std::size_t levels,
+        std::size_t worker_count, F on_start,
+        std::size_t queue_capacity = 4096)
+    {
+        if(levels == 0 || worker_count == 0) [[unlikely]]
+        {
+            impl::fatal("priority scheduler without levels or workers");
+        }
+
+        for(std::size_t i = 0; i < levels; ++i)
+        {
+            _queues.push_back(
+                std::make_unique<impl::mpmc_queue<impl::scheduled_task*>>(
+                    queue_capacity));
+        }
+
+        for(std::size_t i = 0; i < worker_count; ++i)
+        {
+            _workers.start(
+                [this, i, on_start]
+                {
+                    _current_worker = this;
+                    on_start(i);
+                },
+                [this] { return run_one(); });
+        }
+    }
+
+    [[nodiscard]] explicit priority_scheduler(std::size_t levels,
+        std::size_t worker_count, std::size_t queue_capacity = 4096)
+        : priority_scheduler{
+              levels, worker_count, [](std::size_t) {}, queue_capacity}
+    {}
+
+    priority_scheduler(const priority_scheduler&) = delete;
+    priority_scheduler(priority_scheduler&&) = delete;
+
+    // Runs all the queued tasks, and joins the workers.
+    ~priority_scheduler()
+    {
+        _workers.stop();
+    }
+
+    [[nodiscard]] std::size_t levels() const noexcept
+    {
+        return _queues.size();
+    }
+
+    // Returns the first exception thrown by a task since the last call, or a
+    // null pointer if no task threw.
+    [[nodiscard]] std::exception_ptr take_exception()
+    {
+        const std::lock_guard lock{_error_mutex};
+        return std::exchange(_error, nullptr);
+    }
+
+    // Queues `f` with the priority of the `priority_context` of the calling
+    // thread, where levels past the last one are clamped to it. Waits if the
+    // queue of that priority is full, unless the calling thread is one of the
+    // workers, which could all be waiting: it then runs `f` immediately.
+    template <typename F>
+    void submit(F&& f)
+    {
+        const std::size_t last = _queues.size() - 1;
+        const std::size_t level =
+            priority_context::is_active()
+                ? std::min(priority_context::get_top().level, last)
+                : last;
+
+        impl::scheduled_task* const task =
+            new impl::scheduled_task_of<std::decay_t<F>>{
+                level, static_cast<F&&>(f)};
+
+        while(!_queues[level]->try_push(task))
+        {
+            if(_current_worker == this)
+            {
+                const std::unique_ptr<impl::scheduled_task> owned{task};
+
+                priority_context::local_guard lg{level};
+                task->run();
+
+                return;
+            }
+
+            std::this_thread::yield();
+        }
+
+        _workers.notify_one();
+    }
+};
+
+} // namespace tlcontext
+
+#endif
+
+//
+//
+//
+// Staged pipelines
+// ----------------------------------------------------------------------------
+
+#ifdef TLCONTEXT_PIPELINE
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+namespace tlcontext {
+
+// Context of the pipeline stage running on the calling thread.
+struct stage_info
+{
+    const char* name;
+    std::size_t index;
+};
+
+using stage_context = helper<stage_info>;
+
+// Cumulative statistics of a pipeline stage. The queue depth is sampled
+// whenever a batch is queued for the stage.
+struct stage_stats
+{
+    const char* name;
+    std::size_t batches;
+    std::size_t items;
+    std::chrono::nanoseconds busy;
+    std::size_t max_queue_depth;
+    double mean_queue_depth;
+};
+
+} // namespace tlcontext
+
+namespace tlcontext::impl {
+
+template <typename T>
+struct stage_body
+{
+    virtual ~stage_body() = default;
+    virtual void run(std::span<T> items) = 0;
+};
+
+template <typename T, typename F>
+struct stage_body_of final : stage_body<T>
+{
+    F f;
+
+    template <typename G>
+    explicit stage_body_of(G&& g) : f{static_cast<G&&>(g)}
+    {}
+
+    void run(std::span<T> items) override
+    {
+        f(items);
+    }
+};
+
+// Arena of the calling thread for pipeline stages, released after every
+// batch. Its upstream is not the default resource, which might forward to the
+// arena itself through a `context_default_resource`.
+[[nodiscard]] inline std::pmr::monotonic_buffer_resource& stage_arena()
+{
+    thread_local std::pmr::monotonic_buffer_resource arena{
+        64 * 1024, std::pmr::new_delete_resource()};
+
+    return arena;
+}
+
+} // namespace tlcontext::impl
+
+namespace tlcontext {
+
+// Engine running a graph of stages over batches of items of type `T`. A stage
+// runs on a batch once all the stages it comes after have, so independent
+// stages run concurrently and must access disjoint data. Every stage has a
+// bounded queue of batches: when it is full, the producing thread runs the
+// stage itself instead of waiting. Stages run under a `stage_context` naming
+// them, and a `pmr_context` of a per-thread arena released after each batch.
+// If a stage throws, the stages after it skip that batch, and `run` rethrows
+// the first exception once no thread uses the batches anymore.
+template <typename T>
+class pipeline
+{
+private:
+    struct batch
+    {
+        std::span<T> items;
+
+        // Number of predecessors of each stage that have yet to run.
+        std::unique_ptr<std::atomic<std::size_t>[]> waiting;
+
+        // Whether a stage threw on this batch.
+        std::atomic<bool> failed{false};
+    };
+
+    struct stage
+    {
+        const char* name;
+        std::unique_ptr<impl::stage_body<T>> body;
+        std::vector<std::size_t> successors;
+        std::size_t predecessors{0};
+        std::unique_ptr<impl::mpmc_queue<batch*>> queue;
+
+        std::atomic<std::size_t> depth{0};
+        std::atomic<std::size_t> max_depth{0};
+        std::atomic<std::size_t> depth_sum{0};
+        std::atomic<std::size_t> depth_samples{0};
+        std::atomic<std::size_t> batches{0};
+        std::atomic<std::size_t> items{0};
+        std::atomic<std::int64_t> busy_ns{0};
+    };
+
+    std::vector<std::unique_ptr<stage>> _stages;
+    std::size_t _queue_capacity;
+    std::size_t _worker_count;
+    impl::worker_threads _workers;
+
+    alignas(64) std::atomic<std::size_t> _executed{0};
+    std::size_t _expected{0};
+
+    // First exception thrown by a stage during the current run.
+    std::mutex _error_mutex;
+    std::exception_ptr _error;
+
+    // Runs stage `index` on `b`, unless an earlier stage threw on `b`.
+    void execute(std::size_t index, batch* b)
+    {
+        stage& s = *_stages[index];
+
+        if(!b->failed.load(std::memory_order_relaxed)) [[likely]]
+        {
+            std::pmr::monotonic_buffer_resource& arena = impl::stage_arena();
+
+            try
+            {
+                const stage_context::local_guard sg{s.name, index};
+                const pmr_context::local_guard ag{&arena};
+
+                const auto start = std::chrono::steady_clock::now();
+                s.body->run(b->items);
+                const auto elapsed = std::chrono::steady_clock::now() - start;
+
+                s.busy_ns.fetch_add(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        elapsed)
+                        .count(),
+                    std::memory_order_relaxed);
+
+                s.batches.fetch_add(1, std::memory_order_relaxed);
+                s.items.fetch_add(b->items.size(), std::memory_order_relaxed);
+            }
+            catch(...)
+            {
+                b->failed.store(true, std::memory_order_relaxed);
+
+                const std::lock_guard lock{_error_mutex};
+
+                if(_error == nullptr)
+                {
+                    _error = std::current_exception();
+                }
+            }
+
+            arena.release();
+        }
+
+        for(const std::size_t next : s.successors)
+        {
+            if(b->waiting[next].fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                enqueue(next, b);
+            }
+        }
+
+        if(_executed.fetch_add(1, std::memory_order_acq_rel) + 1 == _expected)
+        {
+            _executed.notify_all();
+        }
+    }
+
+    void enqueue(std::size_t index, batch* b)
+    {
+        stage& s = *_stages[index];
+
+        const std::size_t depth =
+            s.depth.fetch_add(1, std::memory_order_relaxed) + 1;
+
+        if(!s.queue->try_push(b))
+        {
+            s.depth.fetch_sub(1, std::memory_order_relaxed);
+            execute(index, b);
+
+            return;
+        }
+
+        std::size_t max = s.max_depth.load(std::memory_order_relaxed);
+        while(depth > max && !s.max_depth.compare_exchange_weak(
+                                 max, depth, std::memory_order_relaxed))
+        {
+        }
+
+        s.depth_sum.fetch_add(depth, std::memory_order_relaxed);
+        s.depth_samples.fetch_add(1, std::memory_order_relaxed);
+
+        _workers.notify_one();
+    }
+
+    // Runs one queued batch, favoring later stages to drain the pipeline.
+    [[nodiscard]] bool run_one()
+    {
+        for(std::size_t i = _stages.size(); i-- > 0;)
+        {
+            batch* b;
+
+            if(_stages[i]->queue->try_pop(b))
+            {
+                _stages[i]->depth.fetch_sub(1, std::memory_order_relaxed);
+                execute(i, b);
+
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+public:
+    // The queue capacity is rounded up to a power of two. Workers are started
+    // by the first `run`.
+    [[nodiscard]] explicit pipeline(
+        std::size_t worker_count, std::size_t queue_capacity = 64)
+        : _queue_capacity{queue_capacity}, _worker_count{worker_count}
+    {}
+
+    pipeline(const pipeline&) = delete;
+    pipeline(pipeline&&) = delete;
+
+    ~pipeline()
+    {
+        _workers.stop();
+    }
+
+    // Declares a stage running `f` with a `std::span<T>` of every batch after
+    // the stages `after`, and returns its index. Stages must be added before
+    // the first `run`.
+    template <typename F>
+    std::size_t add_stage(const char* name, F&& f,
+        std::initializer_list<std::size_t> after = {})
+    {
+        const std::size_t index = _stages.size();
+
+#ifdef TLCONTEXT_DEBUG
+        impl::abort_if(_workers.size() != 0, "stage added after the first run");
+#endif
+
+        auto s = std::make_unique<stage>();
+        s->name = name;
+        s->body = std::make_unique<impl::stage_body_of<T, std::decay_t<F>>>(
+            static_cast<F&&>(f));
+        s->queue = std::make_unique<impl::mpmc_queue<batch*>>(_queue_capacity);
+        s->predecessors = after.size();
+
+        for(const std::size_t prev : after)
+        {
+#ifdef TLCONTEXT_DEBUG
+            impl::abort_if(prev >= index, "stage depends on a later stage");
+#endif
+
+            _stages[prev]->successors.push_back(index);
+        }
+
+        _stages.push_back(std::move(s));
+        return index;
+    }
+
+    // Runs all the stages over `items`, split in batches of `batch_size`, and
+    // returns once every stage has processed every batch. The calling thread
+    // takes part in the work. Runs must not overlap. The batch size must not
+    // be zero.
+    void run(std::span<T> items, std::size_t batch_size)
+    {
+        if(batch_size == 0) [[unlikely]]
+        {
+            impl::fatal("pipeline batch size of zero");
+        }
+
+        const std::size_t batch_count =
+            (items.size() + batch_size - 1) / batch_size;
+
+        std::vector<batch> batches(batch_count);
+
+        for(std::size_t i = 0; i < batch_count; ++i)
+        {
+            batches[i].items = items.subspan(i * batch_size,
+                std::min(batch_size, items.size() - i * batch_size));
+
+            batches[i].waiting.reset(
+                new std::atomic<std::size_t>[_stages.size()]);
+
+            for(std::size_t j = 0; j < _stages.size(); ++j)
+            {
+                batches[i].waiting[j].store(
+                    _stages[j]->predecessors, std::memory_order_relaxed);
+            }
+        }
+
+        _expected = batch_count * _stages.size();
+        _executed.store(0, std::memory_order_release);
+
+        while(_workers.size() < _worker_count)
+        {
+            _workers.start([] {}, [this] { return run_one(); });
+        }
+
+        for(batch& b : batches)
+        {
+            for(std::size_t j = 0; j < _stages.size(); ++j)
+            {
+                if(_stages[j]->predecessors == 0)
+                {
+                    enqueue(j, &b);
+                }
+            }
+        }
+
+        for(;;)
+        {
+            const std::size_t executed =
+                _executed.load(std::memory_order_acquire);
+
+            if(executed == _expected)
+            {
+                break;
+            }
+
+            if(!run_one())
+            {
+                _executed.wait(executed, std::memory_order_acquire);
+            }
+        }
+
+        // Every batch has been fully processed, so the workers no longer
+        // reference them.
+        if(_error != nullptr) [[unlikely]]
+        {
+            std::rethrow_exception(std::exchange(_error, nullptr));
+        }
+    }
+
+    [[nodiscard]] std::vector<stage_stats> stats() const
+    {
+        std::vector<stage_stats> result;
+
+        for(const std::unique_ptr<stage>& s : _stages)
+        {
+            const std::size_t samples = s->depth_samples.load();
+
+            result.push_back({s->name, s->batches.load(), s->items.load(),
+                std::chrono::nanoseconds{s->busy_ns.load()},
+                s->max_depth.load(),
+                samples == 0 ? 0.0
+                             : static_cast<double>(s->depth_sum.load()) /
+                                   static_cast<double>(samples)});
+        }
+
+        return result;
+    }
+};
+
+} // namespace tlcontext
+
+#endif
+
+//
+//
+//
+// Clocks
+// ----------------------------------------------------------------------------
+
+#ifdef TLCONTEXT_CLOCKS
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#if __has_include(<time.h>)
+#include <time.h>
+#endif
+
+namespace tlcontext {
+
+// Context selecting the time source of `context_clock`. Sources either publish
+// nanoseconds since the `steady_clock` epoch in `ticks`, or provide `read`.
+struct clock_source
+{
+    const std::atomic<std::int64_t>* ticks;
+    std::int64_t (*read)() noexcept;
+
+    [[nodiscard, gnu::always_inline]] std::int64_t now() const noexcept
+    {
+        return read != nullptr ? read()
+                               : ticks->load(std::memory_order_relaxed);
+    }
+};
+
+using clock_context = helper<clock_source>;
+
+// Clock reading the innermost `clock_context`, or `steady_clock` if there is
+// none. Its time points are interchangeable with the ones of `steady_clock`,
+// except when a `virtual_clock` is active.
+struct context_clock
+{
+    using rep = std::int64_t;
+    using period = std::nano;
+    using duration = std::chrono::nanoseconds;
+    using time_point = std::chrono::steady_clock::time_point;
+
+    static constexpr bool is_steady = true;
+
+    [[nodiscard, gnu::always_inline]] static time_point now() noexcept
+    {
+        void* slot = impl::top_value<clock_source, true>();
+
+        if(slot == nullptr)
+        {
+            slot = impl::top_value<clock_source, false>();
+        }
+
+        if(slot == nullptr)
+        {
+            return std::chrono::steady_clock::now();
+        }
+
+        return time_point{duration{static_cast<clock_source*>(slot)->now()}};
+    }
+};
+
+} // namespace tlcontext
+
+namespace tlcontext::impl {
+
+[[nodiscard]] inline std::int64_t steady_ticks() noexcept
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Reads `CLOCK_MONOTONIC_COARSE`, which has the epoch of `steady_clock` and a
+// resolution of one scheduler tick, without entering the kernel.
+[[nodiscard]] inline std::int64_t coarse_ticks() noexcept
+{
+#ifdef CLOCK_MONOTONIC_COARSE
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    return static_cast<std::int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+    return steady_ticks();
+#endif
+}
+
+} // namespace tlcontext::impl
+
+namespace tlcontext {
+
+// RAII guard making `context_clock` return the time at which it was pushed,
+// until `refresh()` is called.
+class [[nodiscard]] cached_clock_guard
+{
+private:
+    std::atomic<std::int64_t> _ticks{impl::steady_ticks()};
+    clock_context::local_guard _guard{&_ticks, nullptr};
+
+public:
+    [[nodiscard]] cached_clock_guard() noexcept = default;
+
+    cached_clock_guard(const cached_clock_guard&) = delete;
+    cached_clock_guard(cached_clock_guard&&) = delete;
+
+    void refresh() noexcept
+    {
+        _ticks.store(impl::steady_ticks(), std::memory_order_relaxed);
+    }
+};
+
+// RAII guard making `context_clock` read the coarse monotonic clock.
+class [[nodiscard]] coarse_clock_guard
+{
+private:
+    clock_context::local_guard _guard{nullptr, &impl::coarse_ticks};
+
+public:
+    [[nodiscard]] coarse_clock_guard() noexcept = default;
+
+    coarse_clock_guard(const coarse_clock_guard&) = delete;
+    coarse_clock_guard(coarse_clock_guard&&) = delete;
+};
+
+// Thread publishing the time every `period` to a shared atomic. Threads
+// push its `source()` to read the time with a single load.
+class clock_ticker
+{
+private:
+    alignas(64) std::atomic<std::int64_t> _ticks{impl::steady_ticks()};
+    std::atomic<bool> _stopping{false};
+    std::thread _thread;
+
+public:
+    [[nodiscard]] explicit clock_ticker(
+        std::chrono::nanoseconds period = std::chrono::milliseconds{1})
+        : _thread{[this, period]
+              {
+                  while(!_stopping.load(std::memory_order_relaxed))
+                  {
+                      std::this_thread::sleep_for(period);
+
+                      _ticks.store(
+                          impl::steady_ticks(), std::memory_order_relaxed);
+                  }
+              }}
+    {}
+
+    ~clock_ticker()
+    {
+        _stopping.store(true, std::memory_order_relaxed);
+        _thread.join();
+    }
+
+    clock_ticker(const clock_ticker&) = delete;
+    clock_ticker(clock_ticker&&) = delete;
+
+    [[nodiscard]] clock_source source() const noexcept
+    {
+        return {&_ticks, nullptr};
+    }
+};
+
+// Manually advanced time source, for deterministic tests and benchmarks. It
+// starts at the epoch.
+class virtual_clock
+{
+private:
+    std::atomic<std::int64_t> _ticks{0};
+
+public:
+    [[nodiscard]] virtual_clock() noexcept = default;
+
+    virtual_clock(const virtual_clock&) = delete;
+    virtual_clock(virtual_clock&&) = delete;
+
+    [[nodiscard]] clock_source source() const noexcept
+    {
+        return {&_ticks, nullptr};
+    }
+
+    void advance(std::chrono::nanoseconds d) noexcept
+    {
+        _ticks.fetch_add(d.count(), std::memory_order_relaxed);
+    }
+
+    void set(context_clock::time_point tp) noexcept
+    {
+        const auto since_epoch =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                tp.time_since_epoch());
+
+        _ticks.store(since_epoch.count(), std::memory_order_relaxed);
+    }
+};
+
+} // namespace tlcontext
+
+#endif
+
+//
+//
+//
+// Autotuning
+// ----------------------------------------------------------------------------
+
+#ifdef TLCONTEXT_AUTOTUNE
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace tlcontext {
+
+// Context of a scope being tuned, linking to the enclosing one. `hash`
+// identifies the path of labels from the outermost scope.
+struct tuning_path
+{
+    const char* label;
+    const tuning_path* parent;
+    std::uint64_t hash;
+};
+
+using tuning_context = helper<tuning_path>;
+
+} // namespace tlcontext
+
+namespace tlcontext::impl {
+
+inline constexpr char tuning_separator = '/';
+
+struct file_closer
+{
+    void operator()(std::FILE* file) const noexcept
+    {
+        std::fclose(file);
+    }
+};
+
+[[nodiscard]] inline std::uint64_t tuning_hash(
+    std::uint64_t parent, std::string_view label) noexcept
+{
+    std::uint64_t h = parent ^ 0xcbf29ce484222325ull;
+
+    for(const char c : label)
+    {
+        h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+    }
+
+    return (h ^ static_cast<unsigned char>(tuning_separator)) *
+           0x100000001b3ull;
+}
+
+} // namespace tlcontext::impl
+
+namespace tlcontext {
+
+// Tuner choosing among candidate parameter values per label path, as a
+// multi-armed bandit. Every candidate is tried once, then the fastest one (by
+// exponentially decayed mean time) is picked, except with a probability of
+// exploration that decays with the number of trials. Decisions can be saved
+// to and loaded from a file for warm starts. Thread-safe.
+class autotuner
+{
+private:
+    struct arm
+    {
+        double mean_ns;
+        std::size_t pulls;
+    };
+
+    struct entry
+    {
+        std::string path;
+        std::vector<arm> arms;
+        std::size_t pulls{0};
+    };
+
+    mutable std::mutex _mutex;
+
+    // Keyed by the hash of the path, which is compared as well on lookup.
+    std::unordered_multimap<std::uint64_t, entry> _entries;
+    std::uint64_t _rng{0x9e3779b97f4a7c15ull};
+    double _exploration;
+    double _weight;
+
+    [[nodiscard]] double random() noexcept
+    {
+        _rng ^= _rng << 13;
+        _rng ^= _rng >> 7;
+        _rng ^= _rng << 17;
+
+        return static_cast<double>(_rng >> 11) * 0x1.0p-53;
+    }
+
+    [[nodiscard]] static std::size_t fastest(const entry& e) noexcept
+    {
+        std::size_t best = 0;
+
+        for(std::size_t i = 1; i < e.arms.size(); ++i)
+        {
+            if(e.arms[i].mean_ns < e.arms[best].mean_ns)
+            {
+                best = i;
+            }
+        }
+
+        return best;
+    }
+
+    [[nodiscard]] static std::string path_of(const tuning_path& scope)
+    {
+        if(scope.parent == nullptr)
+        {
+            return scope.label;
+        }
+
+        return path_of(*scope.parent) + impl::tuning_separator + scope.label;
+    }
+
+    // Returns whether `path` is the label path of `scope`.
+    [[nodiscard]] static bool is_path_of(
+        const tuning_path& scope, std::string_view path) noexcept
+    {
+        for(const tuning_path* s = &scope;; s = s->parent)
+        {
+            const std::string_view label = s->label;
+
+            if(!path.ends_with(label))
+            {
+                return false;
+            }
+
+            path.remove_suffix(label.size());
+
+            if(s->parent == nullptr)
+            {
+                return path.empty();
+            }
+
+            if(!path.ends_with(impl::tuning_separator))
+            {
+                return false;
+            }
+
+            path.remove_suffix(1);
+        }
+    }
+
+    // Returns the entry with `hash` whose path satisfies `matches`, if any.
+    template <typename Entries, typename P>
+    [[nodiscard]] static auto* find_entry(
+        Entries& entries, std::uint64_t hash, P&& matches)
+    {
+        auto [it, end] = entries.equal_range(hash);
+
+        for(; it != end; ++it)
+        {
+            if(matches(it->second.path))
+            {
+                return &it->second;
+            }
+        }
+
+        return static_cast<decltype(&it->second)>(nullptr);
+    }
+
+    [[nodiscard]] entry* find_entry(const tuning_path& scope)
+    {
+        return find_entry(_entries, scope.hash,
+            [&](std::string_view path) { return is_path_of(scope, path); });
+    }
+
+    [[nodiscard]] static std::uint64_t hash_of(std::string_view path) noexcept
+    {
+        std::uint64_t h = 0;
+
+        for(std::size_t begin = 0; begin <= path.size();)
+        {
+            std::size_t end = path.find(impl::tuning_separator, begin);
+            end = end == std::string_view::npos ? path.size() : end;
+
+            h = impl::tuning_hash(h, path.substr(begin, end - begin));
+            begin = end + 1;
+        }
+
+        return h;
+    }
+
+public:
+    // `exploration` is the initial probability of trying a random candidate,
+    // and `weight` the weight of each new timing in the decayed means.
+    [[nodiscard]] explicit autotuner(
+        double exploration = 0.2, double weight = 0.2) noexcept
+        : _exploration{exploration}, _weight{weight}
+    {}
+
+    autotuner(const autotuner&) = delete;
+    autotuner(autotuner&&) = delete;
+
+    // Returns the index of the candidate to run next for `scope`, among
+    // `count` candidates, which must not be zero.
+    [[nodiscard]] std::size_t choose(
+        const tuning_path& scope, std::size_t count)
+    {
+        if(count == 0) [[unlikely]]
+        {
+            impl::fatal("no tuning candidates");
+        }
+
+        const std::lock_guard lock{_mutex};
+
+        entry* found = find_entry(scope);
+
+        if(found == nullptr)
+        {
+            found = &_entries.emplace(scope.hash, entry{path_of(scope), {}, 0})
+                         ->second;
+        }
+
+        entry& e = *found;
+
+        if(e.arms.size() != count)
+        {
+            e.arms.assign(count, arm{0.0, 0});
+            e.pulls = 0;
+        }
+
+        for(std::size_t i = 0; i < count; ++i)
+        {
+            if(e.arms[i].pulls == 0)
+            {
+                return i;
+            }
+        }
+
+        const double trials = static_cast<double>(e.pulls / count);
+        const double epsilon = _exploration / std::sqrt(1.0 + trials);
+
+        if(random() < epsilon)
+        {
+            return static_cast<std::size_t>(random() * count) % count;
+        }
+
+        return fastest(e);
+    }
+
+    // Records that candidate `index` of the `count` candidates of `scope`
+    // took `elapsed`. The timing is dropped if the candidates of `scope`
+    // changed since `choose`, e.g. through a concurrent `load`.
+    void record(const tuning_path& scope, std::size_t index, std::size_t count,
+        std::chrono::nanoseconds elapsed)
+    {
+        const std::lock_guard lock{_mutex};
+
+        entry* const found = find_entry(scope);
+
+        if(found == nullptr || found->arms.size() != count || index >= count)
+            [[unlikely]]
+        {
+            return;
+        }
+
+        entry& e = *found;
+        arm& a = e.arms[index];
+
+        const double x = static_cast<double>(elapsed.count());
+        a.mean_ns = a.pulls == 0 ? x : a.mean_ns + _weight * (x - a.mean_ns);
+
+        ++a.pulls;
+        ++e.pulls;
+    }
+
+    // Returns the index of the fastest candidate so far for the label path
+    // `path` (e.g. "outer/inner"), if every candidate has been tried.
+    [[nodiscard]] std::optional<std::size_t> best(std::string_view path) const
+    {
+        const std::lock_guard lock{_mutex};
+
+        const entry* const e = find_entry(_entries, hash_of(path),
+            [&](std::string_view p) { return p == path; });
+
+        if(e == nullptr || e->arms.empty())
+        {
+            return std::nullopt;
+        }
+
+        for(const arm& a : e->arms)
+        {
+            if(a.pulls == 0)
+            {
+                return std::nullopt;
+            }
+        }
+
+        return fastest(*e);
+    }
+
+    // Writes one line per label path: the length of the path, the path, the
+    // number of candidates, and the mean time and number of trials of each
+    // candidate. Paths are written verbatim after their length, so they may
+    // contain any character. Returns whether the file was written.
+    bool save(const char* filename) const
+    {
+        std::unique_ptr<std::FILE, impl::file_closer> file{
+            std::fopen(filename, "w")};
+
+        if(file == nullptr)
+        {
+            return false;
+        }
+
+        const std::lock_guard lock{_mutex};
+
+        for(const auto& [hash, e] : _entries)
+        {
+            std::fprintf(file.get(), "%zu\t", e.path.size());
+            std::fwrite(e.path.data(), 1, e.path.size(), file.get());
+            std::fprintf(file.get(), "\t%zu", e.arms.size());
+
+            for(const arm& a : e.arms)
+            {
+                std::fprintf(file.get(), "\t%.17g\t%zu", a.mean_ns, a.pulls);
+            }
+
+            std::fputc('\n', file.get());
+        }
+
+        return std::fclose(file.release()) == 0;
+    }
+
+    // Reads decisions written by `save`, replacing the ones for the same label
+    // paths. Returns whether the file could be read; if any line is malformed,
+    // no decision is changed.
+    bool load(const char* filename)
+    {
+        std::vector<entry> loaded;
+
+        {
+            const std::unique_ptr<std::FILE, impl::file_closer> file{
+                std::fopen(filename, "r")};
+
+            if(file == nullptr)
+            {
+                return false;
+            }
+
+            for(;;)
+            {
+                std::size_t length;
+                const int fields = std::fscanf(file.get(), " %zu", &length);
+
+                if(fields == EOF)
+                {
+                    break;
+                }
+
+                if(fields != 1 || std::fgetc(file.get()) != '\t')
+                {
+                    return false;
+                }
+
+                entry e{std::string(length, '\0'), {}, 0};
+
+                if(std::fread(e.path.data(), 1, length, file.get()) != length)
+                {
+                    return false;
+                }
+
+                std::size_t count;
+
+                if(std::fscanf(file.get(), "\t%zu", &count) != 1)
+                {
+                    return false;
+                }
+
+                e.arms.resize(count);
+
+                for(arm& a : e.arms)
+                {
+                    if(std::fscanf(file.get(), "\t%lg\t%zu", &a.mean_ns,
+                           &a.pulls) != 2)
+                    {
+                        return false;
+                    }
+
+                    e.pulls += a.pulls;
+                }
+
+                if(std::fgetc(file.get()) != '\n')
+                {
+                    return false;
+                }
+
+                loaded.push_back(std::move(e));
+            }
+        }
+
+        const std::lock_guard lock{_mutex};
+
+        for(entry& e : loaded)
+        {
+            const std::uint64_t hash = hash_of(e.path);
+
+            if(entry* const existing = find_entry(_entries, hash,
+                   [&](std::string_view p) { return p == e.path; }))
+            {
+                *existing = std::move(e);
+            }
+            else
+            {
+                _entries.emplace(hash, std::move(e));
+            }
+        }
+
+        return true;
+    }
+};
+
+using autotune_context = helper<autotuner>;
+
+// RAII scope running with the candidate picked by the innermost
+// `autotune_context`, timed with `context_clock` and reported to the tuner on
+// destruction. Scopes nested in it are tuned by their own label path. If no
+// tuner is active, the first candidate is always picked. There must be at
+// least one candidate.
+template <typename T>
+class [[nodiscard]] tuning_scope
+{
+private:
+    autotuner* _tuner;
+    impl::guard<tuning_path, true /* local */> _guard;
+    std::size_t _index;
+    std::size_t _count;
+    T _value;
+    context_clock::time_point _start;
+
+    [[nodiscard]] static const tuning_path* enclosing() noexcept
+    {
+        return static_cast<const tuning_path*>(
+            impl::top_value<tuning_path, true>());
+    }
+
+    [[nodiscard]] static std::size_t choose(
+        autotuner* tuner, std::size_t count)
+    {
+        if(tuner != nullptr)
+        {
+            return tuner->choose(tuning_context::get_local(), count);
+        }
+
+        if(count == 0) [[unlikely]]
+        {
+            impl::fatal("no tuning candidates");
+        }
+
+        return 0;
+    }
+
+public:
+    [[nodiscard]] explicit tuning_scope(
+        const char* label, std::span<const T> candidates)
+        : _tuner{autotune_context::is_active() ? &autotune_context::get_top()
+                                               : nullptr},
+          _guard{label, enclosing(),
+              impl::tuning_hash(
+                  enclosing() != nullptr ? enclosing()->hash : 0, label)},
+          _index{choose(_tuner, candidates.size())},
+          _count{candidates.size()},
+          _value{candidates[_index]},
+          _start{context_clock::now()}
+    {}
+
+    ~tuning_scope()
+    {
+        if(_tuner != nullptr)
+        {
+            _tuner->record(tuning_context::get_local(), _index, _count,
+                context_clock::now() - _start);
+        }
+    }
+
+    tuning_scope(const tuning_scope&) = delete;
+    tuning_scope(tuning_scope&&) = delete;
+
+    [[nodiscard]] const T& value() const noexcept
+    {
+        return _value;
+    }
+
+    [[nodiscard]] std::size_t index() const noexcept
+    {
+        return _index;
+    }
+};
+
+// Returns a scope running with one of `candidates`, tuned under `label`.
+template <typename T>
+[[nodiscard]] tuning_scope<T> tune(
+    const char* label, std::initializer_list<T> candidates)
+{
+    return tuning_scope<T>{
+        label, std::span<const T>{candidates.begin(), candidates.size()}};
+}
+
+} // namespace tlcontext
+
+#endif
+
+//
+//
+//
+// Sender/receiver integration
+// ----------------------------------------------------------------------------
+
+#ifdef TLCONTEXT_EXECUTION
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <tuple>
+
+// Minimal subset of `std::execution` (P2300): `just`, `then`, `read_context`,
+// `schedule` on a `priority_scheduler`, and `sync_wait`. Senders, receivers and
+// operation states use the member customizations also accepted by stdexec
+// (`connect`, `start`, `set_value`, `set_error`, `set_stopped`, `get_env` and
+// `query`). Completion signatures are simplified: every sender completes with
+// at most one set of values, declared as the `std::tuple` `value_types`.
+namespace tlcontext::exec {
+
+struct empty_env
+{
+};
+
+template <typename R>
+[[nodiscard]] decltype(auto) get_env(const R& r) noexcept
+{
+    if constexpr(requires { r.get_env(); })
+    {
+        return r.get_env();
+    }
+    else
+    {
+        return empty_env{};
+    }
+}
+
+template <typename R, typename... Vs>
+void set_value(R&& r, Vs&&... vs) noexcept
+{
+    static_cast<R&&>(r).set_value(static_cast<Vs&&>(vs)...);
+}
+
+template <typename R, typename E>
+void set_error(R&& r, E&& e) noexcept
+{
+    static_cast<R&&>(r).set_error(static_cast<E&&>(e));
+}
+
+template <typename R>
+void set_stopped(R&& r) noexcept
+{
+    static_cast<R&&>(r).set_stopped();
+}
+
+// Connects a copy of `s` if it is an lvalue, so that senders are reusable.
+template <typename S, typename R>
+[[nodiscard]] auto connect(S&& s, R&& r)
+{
+    if constexpr(std::is_lvalue_reference_v<S>)
+    {
+        return std::remove_cvref_t<S>(s).connect(static_cast<R&&>(r));
+    }
+    else
+    {
+        return static_cast<S&&>(s).connect(static_cast<R&&>(r));
+    }
+}
+
+template <typename O>
+void start(O& op) noexcept
+{
+    op.start();
+}
+
+template <typename S, typename R>
+using connect_result_t =
+    decltype(exec::connect(std::declval<S>(), std::declval<R>()));
+
+template <typename S>
+using value_types_of_t = typename std::remove_cvref_t<S>::value_types;
+
+// Sender completing inline with copies of `Vs...`.
+template <typename... Vs>
+struct just_sender
+{
+    using value_types = std::tuple<Vs...>;
+
+    value_types values;
+
+    template <typename R>
+    struct operation
+    {
+        value_types values;
+        R receiver;
+
+        void start() & noexcept
+        {
+            std::apply(
+                [&](Vs&... vs)
+                { exec::set_value(std::move(receiver), std::move(vs)...); },
+                values);
+        }
+    };
+
+    template <typename R>
+    [[nodiscard]] operation<R> connect(R r) &&
+    {
+        return {std::move(values), std::move(r)};
+    }
+};
+
+template <typename... Vs>
+[[nodiscard]] just_sender<std::decay_t<Vs>...> just(Vs&&... vs)
+{
+    return {{static_cast<Vs&&>(vs)...}};
+}
+
+template <typename F, typename Tuple>
+struct then_result;
+
+template <typename F, typename... Vs>
+struct then_result<F, std::tuple<Vs...>>
+{
+    using result = std::invoke_result_t<F, Vs...>;
+
+    using type = std::conditional_t<std::is_void_v<result>, std::tuple<>,
+        std::tuple<result>>;
+};
+
+// Receiver invoking `f` with the values of the predecessor, and completing
+// with its result, or with the exception it throws.
+template <typename R, typename F>
+struct then_receiver
+{
+    R receiver;
+    F f;
+
+    template <typename... Vs>
+    void set_value(Vs&&... vs) && noexcept
+    {
+        try
+        {
+            if constexpr(std::is_void_v<std::invoke_result_t<F, Vs...>>)
+            {
+                std::invoke(f, static_cast<Vs&&>(vs)...);
+                exec::set_value(std::move(receiver));
+            }
+            else
+            {
+                exec::set_value(std::move(receiver),
+                    std::invoke(f, static_cast<Vs&&>(vs)...));
+            }
+        }
+        catch(...)
+        {
+            exec::set_error(std::move(receiver), std::current_exception());
+        }
+    }
+
+    template <typename E>
+    void set_error(E&& e) && noexcept
+    {
+        exec::set_error(std::move(receiver), static_cast<E&&>(e));
+    }
+
+    void set_stopped() && noexcept
+    {
+        exec::set_stopped(std::move(receiver));
+    }
+
+    [[nodiscard]] decltype(auto) get_env() const noexcept
+    {
+        return exec::get_env(receiver);
+    }
+};
+
+template <typename S, typename F>
+struct then_sender
+{
+    using value_types = typename then_result<F, value_types_of_t<S>>::type;
+
+    S sender;
+    F f;
+
+    template <typename R>
+    [[nodiscard]] auto connect(R r) &&
+    {
+        return exec::connect(std::move(sender),
+            then_receiver<R, F>{std::move(r), std::move(f)});
+    }
+};
+
+template <typename S, typename F>
+[[nodiscard]] then_sender<std::decay_t<S>, std::decay_t<F>> then(S&& s, F&& f)
+{
+    return {static_cast<S&&>(s), static_cast<F&&>(f)};
+}
+
+// Scheduler whose senders complete on a worker of a `priority_scheduler`, with
+// the priority of the `priority_context` active at `start`. If the task
+// cannot be submitted, the receiver completes with the error instead.
+class pool_scheduler
+{
+private:
+    priority_scheduler* _pool;
+
+public:
+    [[nodiscard]] explicit pool_scheduler(priority_scheduler& pool) noexcept
+        : _pool{&pool}
+    {}
+
+    struct sender
+    {
+        using value_types = std::tuple<>;
+
+        priority_scheduler* pool;
+
+        template <typename R>
+        struct operation
+        {
+            priority_scheduler* pool;
+            R receiver;
+
+            void start() & noexcept
+            {
+                try
+                {
+                    pool->submit(
+                        [this] { exec::set_value(std::move(receiver)); });
+                }
+                catch(...)
+                {
+                    exec::set_error(
+                        std::move(receiver), std::current_exception());
+                }
+            }
+        };
+
+        template <typename R>
+        [[nodiscard]] operation<R> connect(R r) &&
+        {
+            return {pool, std::move(r)};
+        }
+    };
+
+    [[nodiscard]] sender schedule() const noexcept
+    {
+        return {_pool};
+    }
+
+    [[nodiscard]] friend bool operator==(
+        const pool_scheduler&, const pool_scheduler&) noexcept = default;
+};
+
+template <typename Sch>
+[[nodiscard]] auto schedule(const Sch& sch)
+{
+    return sch.schedule();
+}
+
+// Completion of a `sync_wait`, on the stack of the waiting thread. It is
+// signaled under the lock, so that the waiter cannot return and destroy it
+// while the completing thread still uses it.
+template <typename T>
+struct sync_wait_state
+{
+    std::optional<T> result;
+    std::exception_ptr error;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done{false};
+
+    void complete() noexcept
+    {
+        const std::lock_guard lock{mutex};
+
+        done = true;
+        cv.notify_one();
+    }
+
+    void wait()
+    {
+        std::unique_lock lock{mutex};
+        cv.wait(lock, [this] { return done; });
+    }
+};
+
+template <typename T>
+struct sync_wait_receiver
+{
+    sync_wait_state<T>* state;
+
+    template <typename... Vs>
+    void set_value(Vs&&... vs) && noexcept
+    {
+        state->result.emplace(static_cast<Vs&&>(vs)...);
+        state->complete();
+    }
+
+    template <typename E>
+    void set_error(E&& e) && noexcept
+    {
+        if constexpr(std::is_same_v<std::decay_t<E>, std::exception_ptr>)
+        {
+            state->error = static_cast<E&&>(e);
+        }
+        else
+        {
+            state->error = std::make_exception_ptr(static_cast<E&&>(e));
+        }
+
+        state->complete();
+    }
+
+    void set_stopped() && noexcept
+    {
+        state->complete();
+    }
+};
+
+// Connects and starts `s`, and blocks until it completes on any thread.
+// Returns its values, or nothing if it was stopped, and rethrows its error.
+template <typename S>
+[[nodiscard]] std::optional<value_types_of_t<S>> sync_wait(S&& s)
+{
+    using value_type = value_types_of_t<S>;
+
+    sync_wait_state<value_type> state;
+
+    auto op = exec::connect(
+        static_cast<S&&>(s), sync_wait_receiver<value_type>{&state});
+
+    exec::start(op);
+
+    state.wait();
+
+    if(state.error)
+    {
+        std::rethrow_exception(state.error);
+    }
+
+    return std::move(state.result);
+}
+
+} // namespace tlcontext::exec
+
+namespace tlcontext {
+
+// Query of the context of type `T` in a receiver environment, e.g.
+// `get_context<T>(exec::get_env(r))`.
+template <typename T>
+struct get_context_t
+{
+    template <typename Env>
+    [[nodiscard]] T& operator()(const Env& env) const noexcept
+    {
+        return env.query(*this);
+    }
+};
+
+template <typename T>
+inline constexpr get_context_t<T> get_context{};
+
+// Receiver environment exposing the contexts of a snapshot (or the global
+// contexts, for types not in the snapshot) through `get_context`, and
+// forwarding every other query to `Env`.
+template <typename Env>
+struct context_env
+{
+    const context_snapshot* snapshot;
+    Env inner;
+
+    template <typename T>
+    [[nodiscard]] T& query(get_context_t<T>) const noexcept
+    {
+        T* ptr = snapshot->find<T>();
+
+        if(ptr == nullptr)
+        {
+            ptr = impl::slot_context<T>(impl::top_value<T, false>());
+        }
+
+#ifdef TLCONTEXT_DEBUG
+        impl::abort_if(ptr == nullptr, "no available context");
+#endif
+
+        return *ptr;
+    }
+
+    template <typename Q>
+        requires requires(const Env& env, Q q) { env.query(q); }
+    [[nodiscard]] decltype(auto) query(Q q) const noexcept
+    {
+        return inner.query(q);
+    }
+};
+
+// Sender completing inline with a reference to the context of type `T` found
+// in the environment of its receiver.
+template <typename T>
+struct read_context_sender
+{
+    using value_types = std::tuple<T&>;
+
+    template <typename R>
+    struct operation
+    {
+        R receiver;
+
+        void start() & noexcept
+        {
+            T& data = get_context<T>(exec::get_env(receiver));
+            exec::set_value(std::move(receiver), data);
+        }
+    };
+
+    template <typename R>
+    [[nodiscard]] operation<R> connect(R r) &&
+    {
+        return {std::move(r)};
+    }
+};
+
+template <typename T>
+[[nodiscard]] read_context_sender<T> read_context() noexcept
+{
+    return {};
+}
+
+namespace impl {
+
+// Operation state of `with_contexts`, owning the snapshot captured at connect.
+template <typename S, typename R>
+class contexts_operation
+{
+private:
+    struct receiver
+    {
+        contexts_operation* op;
+
+        // The guards restore the previous tops from their own storage, so the
+        // operation state may be destroyed by the completion.
+        template <typename... Vs>
+        void set_value(Vs&&... vs) && noexcept
+        {
+            const snapshot_guard sg{op->_snapshot};
+            exec::set_value(std::move(op->_receiver), static_cast<Vs&&>(vs)...);
+        }
+
+        template <typename E>
+        void set_error(E&& e) && noexcept
+        {
+            const snapshot_guard sg{op->_snapshot};
+            exec::set_error(std::move(op->_receiver), static_cast<E&&>(e));
+        }
+
+        void set_stopped() && noexcept
+        {
+            const snapshot_guard sg{op->_snapshot};
+            exec::set_stopped(std::move(op->_receiver));
+        }
+
+        [[nodiscard]] auto get_env() const noexcept
+        {
+            using env_type = std::decay_t<decltype(exec::get_env(
+                std::declval<const R&>()))>;
+
+            return context_env<env_type>{
+                &op->_snapshot, exec::get_env(op->_receiver)};
+        }
+    };
+
+    context_snapshot _snapshot;
+    R _receiver;
+    exec::connect_result_t<S, receiver> _child;
+
+public:
+    [[nodiscard]] explicit contexts_operation(S&& s, R r)
+        : _snapshot{capture_all()},
+          _receiver{std::move(r)},
+          _child{exec::connect(std::move(s), receiver{this})}
+    {}
+
+    contexts_operation(const contexts_operation&) = delete;
+    contexts_operation(contexts_operation&&) = delete;
+
+    void start() & noexcept
+    {
+        const snapshot_guard sg{_snapshot};
+        exec::start(_child);
+    }
+};
+
+} // namespace impl
+
+// Sender adaptor that captures the local contexts of the calling thread when
+// connected, exposes them in the environment of `S`'s receiver, and restores
+// them around every completion, on whichever thread it happens. Continuations
+// attached after it can then use `get_local` and `get_top` as usual.
+template <typename S>
+struct contexts_sender
+{
+    using value_types = exec::value_types_of_t<S>;
+
+    S sender;
+
+    template <typename R>
+    [[nodiscard]] impl::contexts_operation<S, R> connect(R r) &&
+    {
+        return impl::contexts_operation<S, R>{std::move(sender), std::move(r)};
+    }
+};
+
+template <typename S>
+[[nodiscard]] contexts_sender<std::decay_t<S>> with_contexts(S&& s)
+{
+    return {static_cast<S&&>(s)};
+}
+
+} // namespace tlcontext
+
+#endif
+
+//
+//
+//
+// Batched file I/O
+// ----------------------------------------------------------------------------
+
+#ifdef TLCONTEXT_IO
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <exception>
+#include <latch>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define TLCONTEXT_IMPL_IO_URING 1
+#endif
+#endif
+
+namespace tlcontext::impl {
+
+// Type-erased file read or write queued in an `io_batch`, together with the
+// callback receiving its result.
+struct io_operation
+{
+    void* buffer;
+    std::size_t size;
+    std::int64_t offset;
+    int fd;
+    bool write;
+
+    // Number of bytes transferred, or a negated `errno` value.
+    std::int64_t result{0};
+
+    explicit io_operation(void* b, std::size_t s, std::int64_t o, int f,
+        bool w) noexcept
+        : buffer{b}, size{s}, offset{o}, fd{f}, write{w}
+    {}
+
+    virtual ~io_operation() = default;
+    virtual void complete() = 0;
+
+    void run_blocking() noexcept
+    {
+        const ssize_t n = write ? ::pwrite(fd, buffer, size, offset)
+                                : ::pread(fd, buffer, size, offset);
+
+        result = n < 0 ? -static_cast<std::int64_t>(errno) : n;
+    }
+};
+
+template <typename F>
+struct io_operation_of final : io_operation
+{
+    F f;
+
+    template <typename G>
+    explicit io_operation_of(void* b, std::size_t s, std::int64_t o, int fd,
+        bool w, G&& g)
+        : io_operation{b, s, o, fd, w}, f{static_cast<G&&>(g)}
+    {}
+
+    void complete() override
+    {
+        f(result);
+    }
+};
+
+// Runs `ops` on a process-wide thread pool, split in one strided share per
+// worker, and waits for all of them. The pool is never destroyed, as batches
+// with static storage duration may still be flushed during exit.
+inline void run_on_pool(io_operation* const* ops, std::size_t count)
+{
+    static const std::size_t workers =
+        std::max(2u, std::thread::hardware_concurrency());
+
+    alignas(priority_scheduler) static unsigned char
+        storage[sizeof(priority_scheduler)];
+
+    static priority_scheduler& pool =
+        *::new(static_cast<void*>(storage)) priority_scheduler{1, workers};
+
+    const std::size_t shares = std::min(count, workers);
+    std::latch done{static_cast<std::ptrdiff_t>(shares)};
+
+    // The pool has a single priority level, regardless of the priority of the
+    // calling thread.
+    priority_context::local_guard lg{std::size_t{0}};
+
+    for(std::size_t share = 0; share < shares; ++share)
+    {
+        pool.submit(
+            [=, &done]
+            {
+                for(std::size_t i = share; i < count; i += shares)
+                {
+                    ops[i]->run_blocking();
+                }
+
+                done.count_down();
+            });
+    }
+
+    done.wait();
+}
+
+#ifdef TLCONTEXT_IMPL_IO_URING
+
+// Minimal `io_uring` instance, driven through raw system calls. Construction
+// fails silently if the kernel does not support `IORING_OP_READ` and
+// `IORING_OP_WRITE`, or if `io_uring` is disabled.
+class io_ring
+{
+private:
+    // Largest transfer of a single `read` or `write` on Linux.
+    static constexpr std::size_t max_transfer = 0x7ffff000;
+
+    int _fd{-1};
+
+    // Set when submission fails, after which the ring is no longer used.
+    bool _broken{false};
+
+    void* _sq_ptr{MAP_FAILED};
+    void* _cq_ptr{MAP_FAILED};
+    void* _sqes_ptr{MAP_FAILED};
+    std::size_t _sq_size{0};
+    std::size_t _cq_size{0};
+    std::size_t _sqes_size{0};
+
+    unsigned* _sq_tail{nullptr};
+    unsigned* _sq_array{nullptr};
+    unsigned _sq_mask{0};
+    unsigned _sq_entries{0};
+    io_uring_sqe* _sqes{nullptr};
+
+    unsigned* _cq_head{nullptr};
+    unsigned* _cq_tail{nullptr};
+    unsigned _cq_mask{0};
+    io_uring_cqe* _cqes{nullptr};
+
+    template <typename T>
+    [[nodiscard]] static T* at(void* base, std::uint32_t offset) noexcept
+    {
+        return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+    }
+
+    [[nodiscard]] void* map(std::size_t size, off_t offset) const noexcept
+    {
+        return ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, _fd, offset);
+    }
+
+    void release() noexcept
+    {
+        if(_sqes_ptr != MAP_FAILED)
+        {
+            ::munmap(_sqes_ptr, _sqes_size);
+        }
+
+        if(_cq_ptr != MAP_FAILED && _cq_ptr != _sq_ptr)
+        {
+            ::munmap(_cq_ptr, _cq_size);
+        }
+
+        if(_sq_ptr != MAP_FAILED)
+        {
+            ::munmap(_sq_ptr, _sq_size);
+        }
+
+        if(_fd >= 0)
+        {
+            ::close(_fd);
+        }
+
+        _fd = -1;
+    }
+
+    // Reaps the available completions, and returns their number.
+    [[nodiscard]] std::size_t reap(io_operation* const* ops) noexcept
+    {
+        unsigned head = *_cq_head;
+        const unsigned tail =
+            std::atomic_ref{*_cq_tail}.load(std::memory_order_acquire);
+
+        std::size_t reaped = 0;
+
+        for(; head != tail; ++head, ++reaped)
+        {
+            const io_uring_cqe& cqe = _cqes[head & _cq_mask];
+            ops[cqe.user_data]->result = cqe.res;
+        }
+
+        std::atomic_ref{*_cq_head}.store(head, std::memory_order_release);
+        return reaped;
+    }
+
+public:
+    [[nodiscard]] explicit io_ring(unsigned entries) noexcept
+    {
+        io_uring_params params{};
+
+        _fd = static_cast<int>(
+            ::syscall(__NR_io_uring_setup, entries, &params));
+
+        // `IORING_OP_READ` and `IORING_OP_WRITE` were introduced together with
+        // this feature flag.
+        if(_fd < 0 || !(params.features & IORING_FEAT_RW_CUR_POS))
+        {
+            release();
+            return;
+        }
+
+        _sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        _cq_size =
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+        const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+
+        if(single_mmap)
+        {
+            _sq_size = _cq_size = std::max(_sq_size, _cq_size);
+        }
+
+        _sq_ptr = map(_sq_size, IORING_OFF_SQ_RING);
+        _cq_ptr = single_mmap ? _sq_ptr : map(_cq_size, IORING_OFF_CQ_RING);
+        _sqes_ptr = map(_sqes_size, IORING_OFF_SQES);
+
+        if(_sq_ptr == MAP_FAILED || _cq_ptr == MAP_FAILED ||
+            _sqes_ptr == MAP_FAILED)
+        {
+            release();
+            return;
+        }
+
+        _sq_tail = at<unsigned>(_sq_ptr, params.sq_off.tail);
+        _sq_array = at<unsigned>(_sq_ptr, params.sq_off.array);
+        _sq_mask = *at<unsigned>(_sq_ptr, params.sq_off.ring_mask);
+        _sq_entries = params.sq_entries;
+        _sqes = static_cast<io_uring_sqe*>(_sqes_ptr);
+
+        _cq_head = at<unsigned>(_cq_ptr, params.cq_off.head);
+        _cq_tail = at<unsigned>(_cq_ptr, params.cq_off.tail);
+        _cq_mask = *at<unsigned>(_cq_ptr, params.cq_off.ring_mask);
+        _cqes = at<io_uring_cqe>(_cq_ptr, params.cq_off.cqes);
+    }
+
+    ~io_ring()
+    {
+        release();
+    }
+
+    io_ring(const io_ring&) = delete;
+    io_ring(io_ring&&) = delete;
+
+    [[nodiscard]] bool available() const noexcept
+    {
+        return _fd >= 0 && !_broken;
+    }
+
+    // Submits `ops` with one system call per ring-sized chunk, and waits for
+    // all of them. Transfers are capped at `max_transfer` bytes, like those
+    // of `pread` and `pwrite`. If submission fails, the operations that were
+    // not submitted complete with the error, the ones in flight are still
+    // waited for, and the ring becomes unavailable.
+    void run(io_operation* const* ops, std::size_t count) noexcept
+    {
+        while(count > 0)
+        {
+            const std::size_t n = std::min<std::size_t>(count, _sq_entries);
+            unsigned tail = *_sq_tail;
+
+            for(std::size_t i = 0; i < n; ++i, ++tail)
+            {
+                const io_operation& op = *ops[i];
+                const unsigned index = tail & _sq_mask;
+
+                io_uring_sqe& sqe = _sqes[index];
+                std::memset(&sqe, 0, sizeof(sqe));
+
+                sqe.opcode = op.write ? IORING_OP_WRITE : IORING_OP_READ;
+                sqe.fd = op.fd;
+                sqe.addr = reinterpret_cast<std::uintptr_t>(op.buffer);
+                sqe.len = static_cast<std::uint32_t>(
+                    std::min(op.size, max_transfer));
+                sqe.off = static_cast<std::uint64_t>(op.offset);
+                sqe.user_data = i;
+
+                _sq_array[index] = index;
+            }
+
+            std::atomic_ref{*_sq_tail}.store(tail, std::memory_order_release);
+
+            std::size_t to_submit = n;
+            std::size_t expected = n;
+            std::size_t reaped = 0;
+
+            while(reaped < expected)
+            {
+                if(_broken)
+                {
+                    // Operations in flight reference live buffers, so wait
+                    // for them without the ring's system call.
+                    std::this_thread::yield();
+                }
+                else if(const long submitted = ::syscall(__NR_io_uring_enter,
+                            _fd, to_submit, expected - reaped,
+                            IORING_ENTER_GETEVENTS, nullptr, 0);
+                    submitted >= 0)
+                {
+                    to_submit -= static_cast<std::size_t>(submitted);
+                }
+                else if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                {
+                    // The kernel consumes entries in order, and only during
+                    // the system call, so the unsubmitted ones are the last.
+                    for(std::size_t i = n - to_submit; i < n; ++i)
+                    {
+                        ops[i]->result = -static_cast<std::int64_t>(errno);
+                    }
+
+                    std::atomic_ref{*_sq_tail}.store(
+                        tail - static_cast<unsigned>(to_submit),
+                        std::memory_order_release);
+
+                    expected -= to_submit;
+                    to_submit = 0;
+                    _broken = true;
+                }
+
+                reaped += reap(ops);
+            }
+
+            ops += n;
+            count -= n;
+        }
+    }
+};
+
+// Ring of the calling thread, or null if `io_uring` is unavailable.
+[[nodiscard]] inline io_ring* thread_io_ring() noexcept
+{
+    thread_local io_ring ring{256};
+    return ring.available() ? &ring : nullptr;
+}
+
+#else
+
+class io_ring;
+
+[[nodiscard]] inline io_ring* thread_io_ring() noexcept
+{
+    return nullptr;
+}
+
+#endif
+
+} // namespace tlcontext::impl
+
+namespace tlcontext {
+
+enum class io_backend
+{
+    automatic,
+    uring,
+    thread_pool
+};
+
+// Context batching file reads and writes. Operations are queued by any code
+// under the guard through `io_context::get_top()`, and submitted all at once
+// by `flush()` or when the guard exits. Callbacks receive the number of bytes
+// transferred, or a negated `errno` value, and run on the flushing thread in
+// submission order after the whole batch has completed. Buffers must stay
+// valid until then. Transfers may be shorter than requested, as with `pread`
+// and `pwrite`. Batches are not synchronized, so a global batch must only be
+// used by one thread at a time.
+class io_batch
+{
+private:
+    std::vector<impl::io_operation*> _pending;
+    std::vector<impl::io_operation*> _flushing;
+    impl::io_ring* _ring;
+
+    // Set while `flush()` runs, so that flushes from callbacks return at once.
+    bool _in_flush{false};
+
+    template <typename F>
+    void enqueue(void* buffer, std::size_t size, std::int64_t offset, int fd,
+        bool write, F&& on_complete)
+    {
+        auto op = std::make_unique<impl::io_operation_of<std::decay_t<F>>>(
+            buffer, size, offset, fd, write, static_cast<F&&>(on_complete));
+
+        _pending.push_back(op.get());
+        static_cast<void>(op.release());
+    }
+
+public:
+    // `io_backend::uring` falls back to the thread pool if `io_uring` is not
+    // available.
+    [[nodiscard]] explicit io_batch(
+        io_backend backend = io_backend::automatic) noexcept
+        : _ring{backend == io_backend::thread_pool ? nullptr
+                                                   : impl::thread_io_ring()}
+    {}
+
+    // Exceptions thrown by callbacks run here are discarded, as they cannot
+    // leave the destructor; call `flush()` beforehand to observe them.
+    ~io_batch()
+    {
+        try
+        {
+            flush();
+        }
+        catch(...)
+        {
+        }
+    }
+
+    io_batch(const io_batch&) = delete;
+    io_batch(io_batch&&) = delete;
+
+    [[nodiscard]] io_backend backend() const noexcept
+    {
+        return _ring != nullptr ? io_backend::uring : io_backend::thread_pool;
+    }
+
+    [[nodiscard]] std::size_t pending() const noexcept
+    {
+        return _pending.size();
+    }
+
+    // Queues a read of `size` bytes at `offset` of `fd` into `buffer`.
+    template <typename F>
+    void read(int fd, void* buffer, std::size_t size, std::int64_t offset,
+        F&& on_complete)
+    {
+        enqueue(buffer, size, offset, fd, false /* write */,
+            static_cast<F&&>(on_complete));
+    }
+
+    // Queues a write of `size` bytes from `buffer` at `offset` of `fd`.
+    template <typename F>
+    void write(int fd, const void* buffer, std::size_t size,
+        std::int64_t offset, F&& on_complete)
+    {
+        enqueue(const_cast<void*>(buffer), size, offset, fd, true /* write */,
+            static_cast<F&&>(on_complete));
+    }
+
+    // Submits the queued operations, waits for them, and runs their callbacks.
+    // Operations queued by the callbacks are flushed as well. If callbacks
+    // throw, all the others still run, and the first exception is rethrown.
+    // Called from a callback, it returns immediately, and the operations
+    // queued so far are flushed by the enclosing call once the current
+    // callbacks have run.
+    void flush()
+    {
+        if(_in_flush)
+        {
+            return;
+        }
+
+        struct flush_scope
+        {
+            bool& flag;
+
+            ~flush_scope()
+            {
+                flag = false;
+            }
+        };
+
+        _in_flush = true;
+        const flush_scope scope{_in_flush};
+
+        std::exception_ptr error;
+
+        while(!_pending.empty())
+        {
+            _flushing.swap(_pending);
+
+#ifdef TLCONTEXT_IMPL_IO_URING
+            if(_ring != nullptr && _ring->available())
+            {
+                _ring->run(_flushing.data(), _flushing.size());
+            }
+            else
+#endif
+            {
+                impl::run_on_pool(_flushing.data(), _flushing.size());
+            }
+
+            for(impl::io_operation* const op : _flushing)
+            {
+                try
+                {
+                    op->complete();
+                }
+                catch(...)
+                {
+                    if(error == nullptr)
+                    {
+                        error = std::current_exception();
+                    }
+                }
+
+                delete op;
+            }
+
+            _flushing.clear();
+        }
+
+        if(error != nullptr)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+using io_context = helper<io_batch>;
+
+} // namespace tlcontext
+
+#endif
+
+//
+//
+//
+// Buffered output sinks
+// ----------------------------------------------------------------------------
+
+#ifdef TLCONTEXT_IO
+
+#include <algorithm>
+#include <charconv>
+#include <string_view>
+
+namespace tlcontext::impl {
+
+// Per-thread cache of the buffers of destroyed output sinks, so that a thread
+// allocates buffers only the first time it nests sinks that deep.
+struct sink_buffer_cache
+{
+    static constexpr std::size_t limit = 8;
+
+    char* buffers[limit]{};
+    std::size_t size{0};
+
+    // Frees every cached buffer. Called on thread exit by
+    // `sink_buffer_cache_owner`.
+    void free_buffers() noexcept
+    {
+        while(size > 0)
+        {
+            delete[] buffers[--size];
+        }
+    }
+};
+
+constinit inline thread_local sink_buffer_cache sink_buffer_cache_instance;
+
+struct sink_buffer_cache_owner
+{
+    ~sink_buffer_cache_owner()
+    {
+        sink_buffer_cache_instance.free_buffers();
+    }
+};
+
+inline thread_local sink_buffer_cache_owner sink_buffer_cache_owner_instance;
+
+// Returns a buffer of `size` bytes, owned by the caller until it is passed to
+// `release_sink_buffer` on any thread.
+[[nodiscard]] inline char* acquire_sink_buffer(std::size_t size)
+{
+    sink_buffer_cache& cache = sink_buffer_cache_instance;
+
+    if(cache.size > 0) [[likely]]
+    {
+        return cache.buffers[--cache.size];
+    }
+
+    // Registers the release of cached buffers on thread exit.
+    static_cast<void>(&sink_buffer_cache_owner_instance);
+    return new char[size];
+}
+
+inline void release_sink_buffer(char* buffer) noexcept
+{
+    sink_buffer_cache& cache = sink_buffer_cache_instance;
+
+    if(cache.size == sink_buffer_cache::limit) [[unlikely]]
+    {
+        delete[] buffer;
+        return;
+    }
+
+    cache.buffers[cache.size++] = buffer;
+}
+
+} // namespace tlcontext::impl
+
+namespace tlcontext {
+
+// Context buffering text output to a file descriptor. Appending never
+// allocates: text is formatted in place (numbers with `std::to_chars`) into a
+// buffer owned by the sink, which is written out with one system call when
+// full, on `flush()`, and when the guard exits. Buffers are recycled through
+// a per-thread cache, so pushing a sink only allocates the first time a
+// thread nests sinks that deep. Pushing a sink flushes an enclosing sink with
+// the same file descriptor, to preserve the order of the output. Sinks are
+// not synchronized, so a global sink must only be used by one thread at a
+// time.
+class output_sink
+{
+public:
+    static constexpr std::size_t capacity = 64 * 1024;
+
+private:
+    int _fd;
+    std::size_t _size{0};
+    char* _data;
+
+    // Largest output of `std::to_chars` for arithmetic types.
+    static constexpr std::size_t max_number_size = 64;
+
+    void write_all(const char* data, std::size_t size) noexcept
+    {
+        while(size > 0)
+        {
+            const ssize_t n = ::write(_fd, data, size);
+
+            if(n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if(n <= 0)
+            {
+                return;
+            }
+
+            data += n;
+            size -= static_cast<std::size_t>(n);
+        }
+    }
+
+    // Makes room for `size` more bytes, which must not exceed the capacity.
+    void reserve(std::size_t size) noexcept
+    {
+        if(capacity - _size < size) [[unlikely]]
+        {
+            flush();
+        }
+    }
+
+public:
+    [[nodiscard]] explicit output_sink(int fd = STDOUT_FILENO)
+        : _fd{fd}, _data{impl::acquire_sink_buffer(capacity)}
+    {
+        if(helper<output_sink>::is_active())
+        {
+            output_sink& outer = helper<output_sink>::get_top();
+
+            if(outer._fd == fd)
+            {
+                outer.flush();
+            }
+        }
+    }
+
+    ~output_sink()
+    {
+        flush();
+        impl::release_sink_buffer(_data);
+    }
+
+    output_sink(const output_sink&) = delete;
+    output_sink(output_sink&&) = delete;
+
+    [[nodiscard]] int fd() const noexcept
+    {
+        return _fd;
+    }
+
+    [[nodiscard]] std::string_view buffered() const noexcept
+    {
+        return {_data, _size};
+    }
+
+    output_sink& append(std::string_view text) noexcept
+    {
+        if(text.size() > capacity) [[unlikely]]
+        {
+            flush();
+            write_all(text.data(), text.size());
+
+            return *this;
+        }
+
+        reserve(text.size());
+
+        std::memcpy(_data + _size, text.data(), text.size());
+        _size += text.size();
+
+        return *this;
+    }
+
+    // Appends `count` copies of `c`.
+    output_sink& append(char c, std::size_t count = 1) noexcept
+    {
+        while(count > 0)
+        {
+            reserve(1);
+
+            const std::size_t n = std::min(count, capacity - _size);
+            std::memset(_data + _size, c, n);
+
+            _size += n;
+            count -= n;
+        }
+
+        return *this;
+    }
+
+    template <typename T>
+        requires std::is_arithmetic_v<T> && (!std::is_same_v<T, bool>) &&
+                 (!std::is_same_v<T, char>)
+    output_sink& append(T x) noexcept
+    {
+        reserve(max_number_size);
+
+        const std::to_chars_result result =
+            std::to_chars(_data + _size, _data + capacity, x);
+
+        _size = static_cast<std::size_t>(result.ptr - _data);
+        return *this;
+    }
+
+    // Writes out the buffered output.
+    void flush() noexcept
+    {
+        write_all(_data, _size);
+        _size = 0;
+    }
+};
+
+using output_context = helper<output_sink>;
+
+} // namespace tlcontext
+
+#endif
+
+//
+//
+//
+// Shared-memory metrics
+// ----------------------------------------------------------------------------
+
+#ifdef TLCONTEXT_IO
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace tlcontext {
+
+// Layout of a metrics region. Each slot holds the aggregates of one label as
+// updated by one thread, so that updates never contend: the writer bumps the
+// slot's sequence number to an odd value, stores the fields, and bumps it to
+// an even value again. Readers retry until they see the same even sequence
+// number before and after reading, and sum the slots of the same label.
+struct alignas(64) shm_metrics_header
+{
+    static constexpr char expected_magic[8] = "TLCMTRC";
+    static constexpr std::uint32_t current_version = 1;
+
+    char magic[8];
+    std::atomic<std::uint32_t> version;
+    std::uint32_t slot_size;
+    std::uint32_t slot_count;
+    std::atomic<std::uint32_t> used_slots;
+    std::atomic<std::uint64_t> dropped;
+    std::uint64_t pid;
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+
+struct alignas(64) shm_metrics_slot
+{
+    static constexpr std::size_t max_label = 35;
+
+    std::atomic<std::uint32_t> sequence;
+    char label[max_label + 1];
+    std::atomic<std::uint64_t> count;
+    std::atomic<std::uint64_t> total_ns;
+    std::atomic<std::uint64_t> max_ns;
+};
+
+static_assert(sizeof(shm_metrics_slot) == 64);
+
+// Consistent copy of the aggregates of a label.
+struct shm_metrics_entry
+{
+    std::string label;
+    std::uint64_t count;
+    std::uint64_t total_ns;
+    std::uint64_t max_ns;
+};
+
+} // namespace tlcontext
+
+namespace tlcontext::impl {
+
+// Per-thread cache from labels to the slots of a region, by address of the
+// label's characters. Regions are identified by a process-wide id, so that
+// entries of destroyed regions never match.
+struct shm_slot_cache_entry
+{
+    std::uint64_t region;
+    const char* label;
+    std::size_t size;
+    shm_metrics_slot* slot;
+};
+
+inline constexpr std::size_t shm_slot_cache_size = 256;
+inline constexpr std::size_t shm_slot_cache_probes = 8;
+
+constinit inline thread_local shm_slot_cache_entry
+    shm_slot_cache[shm_slot_cache_size]{};
+
+// Maps a POSIX shared memory object, returning null on failure. Creation
+// fails with `errno` set to `EEXIST` if the object already exists. When
+// opening an existing object, `size` receives its size.
+[[nodiscard]] inline void* map_shm(
+    const char* name, std::size_t& size, bool create) noexcept
+{
+    const int fd = create ? ::shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644)
+                          : ::shm_open(name, O_RDONLY, 0);
+
+    if(fd < 0)
+    {
+        return nullptr;
+    }
+
+    if(create && ::ftruncate(fd, static_cast<off_t>(size)) != 0)
+    {
+        ::close(fd);
+        ::shm_unlink(name);
+        return nullptr;
+    }
+
+    if(!create)
+    {
+        struct stat st;
+
+        if(::fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            return nullptr;
+        }
+
+        size = static_cast<std::size_t>(st.st_size);
+    }
+
+    void* const p = ::mmap(nullptr, size,
+        create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+
+    ::close(fd);
+
+    if(p == MAP_FAILED)
+    {
+        if(create)
+        {
+            ::shm_unlink(name);
+        }
+
+        return nullptr;
+    }
+
+    return p;
+}
+
+// Returns whether `name` is a metrics region left behind by a process that
+// no longer exists, e.g. after a crash, and can therefore be replaced.
+[[nodiscard]] inline bool is_stale_shm_metrics(const char* name) noexcept
+{
+    std::size_t size = 0;
+    void* const p = map_shm(name, size, false /* create */);
+
+    if(p == nullptr)
+    {
+        return false;
+    }
+
+    bool stale = false;
+
+    if(size >= sizeof(shm_metrics_header))
+    {
+        const auto& header = *static_cast<const shm_metrics_header*>(p);
+
+        stale = std::memcmp(header.magic, shm_metrics_header::expected_magic,
+                    sizeof(header.magic)) == 0 &&
+                header.version.load(std::memory_order_acquire) != 0 &&
+                ::kill(static_cast<pid_t>(header.pid), 0) != 0 &&
+                errno == ESRCH;
+    }
+
+    ::munmap(p, size);
+    return stale;
+}
+
+// Takes an exclusive lock on the shared memory object `name`, creating it if
+// needed. Retries if the previous holder removed the object in the meantime,
+// so that every holder locks the object currently named `name`. Returns the
+// locked descriptor, or -1 on failure.
+[[nodiscard]] inline int lock_shm(const char* name) noexcept
+{
+    for(;;)
+    {
+        const int fd = ::shm_open(name, O_CREAT | O_RDWR, 0600);
+
+        if(fd < 0)
+        {
+            return -1;
+        }
+
+        if(::flock(fd, LOCK_EX) != 0)
+        {
+            ::close(fd);
+            return -1;
+        }
+
+        const int current = ::shm_open(name, O_RDWR, 0);
+
+        if(current >= 0)
+        {
+            struct stat locked;
+            struct stat named;
+
+            const bool same = ::fstat(fd, &locked) == 0 &&
+                              ::fstat(current, &named) == 0 &&
+                              locked.st_dev == named.st_dev &&
+                              locked.st_ino == named.st_ino;
+
+            ::close(current);
+
+            if(same)
+            {
+                return fd;
+            }
+        }
+
+        ::close(fd);
+    }
+}
+
+// Removes the lock object `name` while still holding it, then releases it.
+inline void unlock_shm(const char* name, int fd) noexcept
+{
+    ::shm_unlink(name);
+    ::close(fd);
+}
+
+// Creates and maps the metrics region `name` of `size` bytes, replacing it
+// only if it is stale, so that live regions of other processes are never
+// reinitialized. Replacements are serialized by a lock object next to the
+// region, so that two processes never both replace the same stale region, and
+// the second one never removes the region created by the first. Returns null
+// on failure.
+[[nodiscard]] inline void* create_shm_metrics(
+    const char* name, std::size_t size)
+{
+    void* const p = map_shm(name, size, true /* create */);
+
+    if(p != nullptr || errno != EEXIST)
+    {
+        return p;
+    }
+
+    const std::string lock_name = std::string{name} + ".lock";
+    const int lock = lock_shm(lock_name.c_str());
+
+    if(lock < 0)
+    {
+        return nullptr;
+    }
+
+    // Another process may have replaced or removed the region meanwhile.
+    void* result = map_shm(name, size, true /* create */);
+
+    if(result == nullptr && errno == EEXIST && is_stale_shm_metrics(name))
+    {
+        ::shm_unlink(name);
+        result = map_shm(name, size, true /* create */);
+    }
+
+    unlock_shm(lock_name.c_str(), lock);
+    return result;
+}
+
+} // namespace tlcontext::impl
+
+namespace tlcontext {
+
+// Metrics backend publishing per-label counts and latencies in the shared
+// memory object `name`, for external readers such as `tlcontext_top`. The
+// first update of a label on a thread claims a slot; later updates are plain
+// stores. When a thread evicts the cache entry of a label, its slot is
+// released, and is claimed again by the next thread updating that label.
+// Updates are dropped (and counted) if the region is full. The region is
+// unavailable if `name` is in use by a live process, or by anything other
+// than a metrics region.
+class shm_metrics
+{
+private:
+    inline static constinit std::atomic<std::uint64_t> _next_id{1};
+
+    // Available regions of the process, so that evicting a cache entry can
+    // release its slot in the region it belongs to, if that still exists.
+    inline static constinit std::mutex _regions_mutex;
+    inline static constinit shm_metrics* _regions{nullptr};
+
+    std::uint64_t _id{_next_id.fetch_add(1, std::memory_order_relaxed)};
+
+    std::string _name;
+    std::size_t _size;
+
+    // Whether each slot was released by its last writer. Released slots are
+    // only claimed again for their own label, so that their aggregates keep
+    // adding up.
+    std::unique_ptr<std::atomic<bool>[]> _released;
+
+    shm_metrics_header* _header;
+    shm_metrics_slot* _slots;
+    shm_metrics* _next_region{nullptr};
+
+    static void release(std::uint64_t region, shm_metrics_slot* slot) noexcept
+    {
+        const std::lock_guard lock{_regions_mutex};
+
+        for(shm_metrics* r = _regions; r != nullptr; r = r->_next_region)
+        {
+            if(r->_id == region)
+            {
+                r->_released[slot - r->_slots].store(
+                    true, std::memory_order_release);
+
+                return;
+            }
+        }
+    }
+
+    [[nodiscard]] shm_metrics_slot* reclaim(std::string_view label) noexcept
+    {
+        const std::string_view stored =
+            label.substr(0, shm_metrics_slot::max_label);
+
+        const std::uint32_t used =
+            std::min(_header->used_slots.load(std::memory_order_relaxed),
+                _header->slot_count);
+
+        for(std::uint32_t i = 0; i < used; ++i)
+        {
+            // Labels of slots that were never released may still be written.
+            if(!_released[i].load(std::memory_order_acquire))
+            {
+                continue;
+            }
+
+            const shm_metrics_slot& slot = _slots[i];
+
+            if(std::string_view{slot.label,
+                   ::strnlen(slot.label, shm_metrics_slot::max_label)} !=
+                stored)
+            {
+                continue;
+            }
+
+            bool expected = true;
+
+            if(_released[i].compare_exchange_strong(
+                   expected, false, std::memory_order_acquire))
+            {
+                return &_slots[i];
+            }
+        }
+
+        return nullptr;
+    }
+
+    [[nodiscard]] shm_metrics_slot* claim(std::string_view label) noexcept
+    {
+        if(shm_metrics_slot* const slot = reclaim(label))
+        {
+            return slot;
+        }
+
+        if(_header->used_slots.load(std::memory_order_relaxed) >=
+            _header->slot_count)
+        {
+            return nullptr;
+        }
+
+        const std::uint32_t index =
+            _header->used_slots.fetch_add(1, std::memory_order_relaxed);
+
+        if(index >= _header->slot_count)
+        {
+            return nullptr;
+        }
+
+        // The label is immutable once the slot is published by its first
+        // even, non-zero sequence number.
+        shm_metrics_slot& slot = _slots[index];
+
+        label.copy(slot.label, shm_metrics_slot::max_label);
+        slot.sequence.store(2, std::memory_order_release);
+
+        return &slot;
+    }
+
+    [[nodiscard]] shm_metrics_slot* slot_for(std::string_view label) noexcept
+    {
+        const auto hash =
+            (reinterpret_cast<std::uintptr_t>(label.data()) >> 3) ^ _id;
+
+        for(std::size_t i = 0; i < impl::shm_slot_cache_probes; ++i)
+        {
+            impl::shm_slot_cache_entry& e =
+                impl::shm_slot_cache[(hash + i) % impl::shm_slot_cache_size];
+
+            if(e.region == _id && e.label == label.data() &&
+                e.size == label.size()) [[likely]]
+            {
+                return e.slot;
+            }
+
+            if(e.region == 0)
+            {
+                e = {_id, label.data(), label.size(), claim(label)};
+                return e.slot;
+            }
+        }
+
+        // Evict an entry, possibly of a destroyed region, releasing its slot.
+        impl::shm_slot_cache_entry& e =
+            impl::shm_slot_cache[hash % impl::shm_slot_cache_size];
+
+        if(e.slot != nullptr)
+        {
+            release(e.region, e.slot);
+        }
+
+        e = {_id, label.data(), label.size(), claim(label)};
+        return e.slot;
+    }
+
+public:
+    [[nodiscard]] explicit shm_metrics(
+        std::string name, std::uint32_t slot_count = 1024)
+        : _name{std::move(name)},
+          _size{sizeof(shm_metrics_header) +
+                slot_count * sizeof(shm_metrics_slot)},
+          _released{new std::atomic<bool>[slot_count]{}},
+          _header{static_cast<shm_metrics_header*>(
+              impl::create_shm_metrics(_name.c_str(), _size))},
+          _slots{reinterpret_cast<shm_metrics_slot*>(_header + 1)}
+    {
+        if(_header == nullptr)
+        {
+            return;
+        }
+
+        std::memset(static_cast<void*>(_header), 0, _size);
+        std::memcpy(_header->magic, shm_metrics_header::expected_magic,
+            sizeof(_header->magic));
+
+        _header->slot_size = sizeof(shm_metrics_slot);
+        _header->slot_count = slot_count;
+        _header->pid = static_cast<std::uint64_t>(::getpid());
+
+        // Publish the version last, so that readers never see a partial
+        // header.
+        _header->version.store(
+            shm_metrics_header::current_version, std::memory_order_release);
+
+        const std::lock_guard lock{_regions_mutex};
+
+        _next_region = _regions;
+        _regions = this;
+    }
+
+    // Unmaps and removes the region. Threads must not record to it anymore.
+    ~shm_metrics()
+    {
+        if(_header == nullptr)
+        {
+            return;
+        }
+
+        {
+            const std::lock_guard lock{_regions_mutex};
+
+            shm_metrics** link = &_regions;
+
+            while(*link != this)
+            {
+                link = &(*link)->_next_region;
+            }
+
+            *link = _next_region;
+        }
+
+        ::munmap(_header, _size);
+        ::shm_unlink(_name.c_str());
+    }
+
+    shm_metrics(const shm_metrics&) = delete;
+    shm_metrics(shm_metrics&&) = delete;
+
+    [[nodiscard]] bool available() const noexcept
+    {
+        return _header != nullptr;
+    }
+
+    // Adds a sample of `elapsed` to the aggregates of `label`. Labels are
+    // identified by the address of their characters, so they should be string
+    // literals or otherwise outlive the region.
+    void record(
+        std::string_view label, std::chrono::nanoseconds elapsed) noexcept
+    {
+        if(_header == nullptr) [[unlikely]]
+        {
+            return;
+        }
+
+        shm_metrics_slot* const slot = slot_for(label);
+
+        if(slot == nullptr) [[unlikely]]
+        {
+            _header->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        const auto ns = static_cast<std::uint64_t>(elapsed.count());
+        const std::uint32_t seq =
+            slot->sequence.load(std::memory_order_relaxed);
+
+        // Release stores order the fields after the odd sequence number, and
+        // are plain stores on x86-64.
+        slot->sequence.store(seq + 1, std::memory_order_relaxed);
+
+        const auto add = [](std::atomic<std::uint64_t>& field, std::uint64_t x)
+        {
+            field.store(field.load(std::memory_order_relaxed) + x,
+                std::memory_order_release);
+        };
+
+        add(slot->count, 1);
+        add(slot->total_ns, ns);
+
+        if(ns > slot->max_ns.load(std::memory_order_relaxed))
+        {
+            slot->max_ns.store(ns, std::memory_order_release);
+        }
+        slot->sequence.store(seq + 2, std::memory_order_release);
+    }
+};
+
+using shm_metrics_context = helper<shm_metrics>;
+
+// Read-only view of the metrics region `name` of another process.
+class shm_metrics_reader
+{
+private:
+    std::size_t _size{0};
+    const shm_metrics_header* _header{nullptr};
+
+public:
+    [[nodiscard]] explicit shm_metrics_reader(const char* name) noexcept
+    {
+        void* const p = impl::map_shm(name, _size, false /* create */);
+
+        if(p == nullptr)
+        {
+            return;
+        }
+
+        const auto* const header = static_cast<const shm_metrics_header*>(p);
+
+        if(_size < sizeof(shm_metrics_header) ||
+            std::memcmp(header->magic, shm_metrics_header::expected_magic,
+                sizeof(header->magic)) != 0 ||
+            header->version.load(std::memory_order_acquire) !=
+                shm_metrics_header::current_version ||
+            header->slot_size != sizeof(shm_metrics_slot) ||
+            _size < sizeof(shm_metrics_header) +
+                        header->slot_count * sizeof(shm_metrics_slot))
+        {
+            ::munmap(p, _size);
+            return;
+        }
+
+        _header = header;
+    }
+
+    ~shm_metrics_reader()
+    {
+        if(_header != nullptr)
+        {
+            ::munmap(const_cast<shm_metrics_header*>(_header), _size);
+        }
+    }
+
+    shm_metrics_reader(const shm_metrics_reader&) = delete;
+    shm_metrics_reader(shm_metrics_reader&&) = delete;
+
+    // Returns whether the region exists and has a compatible layout.
+    [[nodiscard]] bool valid() const noexcept
+    {
+        return _header != nullptr;
+    }
+
+    [[nodiscard]] std::uint64_t pid() const noexcept
+    {
+        return _header->pid;
+    }
+
+    [[nodiscard]] std::uint64_t dropped() const noexcept
+    {
+        return _header->dropped.load(std::memory_order_relaxed);
+    }
+
+    // Returns the aggregates of every label, summed over threads.
+    [[nodiscard]] std::vector<shm_metrics_entry> read() const
+    {
+        std::vector<shm_metrics_entry> result;
+
+        const auto* const slots =
+            reinterpret_cast<const shm_metrics_slot*>(_header + 1);
+
+        const std::uint32_t used =
+            std::min(_header->used_slots.load(std::memory_order_acquire),
+                _header->slot_count);
+
+        for(std::uint32_t i = 0; i < used; ++i)
+        {
+            const shm_metrics_slot& slot = slots[i];
+            shm_metrics_entry e{};
+
+            // Give up on slots whose writer died while updating them.
+            bool consistent = false;
+
+            for(int attempt = 0; attempt < 1024 && !consistent; ++attempt)
+            {
+                const std::uint32_t before =
+                    slot.sequence.load(std::memory_order_acquire);
+
+                if(before == 0)
+                {
+                    break;
+                }
+
+                if(before & 1u)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                e.count = slot.count.load(std::memory_order_acquire);
+                e.total_ns = slot.total_ns.load(std::memory_order_acquire);
+                e.max_ns = slot.max_ns.load(std::memory_order_acquire);
+
+                consistent =
+                    slot.sequence.load(std::memory_order_relaxed) == before;
+            }
+
+            if(!consistent || e.count == 0)
+            {
+                continue;
+            }
+
+            e.label.assign(slot.label,
+                ::strnlen(slot.label, shm_metrics_slot::max_label));
+
+            const auto it = std::find_if(result.begin(), result.end(),
+                [&](const shm_metrics_entry& r) { return r.label == e.label; });
+
+            if(it == result.end())
+            {
+                result.push_back(std::move(e));
+                continue;
+            }
+
+            it->count += e.count;
+            it->total_ns += e.total_ns;
+            it->max_ns = std::max(it->max_ns, e.max_ns);
+        }
+
+        return result;
+    }
+};
+
+} // namespace tlcontext
+
+#endif
+
+//
+//
+//
+// Global allocation hook
+// ----------------------------------------------------------------------------
+
+#ifdef TLCONTEXT_NO_ALLOC_HOOK
+
+#include <cstdlib>
+
+namespace tlcontext::impl {
+
+[[nodiscard]] inline void* raw_allocate(
+    std::size_t size, std::size_t alignment) noexcept
+{
+    if(size == 0)
+    {
+        size = 1;
+    }
+
+    if(alignment <= alignof(std::max_align_t))
+    {
+        return std::malloc(size);
+    }
+
+    const std::size_t padded = (size + alignment - 1) & ~(alignment - 1);
+    return std::aligned_alloc(alignment, padded);
+}
+
+// Allocates like the default `operator new`, calling the new handler after
+// every failure until the allocation succeeds or there is no handler.
+[[nodiscard]] inline void* hooked_allocate_or_throw(
+    std::size_t size, std::size_t alignment)
+{
+    check_allocation();
+
+    for(;;)
+    {
+        if(void* const p = raw_allocate(size, alignment)) [[likely]]
+        {
+            return p;
+        }
+
+        const std::new_handler handler = std::get_new_handler();
+
+        if(handler == nullptr)
+        {
+            throw std::bad_alloc{};
+        }
+
+        handler();
+    }
+}
+
+// Allocates like the default non-throwing `operator new`, which calls the
+// throwing one.
+[[nodiscard]] inline void* hooked_allocate(
+    std::size_t size, std::size_t alignment) noexcept
+{
+    try
+    {
+        return hooked_allocate_or_throw(size, alignment);
+    }
+    catch(...)
+    {
+        return nullptr;
+    }
+}
+
+} // namespace tlcontext::impl
+
+void* operator new(std::size_t size)
+{
+    return tlcontext::impl::hooked_allocate_or_throw(
+        size, alignof(std::max_align_t));
+}
+
+void* operator new[](std::size_t size)
+{
+    return tlcontext::impl::hooked_allocate_or_throw(
+        size, alignof(std::max_align_t));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    return tlcontext::impl::hooked_allocate_or_throw(
+        size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return tlcontext::impl::hooked_allocate_or_throw(
+        size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    return tlcontext::impl::hooked_allocate(size, alignof(std::max_align_t));
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return tlcontext::impl::hooked_allocate(size, alignof(std::max_align_t));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment,
+    const std::nothrow_t&) noexcept
+{
+    return tlcontext::impl::hooked_allocate(
+        size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment,
+    const std::nothrow_t&) noexcept
+{
+    return tlcontext::impl::hooked_allocate(
+        size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+#endif
+
+//
+//
+//
+// Shared library mode owner
+// ----------------------------------------------------------------------------
+
+#ifdef TLCONTEXT_SHARED_OWNER
+
+#include <mutex>
+
+namespace tlcontext::impl {
+
+constinit std::mutex owner_mutex;
+constinit const char* owner_keys[max_types]{};
+constinit std::size_t owner_sizes[max_types]{};
+constinit std::atomic<std::size_t> owner_type_count{0};
+constinit void* owner_global_slots[max_types]{};
+constinit thread_local void* owner_local_slots[max_types]{};
+
+} // namespace tlcontext::impl
+
+extern "C" {
+
+std::size_t tlcontext_shared_register_type(
+    const char* key, std::size_t size) noexcept
+{
+    using namespace tlcontext::impl;
+
+    const std::lock_guard lock{owner_mutex};
+
+    const std::size_t count = owner_type_count.load(std::memory_order_relaxed);
+
+    for(std::size_t i = 0; i < count; ++i)
+    {
+        if(std::strcmp(owner_keys[i], key) == 0)
+        {
+            if(owner_sizes[i] != size) [[unlikely]]
+            {
+                fatal("distinct context types share a name across binaries");
+            }
+
+            return i;
+        }
+    }
+
+    if(count >= max_types) [[unlikely]]
+    {
+        fatal("exceeded TLCONTEXT_MAX_TYPES");
+    }
+
+    // Copy the key, as the binary it comes from might be unloaded.
+    const std::size_t key_size = std::strlen(key) + 1;
+    char* const key_copy = new char[key_size];
+    std::memcpy(key_copy, key, key_size);
+
+    owner_keys[count] = key_copy;
+    owner_sizes[count] = size;
+    owner_type_count.store(count + 1, std::memory_order_relaxed);
+
+    return count;
+}
+
+const std::atomic<std::size_t>* tlcontext_shared_type_count() noexcept
+{
+    return &tlcontext::impl::owner_type_count;
+}
+
+void** tlcontext_shared_global_slots() noexcept
+{
+    return tlcontext::impl::owner_global_slots;
+}
+
+void** tlcontext_shared_local_slots() noexcept
+{
+    return tlcontext::impl::owner_local_slots;
+}
+}
+
+#endif
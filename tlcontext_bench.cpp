@@ -0,0 +1,1533 @@
+// Copyright (c) 2023-2023 Vittorio Romeo
+// License: Academic Free License ("AFL") v. 3.0
+// AFL License page: https://opensource.org/licenses/AFL-3.0
+
+// Build with optimizations and without `TLCONTEXT_DEBUG`, e.g.:
+//
+//     g++ -std=c++20 -O2 -pthread tlcontext_bench.cpp -o tlcontext_bench
+//
+// Every benchmark prints the average time per operation. Additionally define
+// `TLCONTEXT_SHARED_OWNER` to measure the shared library mode,
+// `TLCONTEXT_SLOT_ARRAY` to measure the flat slot array, or `TLCONTEXT_PROBES`
+// to measure guards with inactive tracing probes. The allocation hook of
+// `no_alloc_guard` is always installed. With the flat slot array, thread
+// creation cost depends on the static TLS size, which can be compared across
+// builds with different values of `TLCONTEXT_MAX_TYPES`, e.g.
+// `-DTLCONTEXT_MAX_TYPES=4096`.
+
+#define TLCONTEXT_VALUES 1
+#define TLCONTEXT_MEMORY 1
+#define TLCONTEXT_COROUTINES 1
+#define TLCONTEXT_CLOCKS 1
+#define TLCONTEXT_SCHEDULER 1
+#define TLCONTEXT_PIPELINE 1
+#define TLCONTEXT_AUTOTUNE 1
+#define TLCONTEXT_IO 1
+#define TLCONTEXT_NO_ALLOC_HOOK 1
+
+#ifndef TLCONTEXT_MAX_COLD_TYPES
+#define TLCONTEXT_MAX_COLD_TYPES 64
+#endif
+#include "tlcontext.hpp"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <coroutine>
+#include <exception>
+#include <fstream>
+#include <memory_resource>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+//
+//
+//
+// Benchmark utilities
+// ----------------------------------------------------------------------------
+
+using clock_type = std::chrono::steady_clock;
+
+// Prevents the optimizer from discarding the computation of `x`.
+template <typename T>
+[[gnu::always_inline]] inline void do_not_optimize(const T& x) noexcept
+{
+    asm volatile("" : : "r,m"(x) : "memory");
+}
+
+// Prevents the optimizer from assuming anything about the value of `x`, so
+// that computations depending on it cannot be hoisted out of the benchmark.
+template <typename T>
+[[gnu::always_inline]] inline void clobber(T& x) noexcept
+{
+    asm volatile("" : "+m"(x) : : "memory");
+}
+
+// Runs `f` for `iterations` times after a warm-up run, and prints the average
+// time per iteration divided by `ops_per_iteration`.
+template <typename F>
+void bench(const char* label, std::size_t iterations,
+    std::size_t ops_per_iteration, F&& f)
+{
+    f();
+
+    const auto start = clock_type::now();
+
+    for(std::size_t i = 0; i < iterations; ++i)
+    {
+        f();
+    }
+
+    const auto elapsed = clock_type::now() - start;
+    const double ns =
+        std::chrono::duration<double, std::nano>(elapsed).count() /
+        static_cast<double>(iterations * ops_per_iteration);
+
+    std::printf("%-48s %10.3f ns/op\n", label, ns);
+}
+
+//
+//
+//
+// Context access and propagation
+// ----------------------------------------------------------------------------
+
+struct access_ctx_data
+{
+    std::size_t value;
+};
+
+using access_ctx = tlcontext::helper<access_ctx_data>;
+
+static void bench_access()
+{
+    std::size_t n = 4096;
+
+    access_ctx::global_guard gg{std::size_t{1}};
+
+    bench("access: get_top (global fallback)", 10000, n,
+        [&]
+        {
+            clobber(n);
+            std::size_t acc = 0;
+
+            for(std::size_t i = 0; i < n; ++i)
+            {
+                acc += access_ctx::get_top().value;
+                clobber(acc);
+            }
+
+            do_not_optimize(acc);
+        });
+
+    access_ctx::local_guard lg{std::size_t{2}};
+
+    bench("access: get_local", 10000, n,
+        [&]
+        {
+            clobber(n);
+            std::size_t acc = 0;
+
+            for(std::size_t i = 0; i < n; ++i)
+            {
+                acc += access_ctx::get_local().value;
+                clobber(acc);
+            }
+
+            do_not_optimize(acc);
+        });
+
+    // Guards fire tracing probes if `TLCONTEXT_PROBES` is defined, while the
+    // bare slot swap below never does.
+    bench("access: local_guard push + pop", 10000, n,
+        [&]
+        {
+            clobber(n);
+
+            for(std::size_t i = 0; i < n; ++i)
+            {
+                access_ctx::local_guard inner{i};
+                do_not_optimize(access_ctx::get_local().value);
+            }
+        });
+
+    bench("access: bare slot push + pop", 10000, n,
+        [&]
+        {
+            clobber(n);
+
+            for(std::size_t i = 0; i < n; ++i)
+            {
+                access_ctx_data inner{i};
+                void*& slot = tlcontext::impl::top_slot<access_ctx_data,
+                    true /* local */>();
+
+                void* const prev = slot;
+                slot = &inner;
+                do_not_optimize(access_ctx::get_local().value);
+                slot = prev;
+            }
+        });
+
+    bench("access: slab_guard push + pop", 10000, n,
+        [&]
+        {
+            clobber(n);
+
+            for(std::size_t i = 0; i < n; ++i)
+            {
+                access_ctx::slab_guard inner{i};
+                do_not_optimize(access_ctx::get_local().value);
+            }
+        });
+
+    bench("access: capture_all + restore_all", 1000000, 1,
+        [&]
+        {
+            const tlcontext::context_snapshot s = tlcontext::capture_all();
+            do_not_optimize(s);
+            tlcontext::restore_all(s);
+        });
+}
+
+//
+//
+//
+// Compile-time dispatch vs branchy kernel
+// ----------------------------------------------------------------------------
+
+enum class precision_mode
+{
+    low,
+    high,
+    exact
+};
+
+template <>
+inline constexpr std::size_t tlcontext::dispatch_cardinality<precision_mode> =
+    3;
+
+struct kernel_ctx_data
+{
+    bool validate;
+    precision_mode precision;
+};
+
+using kernel_ctx = tlcontext::helper<kernel_ctx_data>;
+
+[[gnu::noinline]] static long long branchy_kernel(const std::vector<int>& xs)
+{
+    long long sum = 0;
+
+    for(int x : xs)
+    {
+        const kernel_ctx_data& ctx = kernel_ctx::get_top();
+
+        if(ctx.validate && x < 0)
+        {
+            return -1;
+        }
+
+        if(ctx.precision == precision_mode::low)
+        {
+            sum += x / 2 * 2;
+        }
+        else if(ctx.precision == precision_mode::high)
+        {
+            sum += x;
+        }
+        else
+        {
+            sum += x * 2;
+        }
+    }
+
+    return sum;
+}
+
+[[gnu::noinline]] static long long dispatched_kernel(
+    const std::vector<int>& xs)
+{
+    return tlcontext::dispatch_on<kernel_ctx, &kernel_ctx_data::validate,
+        &kernel_ctx_data::precision>(
+        [&](auto validate, auto precision) -> long long
+        {
+            long long sum = 0;
+
+            for(int x : xs)
+            {
+                if constexpr(validate)
+                {
+                    if(x < 0)
+                    {
+                        return -1;
+                    }
+                }
+
+                if constexpr(precision == precision_mode::low)
+                {
+                    sum += x / 2 * 2;
+                }
+                else if constexpr(precision == precision_mode::high)
+                {
+                    sum += x;
+                }
+                else
+                {
+                    sum += x * 2;
+                }
+            }
+
+            return sum;
+        });
+}
+
+static void bench_dispatch()
+{
+    std::vector<int> xs(4096);
+
+    for(std::size_t i = 0; i < xs.size(); ++i)
+    {
+        xs[i] = static_cast<int>(i % 97);
+    }
+
+    kernel_ctx::local_guard lg{true, precision_mode::high};
+
+    bench("dispatch: branchy kernel", 10000, xs.size(),
+        [&]
+        {
+            clobber(xs);
+            do_not_optimize(branchy_kernel(xs));
+        });
+
+    bench("dispatch: dispatch_on kernel", 10000, xs.size(),
+        [&]
+        {
+            clobber(xs);
+            do_not_optimize(dispatched_kernel(xs));
+        });
+}
+
+//
+//
+//
+// Virtual dispatch vs strategy context
+// ----------------------------------------------------------------------------
+
+struct virtual_hasher
+{
+    virtual ~virtual_hasher() = default;
+    virtual std::size_t hash(std::size_t x) const noexcept = 0;
+};
+
+struct virtual_mix_hasher final : virtual_hasher
+{
+    std::size_t hash(std::size_t x) const noexcept override
+    {
+        return (x ^ (x >> 31)) * 0x9E3779B97F4A7C15ull;
+    }
+};
+
+struct virtual_hasher_ctx_data
+{
+    const virtual_hasher* hasher;
+};
+
+using virtual_hasher_ctx = tlcontext::helper<virtual_hasher_ctx_data>;
+
+// A second implementation prevents speculative devirtualization.
+struct virtual_xor_hasher final : virtual_hasher
+{
+    std::size_t hash(std::size_t x) const noexcept override
+    {
+        return x ^ 0x9E3779B97F4A7C15ull;
+    }
+};
+
+struct mix_hasher
+{
+    std::size_t hash(std::size_t x) const noexcept
+    {
+        return (x ^ (x >> 31)) * 0x9E3779B97F4A7C15ull;
+    }
+};
+
+struct hasher_table
+{
+    std::size_t (*hash)(void*, std::size_t);
+
+    template <typename T>
+    static constexpr hasher_table make() noexcept
+    {
+        return {[](void* self, std::size_t x)
+            { return static_cast<T*>(self)->hash(x); }};
+    }
+};
+
+using hasher_ctx = tlcontext::strategy<hasher_table>;
+
+static void bench_strategy()
+{
+    std::size_t n = 4096;
+
+    virtual_mix_hasher vh;
+    virtual_xor_hasher vxh;
+    mix_hasher mh;
+
+    // Launder the object pointer so that the optimizer cannot devirtualize.
+    const virtual_hasher* vh_ptr = &vh;
+    clobber(vh_ptr);
+    clobber(vxh);
+
+    virtual_hasher_ctx::local_guard vlg{vh_ptr};
+    hasher_ctx::local_guard slg{mh};
+
+    bench("strategy: virtual call via get_top", 10000, n,
+        [&]
+        {
+            clobber(n);
+            std::size_t acc = 0;
+
+            for(std::size_t i = 0; i < n; ++i)
+            {
+                acc += virtual_hasher_ctx::get_top().hasher->hash(i);
+            }
+
+            do_not_optimize(acc);
+        });
+
+    bench("strategy: cached function-pointer table", 10000, n,
+        [&]
+        {
+            clobber(n);
+            std::size_t acc = 0;
+
+            for(std::size_t i = 0; i < n; ++i)
+            {
+                acc += hasher_ctx::invoke<&hasher_table::hash>(i);
+            }
+
+            do_not_optimize(acc);
+        });
+
+    bench("strategy: get_if fast path", 10000, n,
+        [&]
+        {
+            clobber(n);
+            std::size_t acc = 0;
+
+            if(mix_hasher* h = hasher_ctx::get_if<mix_hasher>())
+            {
+                for(std::size_t i = 0; i < n; ++i)
+                {
+                    acc += h->hash(i);
+                }
+            }
+
+            do_not_optimize(acc);
+        });
+}
+
+//
+//
+//
+// Scoped override of a large context
+// ----------------------------------------------------------------------------
+
+struct config_data
+{
+    int timeout_ms;
+    int retries;
+    char endpoint[4096]{};
+};
+
+using full_config_ctx = tlcontext::helper<config_data>;
+
+using overlay_config_ctx = tlcontext::overlay<config_data,
+    &config_data::timeout_ms, &config_data::retries>;
+
+[[gnu::noinline]] static int read_full_timeout()
+{
+    return full_config_ctx::get_top().timeout_ms;
+}
+
+[[gnu::noinline]] static int read_overlay_timeout()
+{
+    return overlay_config_ctx::get<&config_data::timeout_ms>();
+}
+
+static void bench_overlay()
+{
+    full_config_ctx::global_guard fgg{1000, 3};
+    overlay_config_ctx::global_guard ogg{1000, 3};
+
+    int timeout = 50;
+
+    bench("overlay: override by copying the whole context", 1000000, 1,
+        [&]
+        {
+            clobber(timeout);
+
+            config_data copy = full_config_ctx::get_top();
+            copy.timeout_ms = timeout;
+
+            full_config_ctx::local_guard lg{copy};
+            do_not_optimize(read_full_timeout());
+        });
+
+    bench("overlay: override_guard", 1000000, 1,
+        [&]
+        {
+            clobber(timeout);
+
+            overlay_config_ctx::override_guard<&config_data::timeout_ms> og{
+                timeout};
+
+            do_not_optimize(read_overlay_timeout());
+        });
+}
+
+//
+//
+//
+// Persistent key-value context
+// ----------------------------------------------------------------------------
+
+static void bench_values()
+{
+    std::vector<tlcontext::value_key<std::size_t>> keys(512);
+    tlcontext::value_map map;
+
+    for(std::size_t i = 0; i < keys.size(); ++i)
+    {
+        map = map.with(keys[i], i);
+    }
+
+    tlcontext::value_guard vg{map};
+
+    bench("values: get_value with 512 keys", 10000, keys.size(),
+        [&]
+        {
+            std::size_t acc = 0;
+
+            for(const auto& key : keys)
+            {
+                acc += *tlcontext::get_value(key);
+            }
+
+            do_not_optimize(acc);
+        });
+
+    bench("values: value_guard push/pop with 512 keys", 1000000, 1,
+        [&]
+        {
+            tlcontext::value_guard inner{keys[0], std::size_t{42}};
+            do_not_optimize(*tlcontext::get_value(keys[0]));
+        });
+
+    bench("values: capture_values", 1000000, 1,
+        [&] { do_not_optimize(tlcontext::capture_values()); });
+}
+
+//
+//
+//
+// Deep nesting and high churn stress
+// ----------------------------------------------------------------------------
+
+// Context data of `N` bytes. Only the first byte is written on construction,
+// so that the cost measured is the one of the inline storage itself.
+template <std::size_t N>
+struct payload_ctx_data
+{
+    unsigned char bytes[N];
+
+    explicit payload_ctx_data(unsigned char x) noexcept
+    {
+        bytes[0] = x;
+    }
+};
+
+template <std::size_t N>
+using payload_ctx = tlcontext::helper<payload_ctx_data<N>>;
+
+struct stress_tag
+{};
+
+using stress_tag_ctx = tlcontext::helper<stress_tag>;
+
+// Pushes one guard of `payload_ctx<N>` per level, down to `depth`, and returns
+// the address of a local variable at the deepest level.
+template <std::size_t N>
+[[gnu::noinline]] static std::uintptr_t nest(std::size_t depth)
+{
+    typename payload_ctx<N>::local_guard lg{
+        static_cast<unsigned char>(depth)};
+
+    if(depth == 0)
+    {
+        unsigned char marker = 0;
+        do_not_optimize(&marker);
+
+        return reinterpret_cast<std::uintptr_t>(&marker);
+    }
+
+    const std::uintptr_t result = nest<N>(depth - 1);
+    do_not_optimize(payload_ctx<N>::get_local().bytes[0]);
+
+    return result;
+}
+
+// Like `nest`, but cycles through several context types of different sizes,
+// including a tag type.
+[[gnu::noinline]] static std::uintptr_t nest_mixed(std::size_t depth)
+{
+    if(depth == 0)
+    {
+        unsigned char marker = 0;
+        do_not_optimize(&marker);
+
+        return reinterpret_cast<std::uintptr_t>(&marker);
+    }
+
+    const auto x = static_cast<unsigned char>(depth);
+
+    switch(depth % 3)
+    {
+        case 0:
+        {
+            payload_ctx<8>::local_guard lg{x};
+            const std::uintptr_t result = nest_mixed(depth - 1);
+            do_not_optimize(payload_ctx<8>::get_local().bytes[0]);
+
+            return result;
+        }
+
+        case 1:
+        {
+            payload_ctx<64>::local_guard lg{x};
+            const std::uintptr_t result = nest_mixed(depth - 1);
+            do_not_optimize(payload_ctx<64>::get_local().bytes[0]);
+
+            return result;
+        }
+
+        default:
+        {
+            stress_tag_ctx::local_guard lg;
+            const std::uintptr_t result = nest_mixed(depth - 1);
+            do_not_optimize(stress_tag_ctx::is_active());
+
+            return result;
+        }
+    }
+}
+
+// Runs `f` on a new thread with a stack of `stack_bytes` bytes, aborting if
+// the thread cannot be created, as the results would be meaningless.
+template <typename F>
+static void run_with_stack(std::size_t stack_bytes, F& f)
+{
+    const auto check = [](int rc, const char* what)
+    {
+        if(rc != 0)
+        {
+            std::fprintf(stderr, "stress: %s failed: %s\n", what,
+                std::strerror(rc));
+
+            std::abort();
+        }
+    };
+
+    pthread_attr_t attr;
+    check(pthread_attr_init(&attr), "pthread_attr_init");
+    check(pthread_attr_setstacksize(&attr, stack_bytes),
+        "pthread_attr_setstacksize");
+
+    pthread_t thread;
+    check(pthread_create(
+              &thread, &attr,
+              [](void* p) -> void*
+              {
+                  (*static_cast<F*>(p))();
+                  return nullptr;
+              },
+              &f),
+        "pthread_create");
+
+    check(pthread_join(thread, nullptr), "pthread_join");
+    pthread_attr_destroy(&attr);
+}
+
+// Repeatedly nests `depth` guards via `nester` on `threads` concurrent
+// threads, and prints the time per push/pop pair and the stack usage per
+// level, which includes the recursive call frame.
+template <typename F>
+static void stress_nesting(const char* label, std::size_t depth,
+    std::size_t threads, std::size_t bytes_per_level, F nester)
+{
+    constexpr std::size_t repetitions = 20;
+
+    std::vector<double> ns_per_op(threads);
+    std::vector<double> stack_per_level(threads);
+
+    const auto worker = [&](std::size_t t)
+    {
+        auto body = [&]
+        {
+            unsigned char base = 0;
+            do_not_optimize(&base);
+
+            const std::uintptr_t deepest = nester(depth);
+            stack_per_level[t] =
+                static_cast<double>(reinterpret_cast<std::uintptr_t>(&base) -
+                                    deepest) /
+                static_cast<double>(depth);
+
+            const auto start = clock_type::now();
+
+            for(std::size_t i = 0; i < repetitions; ++i)
+            {
+                do_not_optimize(nester(depth));
+            }
+
+            const auto elapsed = clock_type::now() - start;
+            ns_per_op[t] =
+                std::chrono::duration<double, std::nano>(elapsed).count() /
+                static_cast<double>(repetitions * depth);
+        };
+
+        run_with_stack(depth * (bytes_per_level + 256) + (1u << 20), body);
+    };
+
+    std::vector<std::thread> pool;
+
+    for(std::size_t t = 0; t < threads; ++t)
+    {
+        pool.emplace_back(worker, t);
+    }
+
+    for(std::thread& th : pool)
+    {
+        th.join();
+    }
+
+    double avg_ns = 0;
+    double avg_stack = 0;
+
+    for(std::size_t t = 0; t < threads; ++t)
+    {
+        avg_ns += ns_per_op[t] / static_cast<double>(threads);
+        avg_stack += stack_per_level[t] / static_cast<double>(threads);
+    }
+
+    std::printf("stress: %-22s depth=%-6zu threads=%-3zu %8.3f ns/op %8.1f "
+                "B/guard\n",
+        label, depth, threads, avg_ns, avg_stack);
+}
+
+template <std::size_t N>
+static void stress_size(std::size_t depth, std::size_t threads)
+{
+    char label[32];
+    std::snprintf(label, sizeof(label), "sizeof(T)=%zu", N);
+
+    stress_nesting(label, depth, threads, N, &nest<N>);
+}
+
+static void bench_stress()
+{
+    const std::size_t max_threads =
+        std::max(4u, std::thread::hardware_concurrency());
+
+    for(const std::size_t threads : {std::size_t{1}, max_threads})
+    {
+        stress_size<8>(20000, threads);
+        stress_size<64>(20000, threads);
+        stress_size<512>(20000, threads);
+        stress_size<4096>(20000, threads);
+        stress_size<16384>(5000, threads);
+
+        stress_nesting("mixed 8/64/tag", 30000, threads, 64, &nest_mixed);
+    }
+}
+
+//
+//
+//
+// Small-object pool resources
+// ----------------------------------------------------------------------------
+
+using tlcontext::pmr_context;
+
+// Allocates and frees batches of small blocks through the resource on top of
+// `pmr_context`, on `threads` concurrent threads. If `cross_thread` is set,
+// every thread keeps all its blocks, and frees the ones of the next thread.
+static void churn_pool(const char* label, std::pmr::memory_resource& mr,
+    std::size_t threads, bool cross_thread)
+{
+    constexpr std::size_t batch = 256;
+    constexpr std::size_t rounds = 200;
+
+    const auto block_size = [](std::size_t i) { return 16 + (i % 8) * 16; };
+
+    pmr_context::global_guard gg{&mr};
+
+    std::vector<std::vector<void*>> blocks(
+        threads, std::vector<void*>(batch * rounds));
+
+    std::vector<std::thread> pool;
+    std::atomic<std::size_t> ready{0};
+
+    const auto start = clock_type::now();
+
+    for(std::size_t t = 0; t < threads; ++t)
+    {
+        pool.emplace_back(
+            [&, t]
+            {
+                std::pmr::memory_resource* const r = pmr_context::get_top()._mr;
+                std::vector<void*>& own = blocks[t];
+
+                for(std::size_t i = 0; i < own.size(); ++i)
+                {
+                    own[i] = r->allocate(block_size(i));
+
+                    if(!cross_thread && i % batch == batch - 1)
+                    {
+                        for(std::size_t j = i + 1 - batch; j <= i; ++j)
+                        {
+                            r->deallocate(own[j], block_size(j));
+                        }
+                    }
+                }
+
+                if(!cross_thread)
+                {
+                    return;
+                }
+
+                ++ready;
+                while(ready.load() != threads)
+                {
+                    std::this_thread::yield();
+                }
+
+                const std::vector<void*>& other = blocks[(t + 1) % threads];
+
+                for(std::size_t i = 0; i < other.size(); ++i)
+                {
+                    r->deallocate(other[i], block_size(i));
+                }
+            });
+    }
+
+    for(std::thread& th : pool)
+    {
+        th.join();
+    }
+
+    const auto elapsed = clock_type::now() - start;
+    const double ns =
+        std::chrono::duration<double, std::nano>(elapsed).count() /
+        static_cast<double>(threads * rounds * batch);
+
+    std::printf("%-48s %10.3f ns/op\n", label, ns);
+}
+
+static void bench_pools()
+{
+    const std::size_t threads =
+        std::max(4u, std::thread::hardware_concurrency());
+
+    {
+        std::pmr::synchronized_pool_resource mr;
+        churn_pool("pools: synchronized_pool_resource", mr, threads, false);
+    }
+
+    {
+        tlcontext::sharded_pool_resource mr;
+        churn_pool("pools: sharded_pool_resource", mr, threads, false);
+    }
+
+    {
+        std::pmr::synchronized_pool_resource mr;
+        churn_pool("pools: synchronized_pool_resource (remote)", mr, threads,
+            true);
+    }
+
+    {
+        tlcontext::sharded_pool_resource mr;
+        churn_pool("pools: sharded_pool_resource (remote)", mr, threads, true);
+    }
+}
+
+//
+//
+//
+// Context-backed default resource
+// ----------------------------------------------------------------------------
+
+static void bench_default_resource()
+{
+    std::pmr::unsynchronized_pool_resource pool;
+    tlcontext::context_default_resource forwarder{&pool};
+
+    std::size_t bytes = 32;
+
+    bench("default resource: pool, direct", 1000000, 1,
+        [&]
+        {
+            clobber(bytes);
+            void* const p = pool.allocate(bytes);
+            do_not_optimize(p);
+            pool.deallocate(p, bytes);
+        });
+
+    bench("default resource: pool, fallback", 1000000, 1,
+        [&]
+        {
+            clobber(bytes);
+            void* const p = forwarder.allocate(bytes);
+            do_not_optimize(p);
+            forwarder.deallocate(p, bytes);
+        });
+
+    pmr_context::local_guard lg{&pool};
+
+    bench("default resource: pool, via pmr_context", 1000000, 1,
+        [&]
+        {
+            clobber(bytes);
+            void* const p = forwarder.allocate(bytes);
+            do_not_optimize(p);
+            forwarder.deallocate(p, bytes);
+        });
+}
+
+//
+//
+//
+// Priority scheduler tail latency
+// ----------------------------------------------------------------------------
+
+static void spin_for(std::chrono::nanoseconds duration)
+{
+    const auto end = clock_type::now() + duration;
+
+    while(clock_type::now() < end)
+    {
+    }
+}
+
+// Keeps the scheduler saturated with batch tasks while periodically submitting
+// short interactive tasks, and prints percentiles of the time interactive
+// tasks wait before starting. If `prioritize` is not set, interactive tasks
+// are submitted at the batch level, as with a single FIFO queue.
+static void latency_mix(const char* label, bool prioritize)
+{
+    using namespace std::chrono_literals;
+
+    constexpr std::size_t samples = 1000;
+    constexpr std::size_t max_outstanding_batch = 256;
+
+    std::vector<double> latencies_us(samples);
+    std::atomic<std::size_t> outstanding_batch{0};
+    std::atomic<std::size_t> completed_samples{0};
+    std::atomic<bool> done{false};
+
+    {
+        tlcontext::priority_scheduler scheduler{2, 4};
+
+        std::thread feeder{[&]
+            {
+                tlcontext::priority_context::local_guard lg{std::size_t{1}};
+
+                while(!done.load())
+                {
+                    if(outstanding_batch.load() >= max_outstanding_batch)
+                    {
+                        std::this_thread::yield();
+                        continue;
+                    }
+
+                    ++outstanding_batch;
+
+                    scheduler.submit(
+                        [&]
+                        {
+                            spin_for(20us);
+                            --outstanding_batch;
+                        });
+                }
+            }};
+
+        tlcontext::priority_context::local_guard lg{
+            std::size_t{prioritize ? 0u : 1u}};
+
+        for(std::size_t i = 0; i < samples; ++i)
+        {
+            const auto submitted = clock_type::now();
+
+            scheduler.submit(
+                [&, i, submitted]
+                {
+                    const auto waited = clock_type::now() - submitted;
+
+                    latencies_us[i] =
+                        std::chrono::duration<double, std::micro>(waited)
+                            .count();
+
+                    ++completed_samples;
+                });
+
+            spin_for(200us);
+        }
+
+        while(completed_samples.load() != samples)
+        {
+            std::this_thread::yield();
+        }
+
+        done = true;
+        feeder.join();
+    }
+
+    std::sort(latencies_us.begin(), latencies_us.end());
+
+    const auto percentile = [&](double p)
+    { return latencies_us[static_cast<std::size_t>(p * (samples - 1))]; };
+
+    std::printf("%-36s p50 %9.1f us  p99 %9.1f us  p99.9 %9.1f us\n", label,
+        percentile(0.5), percentile(0.99), percentile(0.999));
+}
+
+static void bench_scheduler()
+{
+    latency_mix("scheduler: interactive as batch", false);
+    latency_mix("scheduler: interactive prioritized", true);
+}
+
+//
+//
+//
+// Batched file I/O throughput
+// ----------------------------------------------------------------------------
+
+// Reads `reads` random 512-byte blocks of a 2 MiB file (in the page cache) per
+// iteration, either with one `pread` each or through an `io_batch`.
+static void bench_io()
+{
+    constexpr std::size_t block = 512;
+    constexpr std::size_t blocks = 4096;
+    constexpr std::size_t reads = 256;
+
+    std::FILE* const file = std::tmpfile();
+    const int fd = fileno(file);
+
+    std::vector<char> data(block * blocks, 'x');
+    if(::pwrite(fd, data.data(), data.size(), 0) !=
+        static_cast<ssize_t>(data.size()))
+    {
+        std::printf("io: failed to create the test file\n");
+        return;
+    }
+
+    std::mt19937_64 rng{42};
+    std::vector<std::int64_t> offsets(reads);
+
+    for(std::int64_t& offset : offsets)
+    {
+        offset = static_cast<std::int64_t>(rng() % blocks * block);
+    }
+
+    std::vector<char> buffers(block * reads);
+
+    bench("io: pread per block", 200, reads,
+        [&]
+        {
+            for(std::size_t i = 0; i < reads; ++i)
+            {
+                const ssize_t n = ::pread(
+                    fd, buffers.data() + i * block, block, offsets[i]);
+
+                do_not_optimize(n);
+            }
+        });
+
+    const auto batched = [&](tlcontext::io_backend backend)
+    {
+        tlcontext::io_context::local_guard lg{backend};
+        std::int64_t total = 0;
+
+        for(std::size_t i = 0; i < reads; ++i)
+        {
+            tlcontext::io_context::get_top().read(fd,
+                buffers.data() + i * block, block, offsets[i],
+                [&](std::int64_t n) { total += n; });
+        }
+
+        tlcontext::io_context::get_top().flush();
+        do_not_optimize(total);
+    };
+
+    if(tlcontext::io_batch{}.backend() == tlcontext::io_backend::uring)
+    {
+        bench("io: io_batch, io_uring", 200, reads,
+            [&] { batched(tlcontext::io_backend::uring); });
+    }
+    else
+    {
+        std::printf("io: io_uring unavailable\n");
+    }
+
+    bench("io: io_batch, thread pool", 200, reads,
+        [&] { batched(tlcontext::io_backend::thread_pool); });
+
+    std::fclose(file);
+}
+
+//
+//
+//
+// Buffered output
+// ----------------------------------------------------------------------------
+
+// Writes metrics-style report lines to `/dev/null`, through an unbuffered
+// stream with a temporary indentation string per line as the original
+// `metrics_guard`, or through an `output_sink`.
+static void bench_output()
+{
+    constexpr std::size_t lines = 1024;
+    const std::string_view label = "simulation step";
+
+    std::ofstream stream{"/dev/null"};
+    stream.rdbuf()->pubsetbuf(nullptr, 0);
+
+    bench("output: unbuffered ostream + std::string", 100, lines,
+        [&]
+        {
+            for(std::size_t i = 0; i < lines; ++i)
+            {
+                stream << std::string((i % 4) * 4, '-') << " " << label
+                       << " took " << i << "us\n";
+            }
+        });
+
+    const int fd = ::open("/dev/null", O_WRONLY);
+
+    bench("output: output_sink", 100, lines,
+        [&]
+        {
+            tlcontext::output_context::local_guard og{fd};
+            tlcontext::output_sink& sink = tlcontext::output_context::get_top();
+
+            for(std::size_t i = 0; i < lines; ++i)
+            {
+                sink.append('-', (i % 4) * 4)
+                    .append(' ')
+                    .append(label)
+                    .append(" took ")
+                    .append(i)
+                    .append("us\n");
+            }
+        });
+
+    ::close(fd);
+}
+
+//
+//
+//
+// Allocation hook
+// ----------------------------------------------------------------------------
+
+static void bench_alloc_hook()
+{
+    bench("alloc: malloc + free", 10000000, 1,
+        []
+        {
+            void* const p = std::malloc(32);
+            do_not_optimize(p);
+            std::free(p);
+        });
+
+    bench("alloc: hooked operator new + delete", 10000000, 1,
+        []
+        {
+            void* const p = ::operator new(32);
+            do_not_optimize(p);
+            ::operator delete(p);
+        });
+}
+
+//
+//
+//
+// Clocks
+// ----------------------------------------------------------------------------
+
+template <typename Clock>
+static void bench_now(const char* label)
+{
+    bench(label, 10000000, 1,
+        []
+        {
+            const typename Clock::time_point tp = Clock::now();
+            do_not_optimize(tp);
+        });
+}
+
+static void bench_clocks()
+{
+    using tlcontext::context_clock;
+
+    bench_now<clock_type>("clock: steady_clock");
+    bench_now<context_clock>("clock: context_clock, no context");
+
+    {
+        tlcontext::coarse_clock_guard cg;
+        bench_now<context_clock>("clock: context_clock, coarse");
+    }
+
+    {
+        tlcontext::cached_clock_guard cg;
+        bench_now<context_clock>("clock: context_clock, cached");
+    }
+
+    {
+        tlcontext::clock_ticker ticker;
+        tlcontext::clock_context::global_guard gg{ticker.source()};
+        bench_now<context_clock>("clock: context_clock, ticker");
+    }
+}
+
+//
+//
+//
+// Staged pipeline throughput
+// ----------------------------------------------------------------------------
+
+// Work of one stage on one item.
+[[gnu::always_inline]] inline void stage_work(double& x) noexcept
+{
+    for(int i = 0; i < 8; ++i)
+    {
+        x = std::sqrt(x * x + 1.0);
+    }
+}
+
+// Runs a chain of 4 stages over 64K items, serially and through pipelines
+// with an increasing number of workers, and prints the time per item.
+static void bench_pipeline()
+{
+    constexpr std::size_t items = 65536;
+    constexpr std::size_t batch_size = 256;
+    constexpr std::size_t stages = 4;
+
+    std::vector<double> data(items, 1.0);
+
+    bench("pipeline: serial, 4 stages", 20, items,
+        [&]
+        {
+            for(std::size_t s = 0; s < stages; ++s)
+            {
+                for(double& x : data)
+                {
+                    stage_work(x);
+                }
+            }
+
+            clobber(data);
+        });
+
+    const std::size_t max_workers =
+        std::max(4u, std::thread::hardware_concurrency());
+
+    for(std::size_t workers = 1; workers <= max_workers; workers *= 2)
+    {
+        tlcontext::pipeline<double> engine{workers};
+        std::size_t previous = 0;
+
+        for(std::size_t s = 0; s < stages; ++s)
+        {
+            const auto body = [](std::span<double> batch)
+            {
+                for(double& x : batch)
+                {
+                    stage_work(x);
+                }
+            };
+
+            previous = s == 0 ? engine.add_stage("stage", body)
+                              : engine.add_stage("stage", body, {previous});
+        }
+
+        char label[64];
+        std::snprintf(label, sizeof(label), "pipeline: %zu workers + caller",
+            workers);
+
+        bench(label, 20, items, [&] { engine.run(data, batch_size); });
+    }
+}
+
+//
+//
+//
+// Autotuning overhead
+// ----------------------------------------------------------------------------
+
+static void bench_autotune()
+{
+    tlcontext::autotune_context::global_guard tuner;
+
+    bench("autotune: tune scope", 1000000, 1,
+        []
+        {
+            const auto batch = tlcontext::tune("batch", {64, 256, 1024});
+            do_not_optimize(batch.value());
+        });
+
+    tlcontext::cached_clock_guard cg;
+
+    bench("autotune: tune scope, cached clock", 1000000, 1,
+        []
+        {
+            const auto batch = tlcontext::tune("batch", {64, 256, 1024});
+            do_not_optimize(batch.value());
+        });
+}
+
+//
+//
+//
+// Shared-memory metrics
+// ----------------------------------------------------------------------------
+
+// Compares a shared-memory update with an equivalent relaxed `fetch_add` on a
+// shared counter, as a process-local metrics registry would do.
+static void bench_shm_metrics()
+{
+    using namespace std::chrono_literals;
+
+    std::atomic<std::uint64_t> counter{0};
+
+    bench("metrics: shared fetch_add", 10000000, 1,
+        [&] { counter.fetch_add(1, std::memory_order_relaxed); });
+
+    const std::string name =
+        "/tlcontext_bench_" + std::to_string(static_cast<long>(::getpid()));
+
+    tlcontext::shm_metrics_context::global_guard mg{name};
+
+    bench("metrics: shm record", 10000000, 1,
+        [] { tlcontext::shm_metrics_context::get_top().record("step", 1us); });
+}
+
+//
+//
+//
+// Coroutine frame allocation
+// ----------------------------------------------------------------------------
+
+struct global_new_promise_base
+{
+};
+
+// Eagerly started coroutine producing a value, whose promise derives from
+// `Base` to select the frame allocation strategy.
+template <typename Base>
+class bench_task
+{
+public:
+    struct promise_type : Base
+    {
+        std::size_t value;
+
+        bench_task get_return_object() noexcept
+        {
+            return bench_task{
+                std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_always final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_value(std::size_t x) noexcept
+        {
+            value = x;
+        }
+
+        void unhandled_exception() noexcept
+        {
+            std::terminate();
+        }
+    };
+
+private:
+    std::coroutine_handle<promise_type> _handle;
+
+    explicit bench_task(std::coroutine_handle<promise_type> handle) noexcept
+        : _handle{handle}
+    {}
+
+public:
+    bench_task(bench_task&& rhs) noexcept
+        : _handle{std::exchange(rhs._handle, nullptr)}
+    {}
+
+    ~bench_task()
+    {
+        _handle.destroy();
+    }
+
+    [[nodiscard]] std::size_t get() const noexcept
+    {
+        return _handle.promise().value;
+    }
+};
+
+template <typename Base>
+[[gnu::noinline]] static bench_task<Base> chain(std::size_t depth)
+{
+    if(depth == 0)
+    {
+        co_return 0;
+    }
+
+    co_return chain<Base>(depth - 1).get() + 1;
+}
+
+// Runs a chain of 64 nested coroutines, with frames from the global
+// `operator new`, from the per-thread frame cache, and from a pool resource
+// pushed as `pmr_context`.
+static void bench_coroutines()
+{
+    constexpr std::size_t depth = 64;
+
+    bench("coroutines: operator new frames", 100000, depth + 1,
+        [] { do_not_optimize(chain<global_new_promise_base>(depth).get()); });
+
+    bench("coroutines: frame cache", 100000, depth + 1,
+        []
+        {
+            do_not_optimize(
+                chain<tlcontext::context_promise_base>(depth).get());
+        });
+
+    std::pmr::unsynchronized_pool_resource pool;
+    tlcontext::pmr_context::local_guard pg{&pool};
+
+    bench("coroutines: pmr_context pool frames", 100000, depth + 1,
+        []
+        {
+            do_not_optimize(
+                chain<tlcontext::context_promise_base>(depth).get());
+        });
+}
+
+//
+//
+//
+// Thread creation
+// ----------------------------------------------------------------------------
+
+template <std::size_t I, bool TCold>
+struct spawn_ctx_data
+{
+    std::size_t value;
+};
+
+template <std::size_t I>
+inline constexpr bool tlcontext::cold_context<spawn_ctx_data<I, true>> = true;
+
+// Pushes one local context of each of `N` types of the given temperature.
+template <bool TCold, std::size_t... Is>
+static void push_spawn_contexts(std::index_sequence<Is...>)
+{
+    [[maybe_unused]] const auto push = []<std::size_t I>()
+    {
+        using ctx = tlcontext::helper<spawn_ctx_data<I, TCold>>;
+
+        typename ctx::local_guard g{I};
+        do_not_optimize(ctx::get_local().value);
+    };
+
+    (push.template operator()<Is>(), ...);
+}
+
+// Measures spawning and joining a thread that pushes no context, or one
+// context of each of 16 hot or cold types. Hot types add one pointer of static
+// TLS each, or use the `TLCONTEXT_MAX_TYPES` slots of the flat array with
+// `TLCONTEXT_SLOT_ARRAY`. Cold types add no static TLS, but allocate an
+// overflow table on the first push of each thread.
+static void bench_thread_creation()
+{
+    constexpr auto types = std::make_index_sequence<16>{};
+
+#if defined(TLCONTEXT_SLOT_ARRAY) && !defined(TLCONTEXT_SHARED)
+    std::printf("%-48s %10zu bytes\n", "threads: static TLS of local slots",
+        sizeof(tlcontext::impl::local_slots) +
+            sizeof(tlcontext::impl::local_cold_slots));
+#endif
+
+    bench("threads: spawn + join", 2000, 1, [] { std::thread{[] {}}.join(); });
+
+    bench("threads: spawn + join, 16 hot pushes", 2000, 1,
+        [&]
+        {
+            std::thread{[&] { push_spawn_contexts<false>(types); }}.join();
+        });
+
+    bench("threads: spawn + join, 16 cold pushes", 2000, 1,
+        [&] { std::thread{[&] { push_spawn_contexts<true>(types); }}.join(); });
+}
+
+//
+//
+//
+// Entry point
+// ----------------------------------------------------------------------------
+
+int main()
+{
+    bench_access();
+    bench_dispatch();
+    bench_strategy();
+    bench_overlay();
+    bench_values();
+    bench_pools();
+    bench_default_resource();
+    bench_scheduler();
+    bench_io();
+    bench_output();
+    bench_alloc_hook();
+    bench_clocks();
+    bench_pipeline();
+    bench_autotune();
+    bench_shm_metrics();
+    bench_coroutines();
+    bench_thread_creation();
+    bench_stress();
+}
@@ -0,0 +1,227 @@
+// Copyright (c) 2023-2023 Vittorio Romeo
+// License: Academic Free License ("AFL") v. 3.0
+// AFL License page: https://opensource.org/licenses/AFL-3.0
+
+// Multi-binary test for `TLCONTEXT_SHARED`. The same file is built twice: once
+// as a plugin with hidden visibility and `-Bsymbolic`, and once as the owning
+// executable that loads it, e.g.:
+//
+//     g++ -std=c++20 -O2 -fPIC -shared -fvisibility=hidden -Wl,-Bsymbolic
+//         -DTLCONTEXT_SHARED -DTLCONTEXT_SHARED_PLUGIN
+//         tlcontext_shared.cpp -o tlcontext_shared_plugin.so
+//
+//     g++ -std=c++20 -O2 -fvisibility=hidden -rdynamic -pthread
+//         -DTLCONTEXT_SHARED_OWNER tlcontext_shared.cpp
+//         -o tlcontext_shared -ldl
+//
+//     ./tlcontext_shared ./tlcontext_shared_plugin.so
+
+#define TLCONTEXT_DEBUG 1
+#include "tlcontext.hpp"
+
+// Set up assertions.
+// #define NDEBUG 1
+#include <cassert>
+
+// Set up context data classes, shared by both binaries.
+struct int_ctx_data
+{
+    int value;
+};
+
+struct pair_ctx_data
+{
+    int value;
+};
+
+using int_ctx = tlcontext::helper<int_ctx_data>;
+using pair_ctx = tlcontext::helper<pair_ctx_data>;
+
+// Context type with the same name in both binaries, but internal linkage, so
+// each binary has its own.
+namespace {
+
+struct local_ctx_data
+{
+    int value;
+};
+
+using local_ctx = tlcontext::helper<local_ctx_data>;
+
+} // namespace
+
+#ifdef TLCONTEXT_SHARED_PLUGIN
+
+//
+//
+//
+// Plugin
+// ----------------------------------------------------------------------------
+
+extern "C" {
+
+[[gnu::visibility("default")]] int plugin_get_top()
+{
+    return int_ctx::get_top().value;
+}
+
+[[gnu::visibility("default")]] int plugin_get_local()
+{
+    return int_ctx::get_local().value;
+}
+
+[[gnu::visibility("default")]] bool plugin_local_is_active()
+{
+    return local_ctx::is_active();
+}
+
+// Pushes a local context in the plugin, and invokes `f` under it.
+[[gnu::visibility("default")]] int plugin_push_and_call(int value, int (*f)())
+{
+    int_ctx::local_guard lg{value};
+    pair_ctx::local_guard lg2{value * 2};
+
+    return f();
+}
+}
+
+#else
+
+//
+//
+//
+// Owner executable
+// ----------------------------------------------------------------------------
+
+#include <dlfcn.h>
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+template <typename T>
+static T load(void* handle, const char* name)
+{
+    void* const symbol = dlsym(handle, name);
+    assert(symbol != nullptr);
+
+    return reinterpret_cast<T>(symbol);
+}
+
+static int owner_get_local()
+{
+    return int_ctx::get_local().value;
+}
+
+// Checks that a snapshot of contexts pushed by the plugin can be restored on
+// another thread of the owner.
+static int owner_propagate()
+{
+    const tlcontext::context_snapshot snapshot = tlcontext::capture_all();
+
+    int result = 0;
+
+    std::thread t{[&]
+        {
+            tlcontext::snapshot_guard sg{snapshot};
+            result = int_ctx::get_local().value + pair_ctx::get_local().value;
+        }};
+
+    t.join();
+
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    const char* const path =
+        argc > 1 ? argv[1] : "./tlcontext_shared_plugin.so";
+
+    void* const handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+
+    if(handle == nullptr)
+    {
+        std::printf("failed to load plugin: %s\n", dlerror());
+        return 1;
+    }
+
+    const auto get_top = load<int (*)()>(handle, "plugin_get_top");
+    const auto get_local = load<int (*)()>(handle, "plugin_get_local");
+
+    const auto push_and_call =
+        load<int (*)(int, int (*)())>(handle, "plugin_push_and_call");
+
+    // Types in anonymous namespaces are distinct in every binary.
+    const auto local_is_active =
+        load<bool (*)()>(handle, "plugin_local_is_active");
+
+    {
+        local_ctx::local_guard lg{8};
+        assert(local_ctx::is_active());
+        assert(!local_is_active());
+    }
+
+    // Global guards pushed by the owner are visible in the plugin.
+    int_ctx::global_guard gg{1};
+    assert(get_top() == 1);
+
+    // Local guards pushed by the owner are visible in the plugin.
+    {
+        int_ctx::local_guard lg{2};
+        assert(get_local() == 2);
+        assert(get_top() == 2);
+    }
+
+    assert(get_top() == 1);
+
+    // Local guards pushed by the plugin are visible in the owner.
+    assert(push_and_call(3, &owner_get_local) == 3);
+    assert(get_top() == 1);
+
+    // Every thread resolves its own slots.
+    std::thread t{[&]
+        {
+            assert(get_top() == 1);
+
+            int_ctx::local_guard lg{4};
+            assert(get_local() == 4);
+            assert(push_and_call(5, get_local) == 5);
+            assert(get_local() == 4);
+        }};
+
+    t.join();
+
+    // Contexts pushed by the plugin propagate through snapshots.
+    assert(push_and_call(7, &owner_propagate) == 7 + 14);
+
+    // Compare the access cost in the owner and in the plugin.
+    int_ctx::local_guard lg{6};
+
+    const auto time_per_call = [](int (*f)())
+    {
+        constexpr int iterations = 10000000;
+
+        const auto start = std::chrono::steady_clock::now();
+
+        int acc = 0;
+        for(int i = 0; i < iterations; ++i)
+        {
+            acc += f();
+        }
+
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        assert(acc == 6 * iterations);
+
+        return std::chrono::duration<double, std::nano>(elapsed).count() /
+               iterations;
+    };
+
+    std::printf("owner get_local:  %.3f ns/op\n",
+        time_per_call(owner_get_local));
+
+    std::printf("plugin get_local: %.3f ns/op\n", time_per_call(get_local));
+
+    dlclose(handle);
+}
+
+#endif
@@ -0,0 +1,114 @@
+// Copyright (c) 2023-2023 Vittorio Romeo
+// License: Academic Free License ("AFL") v. 3.0
+// AFL License page: https://opensource.org/licenses/AFL-3.0
+
+// Live view of the metrics a process publishes through `shm_metrics_context`,
+// refreshed every second and sorted by rate, e.g.:
+//
+//     g++ -std=c++20 -O2 -pthread tlcontext_top.cpp -o tlcontext_top
+//
+//     ./tlcontext_top /my_metrics_region
+//     ./tlcontext_top /my_metrics_region --once
+
+#define TLCONTEXT_IO 1
+#include "tlcontext.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct row
+{
+    tlcontext::shm_metrics_entry entry;
+    double rate;
+};
+
+// Prints one frame, computing rates from the counts of the previous one.
+static void print_frame(const tlcontext::shm_metrics_reader& reader,
+    std::unordered_map<std::string, std::uint64_t>& previous,
+    double seconds, bool clear)
+{
+    std::vector<row> rows;
+
+    for(tlcontext::shm_metrics_entry& e : reader.read())
+    {
+        const std::uint64_t before = previous[e.label];
+        const double rate = seconds > 0.0
+                                ? static_cast<double>(e.count - before) /
+                                      seconds
+                                : 0.0;
+
+        previous[e.label] = e.count;
+        rows.push_back({std::move(e), rate});
+    }
+
+    std::sort(rows.begin(), rows.end(),
+        [](const row& a, const row& b) { return a.rate > b.rate; });
+
+    if(clear)
+    {
+        std::printf("\033[H\033[2J");
+    }
+
+    std::printf("pid %llu, %llu dropped updates\n\n",
+        static_cast<unsigned long long>(reader.pid()),
+        static_cast<unsigned long long>(reader.dropped()));
+
+    std::printf("%-36s %12s %10s %12s %12s\n", "label", "count", "rate/s",
+        "mean us", "max us");
+
+    for(const row& r : rows)
+    {
+        const tlcontext::shm_metrics_entry& e = r.entry;
+
+        std::printf("%-36s %12llu %10.1f %12.3f %12.3f\n", e.label.c_str(),
+            static_cast<unsigned long long>(e.count), r.rate,
+            static_cast<double>(e.total_ns) /
+                static_cast<double>(e.count) / 1000.0,
+            static_cast<double>(e.max_ns) / 1000.0);
+    }
+
+    std::fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 2)
+    {
+        std::printf("usage: %s <region name> [--once]\n", argv[0]);
+        return 1;
+    }
+
+    const bool once = argc > 2 && std::strcmp(argv[2], "--once") == 0;
+
+    const tlcontext::shm_metrics_reader reader{argv[1]};
+
+    if(!reader.valid())
+    {
+        std::printf("no compatible metrics region named '%s'\n", argv[1]);
+        return 1;
+    }
+
+    std::unordered_map<std::string, std::uint64_t> previous;
+    auto last = std::chrono::steady_clock::now();
+
+    // The first frame has no rates, as there is no previous sample.
+    print_frame(reader, previous, 0.0, !once);
+
+    while(!once)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds{1});
+
+        const auto now = std::chrono::steady_clock::now();
+        const std::chrono::duration<double> elapsed = now - last;
+        last = now;
+
+        print_frame(reader, previous, elapsed.count(), true /* clear */);
+    }
+}